@@ -12,12 +12,15 @@ import errno
 import sys
 import os
 import getopt
+import json
 
 class MPM:
   def __init__(self, snapshot_interval=20, **kwargs):
     res = kwargs['res']
 ## -----------------------------------------------------------------------------
     self.Snapshots = kwargs.get('snapshots', False)
+    # Snapshots as raw particle pool checkpoints (.mpmc) instead of .tcb
+    self.fast_snapshots = kwargs.get('fast_snapshots', False)
 ## -----------------------------------------------------------------------------
     self.frame_dt = kwargs.get('frame_dt', 0.01)
     if 'frame_dt' not in kwargs:
@@ -243,9 +246,10 @@ class MPM:
     # do restart
     if self.continue_opt:
       path = self.snapshot_directory
-      files = [f for f in os.listdir(path) if f.endswith('.tcb')]
+      extension = self.get_snapshot_extension()
+      files = [f for f in os.listdir(path) if f.endswith(extension)]
       files.sort()
-      if not '{:04d}.tcb'.format(self.continue_frame) in files:
+      if not '{:04d}{}'.format(self.continue_frame, extension) in files:
         print('Snapshot is not found.')
         print('The lastest one is ', files[-1], '.')
         sys.exit()
@@ -292,10 +296,28 @@ class MPM:
   def general_action(self, **kwargs):
     return self.c.general_action(P(**kwargs))
 
+  # Stage timings and counts (needs metrics=True or metrics_file=...), of the
+  # last 'substep', the last 'frame' or the 'total' since the start
+  def get_metrics(self, scope='substep'):
+    return json.loads(self.general_action(action='metrics', scope=scope))
+
+  # Hardware counters and derived metrics (ipc, bytes_per_particle...) per
+  # stage since the start (needs perf_counters=True)
+  def get_perf_counters(self):
+    return json.loads(self.general_action(action='perf_counters'))
+
   def add_articulation(self, **kwargs):
     kwargs['action'] = 'add_articulation'
     self.c.general_action(P(**kwargs))
 
+  # Prescribed grid velocity in a box, half_space or cylinder, e.g.
+  # add_dirichlet_region(type='cylinder', center=(0.5, 0.5, 0.5),
+  #     axis=(1, 0, 0), radius=0.1, angular_velocity=10)
+  # (see dirichlet_region.h)
+  def add_dirichlet_region(self, **kwargs):
+    kwargs['action'] = 'add_dirichlet_region'
+    self.c.general_action(P(**kwargs))
+
   def delete_particles_inside_level_set(self):
     self.update_levelset(self.c.get_current_time(), self.c.get_current_time()+1)
     self.c.general_action(P(action='delete_particles_inside_level_set'))
@@ -304,14 +326,24 @@ class MPM:
     self.c.general_action(P(**kwargs))
 
   def save(self, fn):
-    self.action(action="save", file_name=fn)
+    if fn.endswith('.mpmc'):
+      self.action(action="save_checkpoint", file_name=fn)
+    else:
+      self.action(action="save", file_name=fn)
 
   def load(self, fn):
     script_dict = {}
     for i, func in enumerate(function_addresses):
       script_dict['script{:05d}'.format(i)] = func
     print(script_dict)
-    self.action(action="load", file_name=fn, **script_dict)
+    if fn.endswith('.mpmc'):
+      self.action(action="load_checkpoint", file_name=fn, **script_dict)
+    else:
+      self.action(action="load", file_name=fn, **script_dict)
+
+  def get_snapshot_extension(self):
+    return '.mpmc' if self.fast_snapshots else '.tcb'
 
   def get_snapshot_file_name(self, iteration):
-    return os.path.join(self.snapshot_directory, '{:04d}.tcb'.format(iteration))
+    return os.path.join(self.snapshot_directory,
+                        '{:04d}{}'.format(iteration, self.get_snapshot_extension()))
@@ -0,0 +1,78 @@
+## Frame output: .txt / .csv / .bgeo writers vs. the binary frames (.mpmf, .mpmz)
+
+# $ python3 benchmark_output.py [--sizes 1,8] [--directory /tmp]
+# Cubes of sand with the given numbers of particles (millions, 4 ppc) and a
+# plate (the .csv dataset needs a rigid body), as in excav.py; each writer is
+# timed on the same particles.
+
+import os
+import sys
+import taichi as tc
+
+
+def benchmark(millions, directory, r=512):
+    side = round((millions * 1e6 / 4) ** (1 / 3))  # cells, 4 * side^3 particles
+
+    mpm = tc.dynamics.MPM(
+        res=(r, r, r),
+        base_delta_t=1e-4,
+        num_threads=-1,
+        gravity=(0, -9.81, 0),
+        particle_gravity=True,
+        rigidBody_gravity=False,
+        clean_boundary=False,
+        write_particle=False,
+        write_rigid_body=False,
+        write_partio=False,
+        write_dataset=False,
+    )
+
+    tex = tc.Texture(
+        'mesh',
+        scale=(side/r, side/r, side/r),
+        translate=(0.5, 0.5, 0.5),
+        resolution=(2*r, 2*r, 2*r),
+        mesh_accuracy=3,
+        filename='projects/mpm/data/cube_smooth.obj',
+    ) * 4
+
+    mpm.add_particles(
+        type='sand',
+        pd=True,
+        density_tex=tex.id,
+        density=2583,
+    )
+
+    mpm.add_particles(
+        type='rigid',
+        density=1e5,
+        scale=(0.1, 0.1, 0.01),
+        friction=0.3,
+        scripted_position=tc.constant_function13(tc.Vector(0.5, 0.5 + side/r, 0.5)),
+        scripted_rotation=tc.constant_function13(tc.Vector(0, 0, 0)),
+        codimensional=False,
+        mesh_fn='projects/mpm/data/cube_smooth.obj',
+    )
+
+    times = mpm.general_action(action='benchmark_output', iterations=3,
+                               directory=directory).split()
+    particle, dataset, frame, partio, compressed = map(float, times[:5])
+    frame_size, partio_size, compressed_size = map(int, times[5:])
+    print('{:5.1f}M particles: .txt {:6.2f} s, .csv {:6.2f} s, '
+          '.mpmf {:6.3f} s ({:.0f}x)'.format(
+              4 * side ** 3 / 1e6, particle, dataset, frame,
+              particle / max(frame, 1e-9)))
+    print('    .bgeo {:6.2f} s {:8.1f} MB, .mpmf {:8.1f} MB, '
+          '.mpmz {:6.2f} s {:8.1f} MB ({:.1f}x smaller than .bgeo)'.format(
+              partio, partio_size / 1e6, frame_size / 1e6, compressed,
+              compressed_size / 1e6, partio_size / max(compressed_size, 1)))
+
+if __name__ == '__main__':
+    sizes = [1, 8]
+    directory = '/tmp'
+    if '--sizes' in sys.argv:
+        sizes = [float(s) for s in sys.argv[sys.argv.index('--sizes') + 1].split(',')]
+    if '--directory' in sys.argv:
+        directory = sys.argv[sys.argv.index('--directory') + 1]
+    for millions in sizes:
+        benchmark(millions, os.path.abspath(directory))
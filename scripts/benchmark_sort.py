@@ -0,0 +1,62 @@
+## Full vs. incremental particle sort
+
+# $ python3 benchmark_sort.py [--sizes 1,8,16,32,64]
+# Cubes of sand with the given numbers of particles (millions, 4 ppc);
+# particles are moved by up to 0.1 dx, as in a substep, and the two sorts are
+# timed on the same keys. The cost per particle should stay flat with size,
+# including past the old 2^25 particle limit of the sort key.
+
+import sys
+import taichi as tc
+
+
+def benchmark(millions, r=512):
+    side = round((millions * 1e6 / 4) ** (1 / 3))  # cells, 4 * side^3 particles
+
+    mpm = tc.dynamics.MPM(
+        res=(r, r, r),
+        base_delta_t=1e-4,
+        num_threads=-1,
+        gravity=(0, -9.81, 0),
+        particle_gravity=True,
+        rigidBody_gravity=False,
+        clean_boundary=False,
+        write_particle=False,
+        write_rigid_body=False,
+        write_partio=False,
+        write_dataset=False,
+    )
+
+    tex = tc.Texture(
+        'mesh',
+        scale=(side/r, side/r, side/r),
+        translate=(0.5, 0.5, 0.5),
+        resolution=(2*r, 2*r, 2*r),
+        mesh_accuracy=3,
+        filename='projects/mpm/data/cube_smooth.obj',
+    ) * 4
+
+    mpm.add_particles(
+        type='sand',
+        pd=True,
+        density_tex=tex.id,
+        density=2583,
+    )
+
+    num_particles = 4 * side ** 3
+    for displacement in [0.01, 0.1, 0.5]:
+        full, incremental = map(float, mpm.general_action(
+            action='benchmark_sort', iterations=10,
+            displacement=displacement).split())
+        print('{:5.1f}M particles, displacement {:4.2f} dx: '
+              'full {:6.2f} ns/particle, incremental {:6.2f} ns/particle'.format(
+                  num_particles / 1e6, displacement,
+                  full / num_particles * 1e9, incremental / num_particles * 1e9))
+
+
+if __name__ == '__main__':
+    sizes = [1, 8]
+    if '--sizes' in sys.argv:
+        sizes = [float(s) for s in sys.argv[sys.argv.index('--sizes') + 1].split(',')]
+    for millions in sizes:
+        benchmark(millions)
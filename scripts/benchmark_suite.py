@@ -0,0 +1,263 @@
+## Standard benchmark scenes, for comparing builds
+
+# $ python3 benchmark_suite.py [--scenes cube,excavation,wheel,silo,rigid_bodies]
+#       [--threads 1,2,4,...] [--res 128] [--substeps 50] [--warmup 20]
+#       [--output benchmark.json]
+# Each (scene, thread count) runs headless in its own process: the scene is
+# built with a fixed seed, settled for --warmup substeps, then --substeps are
+# timed (action 'benchmark_substeps'). The results (particle updates per
+# second overall and per stage, peak memory, stage times) go to --output as
+# JSON, along with the build (git revision) and the machine.
+
+import json
+import multiprocessing
+import os
+import platform
+import random
+import subprocess
+import sys
+import taichi as tc
+
+data = 'projects/mpm/data/'
+
+nonlocal_sand = dict(
+    type='nonlocal',
+    pd=True,
+    density=2583,
+    critical_density=0.67 * 2583,
+    packing_fraction=0.67,
+    S_mod=15e6 / 2 / 1.3,
+    B_mod=15e6 / 3 / 0.4,
+    A_mat=0.48,
+    dia=0.0003,
+    mu_s=0.7,
+    mu_2=0.9616,
+    I_0=0.278,
+    t_0=1e-4,
+)
+
+
+def create_mpm(res, **kwargs):
+    return tc.dynamics.MPM(
+        res=(res, res, res),
+        base_delta_t=1e-4,
+        num_threads=-1,
+        gravity=(0, -9.81, 0),
+        particle_gravity=True,
+        rigidBody_gravity=False,
+        clean_boundary=True,
+        write_particle=False,
+        write_rigid_body=False,
+        write_partio=False,
+        write_dataset=False,
+        snapshots=False,
+        metrics=True,
+        **kwargs)
+
+
+def box_texture(res, size, center, ppc=8):
+    # Scaled as in excav.py: the mesh is 0.1 wide
+    return tc.Texture(
+        'mesh',
+        scale=tuple(s * 10 for s in size),
+        translate=center,
+        resolution=(2 * res, 2 * res, 2 * res),
+        mesh_accuracy=3,
+        filename=data + 'cube_smooth.obj',
+    ) * ppc
+
+
+def floor(mpm, height, friction=2):
+    levelset = mpm.create_levelset()
+    levelset.add_plane(tc.Vector(0, 1, 0), -height)
+    levelset.set_friction(friction)
+    mpm.set_levelset(levelset, False)
+
+
+def add_wall(mpm, position, rotation, scale, friction=2):
+    mpm.add_particles(
+        type='rigid',
+        density=1e5,
+        friction=friction,
+        scale=scale,
+        scripted_position=tc.constant_function13(tc.Vector(*position)),
+        scripted_rotation=tc.constant_function13(tc.Vector(*rotation)),
+        codimensional=True,
+        mesh_fn=data + 'flat_cutter_low_res.obj')
+
+
+# Dense cube of sand falling on the floor
+def cube(res):
+    mpm = create_mpm(res)
+    floor(mpm, 0.1)
+    tex = box_texture(res, (0.4, 0.4, 0.4), (0.5, 0.35, 0.5))
+    mpm.add_particles(type='sand', pd=True, density_tex=tex.id, density=2583)
+    return mpm
+
+
+# Plate cutting through a bin of sand, as in excav.py
+def excavation(res):
+    mpm = create_mpm(res, rigid_body_collision=False)
+    offset, size = 0.2, (0.6, 0.15, 0.3)
+    levelset = mpm.create_levelset()
+    levelset.add_plane(tc.Vector(1, 0, 0), -offset)
+    levelset.add_plane(tc.Vector(0, 1, 0), -offset)
+    levelset.add_plane(tc.Vector(0, 0, 1), -offset)
+    levelset.add_plane(tc.Vector(-1, 0, 0), offset + size[0])
+    levelset.add_plane(tc.Vector(0, 0, -1), offset + size[2])
+    levelset.set_friction(2)
+    mpm.set_levelset(levelset, False)
+    tex = box_texture(res, size, (offset + size[0] / 2, offset + size[1] / 2,
+                                  offset + size[2] / 2), ppc=4)
+    mpm.add_particles(density_tex=tex.id, **nonlocal_sand)
+
+    def position_function(t):
+        return tc.Vector(offset + 0.9 * size[0] - 0.4 * t,
+                         offset + 0.9 * size[1], offset + size[2] / 2)
+
+    mpm.add_particles(
+        type='rigid',
+        density=1e5,
+        friction=0.3,
+        scripted_position=tc.function13(position_function),
+        scripted_rotation=tc.constant_function13(tc.Vector(0, 0, 90 - 3.8)),
+        scale=(0.0763, 0.007, 0.1142),
+        codimensional=False,
+        mesh_fn=data + 'plate_houdini.obj')
+    return mpm
+
+
+# Driven wheel rolling on sand, as in wheel.py
+def wheel(res):
+    mpm = create_mpm(res, rigid_body_collision=False)
+    floor(mpm, 0.2)
+    tex = box_texture(res, (0.6, 0.1, 0.3), (0.5, 0.25, 0.5), ppc=4)
+    mpm.add_particles(density_tex=tex.id, **nonlocal_sand)
+
+    def position_function(t):
+        return tc.Vector(0.3 + 0.1 * t, 0.3 + 0.125, 0.5)
+
+    def rotation_function(t):
+        return tc.Vector(0, 0, -200 * t)
+
+    mpm.add_particles(
+        type='rigid',
+        density=400,
+        friction=-1,
+        scripted_position=tc.function13(position_function),
+        scripted_rotation=tc.function13(rotation_function),
+        scale=(0.25, 0.25, 0.25),
+        codimensional=False,
+        mesh_fn=data + 'wheel_houdini_closed.obj')
+    return mpm
+
+
+# Sand draining through the orifice of a bin, as in silo.py
+def silo(res):
+    mpm = create_mpm(res, rigid_body_collision=True, particle_collision=True)
+    offset, length, height, width, orifice = 0.2, 0.25, 0.25, 0.0625, 0.025
+    floor(mpm, offset)
+    add_wall(mpm, (offset + length / 2 + orifice, offset + height,
+                   offset + width / 2), (0, 0, 0), (length, 1, 0.13), -1)
+    add_wall(mpm, (offset, offset + height, offset + width / 2), (0, 0, 90),
+             (0.45, 1, 0.25))
+    add_wall(mpm, (offset + length, offset + height, offset + width / 2),
+             (0, 0, 90), (0.15, 1, 0.15))
+    add_wall(mpm, (offset + length / 2, offset + height, offset), (90, 0, 0),
+             (length, 1, 0.15))
+    add_wall(mpm, (offset + length / 2, offset + height, offset + width),
+             (90, 0, 0), (length, 1, 0.15))
+    tex = box_texture(res, (length, 0.1, width),
+                      (offset + length / 2, offset + height + 0.06,
+                       offset + width / 2))
+    mpm.add_particles(density_tex=tex.id, **nonlocal_sand)
+    return mpm
+
+
+# Sand with many small rigid cubes dropped on it (rigid-rigid contacts)
+def rigid_bodies(res, count=32):
+    mpm = create_mpm(res, rigid_body_collision=True)
+    floor(mpm, 0.1)
+    tex = box_texture(res, (0.7, 0.1, 0.7), (0.5, 0.15, 0.5), ppc=4)
+    mpm.add_particles(density_tex=tex.id, **nonlocal_sand)
+    for i in range(count):
+        mpm.add_particles(
+            type='rigid',
+            density=1000,
+            friction=0.4,
+            scale=(0.04, 0.04, 0.04),
+            initial_position=(random.uniform(0.25, 0.75),
+                              random.uniform(0.3, 0.8),
+                              random.uniform(0.25, 0.75)),
+            initial_rotation=(random.uniform(0, 90), random.uniform(0, 90),
+                              random.uniform(0, 90)),
+            codimensional=False,
+            mesh_fn=data + 'cube_smooth.obj')
+    return mpm
+
+
+scenes = dict(cube=cube, excavation=excavation, wheel=wheel, silo=silo,
+              rigid_bodies=rigid_bodies)
+
+
+def run(scene, threads, res, substeps, warmup, seed=0):
+    random.seed(seed)
+    mpm = scenes[scene](res)
+    return json.loads(mpm.general_action(
+        action='benchmark_substeps', threads=threads, substeps=substeps,
+        warmup=warmup))
+
+
+def argument(name, default):
+    if '--' + name in sys.argv:
+        return sys.argv[sys.argv.index('--' + name) + 1]
+    return default
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'],
+            cwd=os.path.dirname(os.path.abspath(__file__))).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+if __name__ == '__main__':
+    res = int(argument('res', 128))
+    substeps = int(argument('substeps', 50))
+    warmup = int(argument('warmup', 20))
+    if '--run' in sys.argv:
+        # One case, in a fresh process: the result is the last line
+        scene, threads = argument('run', None).split(':')
+        print(json.dumps(run(scene, int(threads), res, substeps, warmup)))
+        sys.exit(0)
+
+    cores = multiprocessing.cpu_count()
+    default_threads = sorted(set([2 ** i for i in range(cores.bit_length())
+                                  if 2 ** i <= cores] + [cores]))
+    threads = [int(t) for t in argument(
+        'threads', ','.join(map(str, default_threads))).split(',')]
+    names = argument('scenes', ','.join(scenes.keys())).split(',')
+    results = []
+    for scene in names:
+        for t in threads:
+            output = subprocess.check_output(
+                [sys.executable, os.path.abspath(__file__),
+                 '--run', '{}:{}'.format(scene, t), '--res', str(res),
+                 '--substeps', str(substeps), '--warmup', str(warmup)])
+            result = json.loads(output.decode().strip().split('\n')[-1])
+            result['scene'] = scene
+            results.append(result)
+            print('{:>12} {:3d} threads: {:8.3g} particle updates/s, '
+                  '{:9d} particles, {:7.0f} MB peak'.format(
+                      scene, t, result['particle_updates_per_second'],
+                      result['particles'], result['max_rss_bytes'] / 1e6))
+
+    with open(argument('output', 'benchmark.json'), 'w') as f:
+        json.dump(dict(
+            revision=git_revision(),
+            machine=dict(node=platform.node(), processor=platform.processor(),
+                         cores=cores),
+            res=res, substeps=substeps, warmup=warmup,
+            results=results), f, indent=2)
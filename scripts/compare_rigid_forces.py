@@ -0,0 +1,66 @@
+## Rigid body force/torque traces of two runs, e.g. before and after a change
+
+# $ python3 compare_rigid_forces.py <reference output dir> <output dir>
+#       [--tolerance 1e-3]
+# Both runs need write_rigid_body=True (e.g. excav.py at two revisions with
+# the same frame rate). For every rigid body, compares the force and torque
+# of rigid_<id>_<frame>.txt over the frames both runs wrote. A trace passes if
+# its largest difference is within --tolerance of the largest magnitude in
+# the reference trace: changes that only reorder the P2G sums (e.g. the grid
+# block shape) move forces at round-off level, not more.
+
+import glob
+import os
+import re
+import sys
+
+
+def read_traces(directory):
+    traces = {}
+    for fn in glob.glob(os.path.join(directory, 'rigid_*_*.txt')):
+        match = re.match(r'rigid_(\d+)_(\d+)\.txt$', os.path.basename(fn))
+        if not match:
+            continue
+        with open(fn) as f:
+            values = [float(v) for v in f.read().split()]
+        # force (3), torque (3), position (3)
+        traces.setdefault(int(match.group(1)), {})[int(match.group(2))] = \
+            values[:6]
+    return traces
+
+
+def argument(name, default):
+    if '--' + name in sys.argv:
+        return sys.argv[sys.argv.index('--' + name) + 1]
+    return default
+
+
+if __name__ == '__main__':
+    reference = read_traces(sys.argv[1])
+    current = read_traces(sys.argv[2])
+    tolerance = float(argument('tolerance', 1e-3))
+    failed = False
+    if not reference:
+        print('No rigid_*_*.txt in {}'.format(sys.argv[1]))
+        sys.exit(1)
+    for rigid in sorted(reference):
+        frames = sorted(set(reference[rigid]) & set(current.get(rigid, {})))
+        if not frames:
+            print('rigid {:3d}: missing'.format(rigid))
+            failed = True
+            continue
+        for name, components in (('force', range(0, 3)),
+                                 ('torque', range(3, 6))):
+            scale = max(abs(reference[rigid][f][c]) for f in frames
+                        for c in components)
+            difference = max(
+                abs(reference[rigid][f][c] - current[rigid][f][c])
+                for f in frames for c in components)
+            relative = difference / scale if scale > 0 else difference
+            ok = relative <= tolerance
+            failed = failed or not ok
+            print('rigid {:3d} {:>6}: {:4d} frames, max |difference| {:.3e} '
+                  '({:.2e} of max |{}|) {}'.format(
+                      rigid, name, len(frames), difference, relative, name,
+                      'ok' if ok else 'FAILED'))
+    sys.exit(1 if failed else 0)
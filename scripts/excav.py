@@ -13,6 +13,8 @@
 # 0.0100  <-  0.04  m/s (plate's forward velocity)
 # 0.0033  <-  4*(grid size)
 
+import sys
+
 import taichi as tc
 
 
@@ -45,6 +47,10 @@ if __name__ == '__main__':
     mpm = tc.dynamics.MPM(
         res=(r, r, r),
         base_delta_t=4e-5,  # can't be larger than 3.5e-4
+        # adaptive_dt=True,  # substep dt from particle CFL and NGF stiffness
+        # max_delta_t=3.5e-4,
+        # async=True,  # per-block steps of base_delta_t / 2^k, k < async_levels
+        # async_levels=4,
         frame_dt=1/frameRate,
         num_frames=finalTime*frameRate,
         num_threads=-1,
@@ -66,6 +72,9 @@ if __name__ == '__main__':
         clean_boundary=False,  # def: true, clear boundary particles
         warn_particle_deletion=False,
         cdf_3d_modified=True,
+        # rigid_sdf=True,  # rigid CDF from baked body-frame SDFs
+        # rigid_sdf_band=2,  # half width in dx
+        # baked_levelset=True,  # levelset sampled once per block and frame
         compute_particle_impulses=True,
         visualize_particle_impulses=False,
         affect_particle_impulses=False,
@@ -77,6 +86,18 @@ if __name__ == '__main__':
         write_rigid_body=False,
         write_partio=True,
         write_dataset=False,
+        # write_frame=True,  # binary columnar frames, see mpm_frame.py
+        # frame_fields='id,type,position,velocity,pressure,shear_stress,gf',
+        # write_compressed_frame=True,  # .mpmz, quantized and zlib compressed
+        # frame_bits='position:20,velocity:16',  # per float field, 0: exact
+        # frame_keyframe_interval=10,
+        # async_output=True,  # write frames on a background thread (default)
+        # output_buffers=2,  # frames in flight before the solver waits
+        # metrics_file='metrics.csv',  # stage times per substep (.csv/.jsonl)
+        # metrics_per_frame=True,  # one record per frame instead
+        # trace_file='trace.json',  # per-thread timeline, chrome://tracing
+        # perf_counters=True,  # IPC, LLC/dTLB misses per stage (Linux)
+        # perf_counters_file='perf_counters.json',
     )
 
     # level-set ----------------------------------------------------------------
@@ -208,6 +229,13 @@ if __name__ == '__main__':
     )
 
     # --------------------------------------------------------------------------
+    # $ python3 excav.py --benchmark-p2g
+    # runs a few substeps to populate the grid, then times P2G in isolation
+    if '--benchmark-p2g' in sys.argv:
+        mpm.step(10 * 4e-5)
+        print(mpm.general_action(action='benchmark_p2g', iterations=20))
+        sys.exit(0)
+
     mpm.simulate(
         clear_output_directory=True,
         print_profile_info=True,
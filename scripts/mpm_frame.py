@@ -0,0 +1,118 @@
+## Reader for .mpmf/.mpmz particle frames (write_frame/write_compressed_frame)
+
+# $ python3 mpm_frame.py frame_0001.mpmf
+# from mpm_frame import read_frame
+# frame = read_frame('frame_0001.mpmf')  # columns are numpy memmaps
+# frame['position'][:, 1], frame.t, frame.frame
+#
+# Compressed frames are decoded in order, from a keyframe on:
+# reader = CompressedFrameReader()
+# for fn in sorted(glob.glob('frame_*.mpmz')):
+#     frame = reader.read(fn)
+
+import struct
+import sys
+import zlib
+
+import numpy as np
+
+TYPES = {0: np.float32, 1: np.int32, 2: np.uint8, 3: np.uint32}
+
+
+class Frame(dict):
+    pass
+
+
+def read_frame(file_name):
+    with open(file_name, 'rb') as f:
+        header = f.read(32)
+        magic, version, dim, num_columns, num_particles, frame, _, t = \
+            struct.unpack('<4sIIIQiId', header)
+        assert magic == b'MPMF', 'not an .mpmf frame'
+        assert version == 1, 'unsupported .mpmf version {}'.format(version)
+        descriptors = [struct.unpack('<32sBBHIQ', f.read(48))
+                       for _ in range(num_columns)]
+
+    columns = Frame()
+    columns.dim, columns.frame, columns.t = dim, frame, t
+    for name, type, components, _, _, offset in descriptors:
+        name = name.rstrip(b'\0').decode()
+        shape = (num_particles, components) if components > 1 else \
+            (num_particles,)
+        columns[name] = np.memmap(file_name, dtype=TYPES[type], mode='r',
+                                  offset=offset, shape=shape)
+    return columns
+
+
+RAW, QUANTIZED, QUANTIZED_DELTA, DELTA, PARTICLE_DELTA = range(5)
+
+
+class CompressedFrameReader:
+    """Decodes .mpmz frames block by block; keeps the previous frame for the
+    temporal deltas."""
+
+    def __init__(self):
+        self.q = {}
+
+    def read(self, file_name):
+        with open(file_name, 'rb') as f:
+            magic, version, dim, num_columns, num_particles, frame, \
+                block_size, t = struct.unpack('<4sIIIQiId', f.read(40))
+            assert magic == b'MPMZ', 'not an .mpmz frame'
+            assert version == 1, 'unsupported .mpmz version {}'.format(version)
+            descriptors = [struct.unpack('<32sBBBBI3f3f', f.read(64))
+                           for _ in range(num_columns)]
+            tables = [[struct.unpack('<QII', f.read(16))
+                       for _ in range(d[5])] for d in descriptors]
+
+            columns = Frame()
+            columns.dim, columns.frame, columns.t = dim, frame, t
+            for c, (d, table) in enumerate(zip(descriptors, tables)):
+                name = d[0].rstrip(b'\0').decode()
+                type, components, coding = d[1], d[2], d[3]
+                origin = np.array(d[6:9][:components])
+                step = np.array(d[9:12][:components])
+                raw_dtype = np.uint8 if coding == RAW and type == 2 else \
+                    (TYPES[type] if coding == RAW else np.uint32)
+                width = np.dtype(raw_dtype).itemsize
+                values = []
+                for offset, size, raw_size in table:
+                    f.seek(offset)
+                    block = f.read(size)
+                    if size != raw_size:
+                        block = zlib.decompress(block)
+                    planes = np.frombuffer(block, np.uint8).reshape(width, -1)
+                    values.append(planes.T.copy().view(raw_dtype).ravel())
+                v = np.concatenate(values) if values else \
+                    np.zeros(0, raw_dtype)
+                if coding != RAW:
+                    delta = (v >> 1).astype(np.int64) ^ -(v & 1).astype(np.int64)
+                    if coding == PARTICLE_DELTA:
+                        delta = delta.reshape(-1, components)
+                        q = np.cumsum(delta, axis=0).ravel()
+                    elif coding in (QUANTIZED_DELTA, DELTA):
+                        assert c in self.q, 'previous frame not read'
+                        q = self.q[c] + delta
+                    else:
+                        q = delta
+                    q = q.astype(np.int64).astype(np.uint32).view(np.int32)
+                    self.q[c] = q.astype(np.int64)
+                    if coding in (QUANTIZED, QUANTIZED_DELTA):
+                        v = (origin + q.reshape(-1, components) * step)
+                        v = v.astype(np.float32).ravel()
+                    else:
+                        v = q.view(TYPES[type])
+                shape = (num_particles, components) if components > 1 else \
+                    (num_particles,)
+                columns[name] = v.reshape(shape)
+        return columns
+
+
+if __name__ == '__main__':
+    if sys.argv[1].endswith('.mpmz'):
+        frame = CompressedFrameReader().read(sys.argv[1])
+    else:
+        frame = read_frame(sys.argv[1])
+    print('frame {}, t = {}'.format(frame.frame, frame.t))
+    for name, column in frame.items():
+        print('  {:20s} {} {}'.format(name, column.dtype, column.shape))
@@ -0,0 +1,234 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <algorithm>
+#include <tbb/tbb.h>
+#include "../mpm.h"
+#include "mpm_scheduler.h"
+
+TC_NAMESPACE_BEGIN
+
+template <int dim>
+void MPMScheduler<dim>::initialize(const Config &config) {
+  levels = config.get("async_levels", 4);
+  TC_ASSERT_INFO(1 <= levels && levels <= 16,
+                 "'async_levels' must be in [1, 16]");
+  max_dt_int = int64(1) << (levels - 1);
+  unit_delta_t = mpm.base_delta_t / max_dt_int;
+  TC_INFO("Async: {} levels, dt in [{:.3e}, {:.3e}]", levels, unit_delta_t,
+          mpm.base_delta_t);
+  reset();
+}
+
+template <int dim>
+void MPMScheduler<dim>::reset() {
+  t_int = 0;
+  substep_dt_int = 0;
+  pass_dt_int = 0;
+  due_levels = 0;
+  num_due = 0;
+  for (auto &p_i : mpm.particles) {
+    mpm.allocator[p_i]->dt_limit = 1;
+  }
+}
+
+template <int dim>
+int64 MPMScheduler<dim>::get_dt_int(real allowed_dt) const {
+  int64 dt_int = 1;
+  while (dt_int < max_dt_int && unit_delta_t * (dt_int * 2) <= allowed_dt) {
+    dt_int *= 2;
+  }
+  return dt_int;
+}
+
+// Blocks sharing a face, edge or corner (and the block itself), as indices
+// into page_map order
+template <int dim>
+void MPMScheduler<dim>::update_neighbours() {
+  using Vectori = typename MPM<dim>::Vectori;
+  using VectorI = typename MPM<dim>::VectorI;
+  using Region = typename MPM<dim>::Region;
+  using SparseMask = typename MPM<dim>::SparseMask;
+  auto blocks = mpm.page_map->Get_Blocks();
+  auto block_size = mpm.grid_block_size();
+  block_index.clear();
+  for (int b = 0; b < (int)blocks.second; b++) {
+    block_index[blocks.first[b]] = b;
+  }
+  neighbour_begin.resize(blocks.second + 1);
+  neighbours.clear();
+  for (int b = 0; b < (int)blocks.second; b++) {
+    neighbour_begin[b] = (int)neighbours.size();
+    Vectori base_pos(SparseMask::LinearToCoord(blocks.first[b]));
+    for (auto &ind : Region(Vectori(-1), Vectori(2))) {
+      Vectori nei_pos = base_pos + ind.get_ipos() * block_size;
+      if (!(VectorI(0) <= VectorI(nei_pos) &&
+            VectorI(nei_pos) < VectorI(mpm.spgrid_size))) {
+        continue;
+      }
+      auto it = block_index.find(SparseMask::Linear_Offset(nei_pos));
+      if (it != block_index.end()) {
+        neighbours.push_back(it->second);
+      }
+    }
+  }
+  neighbour_begin[blocks.second] = (int)neighbours.size();
+}
+
+// The fat blocks around rasterized blocks, i.e. the grid their P2G writes, and
+// among them those around active blocks, the grid their G2P reads
+template <int dim>
+void MPMScheduler<dim>::update_fat_blocks() {
+  using Vectori = typename MPM<dim>::Vectori;
+  using VectorI = typename MPM<dim>::VectorI;
+  using Region = typename MPM<dim>::Region;
+  using SparseMask = typename MPM<dim>::SparseMask;
+  auto blocks = mpm.page_map->Get_Blocks();
+  auto fat_blocks = mpm.fat_page_map->Get_Blocks();
+  auto fat_end = fat_blocks.first + fat_blocks.second;
+  auto block_size = mpm.grid_block_size();
+  fat_block_states.assign(fat_blocks.second, idle);
+  for (int b = 0; b < (int)blocks.second; b++) {
+    if (block_states[b] == idle) {
+      continue;
+    }
+    Vectori base_pos(SparseMask::LinearToCoord(blocks.first[b]));
+    for (auto &ind : Region(Vectori(-1), Vectori(2))) {
+      Vectori nei_pos = base_pos + ind.get_ipos() * block_size;
+      if (!(VectorI(0) <= VectorI(nei_pos) &&
+            VectorI(nei_pos) < VectorI(mpm.spgrid_size))) {
+        continue;
+      }
+      uint64 offset = SparseMask::Linear_Offset(nei_pos);
+      auto it = std::lower_bound(fat_blocks.first, fat_end, offset);
+      TC_ASSERT(it != fat_end && *it == offset);
+      auto &state = fat_block_states[it - fat_blocks.first];
+      state = std::max(state, block_states[b]);
+    }
+  }
+}
+
+template <int dim>
+real MPMScheduler<dim>::update(bool resorted) {
+  auto &particles = mpm.particles;
+  auto &allocator = mpm.allocator;
+  auto &block_meta = mpm.block_meta;
+  int num_blocks = (int)mpm.page_map->Get_Blocks().second;
+  if (resorted || (int)neighbour_begin.size() != num_blocks + 1) {
+    update_neighbours();
+  }
+
+  // Block limit: due particles contribute their own limits, the others the
+  // step they are in the middle of
+  block_dt_int.resize(num_blocks);
+  tbb::parallel_for(0, num_blocks, [&](int b) {
+    int64 block_limit = max_dt_int;
+    for (uint32 i = block_meta[b].particle_offset;
+         i < block_meta[b + 1].particle_offset; i++) {
+      Particle &p = *allocator[particles[i]];
+      if (is_due(p)) {
+        real speed = length(p.get_velocity());
+        p.stiffness_limit =
+            (int)get_dt_int(mpm.cfl * p.get_allowed_dt(mpm.delta_x));
+        p.cfl_limit = (int)get_dt_int(mpm.cfl * mpm.delta_x /
+                                      std::max(speed, 1e-30_f));
+        block_limit = std::min(
+            block_limit, (int64)std::min(p.stiffness_limit, p.cfl_limit));
+      } else {
+        block_limit = std::min(block_limit, (int64)p.dt_limit);
+      }
+    }
+    block_dt_int[b] = block_limit;
+  });
+
+  // At most one level between neighbouring blocks
+  std::vector<int64> limits;
+  for (int l = 1; l < levels; l++) {
+    limits = block_dt_int;
+    tbb::parallel_for(0, num_blocks, [&](int b) {
+      for (int n = neighbour_begin[b]; n < neighbour_begin[b + 1]; n++) {
+        block_dt_int[b] = std::min(block_dt_int[b], 2 * limits[neighbours[n]]);
+      }
+    });
+  }
+
+  // Due particles take the block step, shortened to stay on its own grid of
+  // t_int; the substep ends when the first particle is due again.
+  std::vector<int64> block_next(num_blocks);
+  std::vector<uint32> block_levels(num_blocks);
+  std::vector<uint64> block_due(num_blocks);
+  block_states.assign(num_blocks, idle);
+  tbb::parallel_for(0, num_blocks, [&](int b) {
+    int64 next = max_dt_int;
+    uint32 due_levels_ = 0;
+    uint64 due = 0;
+    for (uint32 i = block_meta[b].particle_offset;
+         i < block_meta[b + 1].particle_offset; i++) {
+      Particle &p = *allocator[particles[i]];
+      if (is_due(p)) {
+        int64 dt_int = block_dt_int[b];
+        while (t_int % dt_int != 0) {
+          dt_int /= 2;
+        }
+        p.dt_limit = (int)dt_int;
+        due_levels_ |= uint32(dt_int);  // dt_int is a power of two
+        due++;
+      }
+      next = std::min(next, p.dt_limit - t_int % p.dt_limit);
+    }
+    block_next[b] = next;
+    block_levels[b] = due_levels_;
+    block_due[b] = due;
+    if (due > 0) {
+      block_states[b] = active;
+    }
+  });
+
+  substep_dt_int = max_dt_int;
+  due_levels = 0;
+  num_due = 0;
+  for (int b = 0; b < num_blocks; b++) {
+    substep_dt_int = std::min(substep_dt_int, block_next[b]);
+    due_levels |= block_levels[b];
+    num_due += block_due[b];
+    if (block_states[b] == active) {
+      for (int n = neighbour_begin[b]; n < neighbour_begin[b + 1]; n++) {
+        if (block_states[neighbours[n]] == idle) {
+          block_states[neighbours[n]] = buffer;
+        }
+      }
+    }
+  }
+  update_fat_blocks();
+  return unit_delta_t * substep_dt_int;
+}
+
+template <int dim>
+void MPMScheduler<dim>::for_each_level(const std::function<void()> &body) {
+  auto &materials = mpm.allocator.materials.nonlocal.materials;
+  std::vector<real> material_delta_t;
+  for (auto &material : materials) {
+    material_delta_t.push_back(material.delta_t);
+  }
+  for (int l = 0; l < levels; l++) {
+    if (!((due_levels >> l) & 1)) {
+      continue;
+    }
+    pass_dt_int = int64(1) << l;
+    for (auto &material : materials) {
+      material.delta_t = unit_delta_t * pass_dt_int;
+    }
+    body();
+  }
+  pass_dt_int = 0;
+  for (std::size_t i = 0; i < materials.size(); i++) {
+    materials[i].delta_t = material_delta_t[i];
+  }
+}
+
+template class MPMScheduler<2>;
+template class MPMScheduler<3>;
+
+TC_NAMESPACE_END
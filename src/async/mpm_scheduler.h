@@ -0,0 +1,140 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "../mpm_fwd.h"
+#include "../particles.h"
+
+TC_NAMESPACE_BEGIN
+
+// Asynchronous (multi-rate) time stepping.
+//
+// Time is counted in integer units of unit_delta_t = base_delta_t /
+// max_dt_int. Each particle steps with dt_limit units, a power of two picked
+// from the limit of its SPGrid block when it is due; neighbouring blocks
+// differ by at most one level. A particle is due at t_int iff t_int is a
+// multiple of its dt_limit, so all particles are in sync every base_delta_t.
+//
+// In a substep, due particles do a full P2G/G2P with their own dt. Others in
+// the same or neighbouring blocks ("buffer") rasterize mass, momentum and
+// their stress over the substep, so the due particles next to them feel it.
+// The remaining blocks are skipped by the transfers, and the grid passes
+// between P2G and G2P only visit the fat blocks the due particles read.
+//
+// Only due particles move, so within a base_delta_t the particles are sorted
+// again only if one of them left its cell (MPM::is_sort_current; rigid bodies
+// and particle collision always sort). Otherwise the page maps and particle
+// counts are kept, and only the fat blocks around rasterized blocks are
+// cleared (MPM::reset_substep_grid).
+//
+// Grid nodes are not split by level. At a node shared by particles of
+// different steps (the blocks along a level boundary, which differ by one
+// level), the velocity is the mass-weighted one of all rasterized particles,
+// with the stress of each over its own stress dt: a due particle's step for
+// due particles, the substep for the others. A due particle stepping 2 dt next
+// to particles stepping dt therefore sees their forces over the first dt of
+// its step only, while they feel its force at each of their substeps. This
+// is a first order error in the coarse dt, confined to the buffer blocks; the
+// mixed-level nodes are otherwise treated like any other node.
+template <int dim>
+class MPMScheduler {
+ public:
+  using Particle = MPMParticle<dim>;
+
+  enum BlockState : uint8 { idle = 0, buffer = 1, active = 2 };
+
+  MPM<dim> &mpm;
+  int levels;
+  int64 max_dt_int;
+  real unit_delta_t;
+  int64 t_int;
+  // t_int increment of the current substep
+  int64 substep_dt_int;
+  // If nonzero, only due particles stepping this many units take part (G2P)
+  int64 pass_dt_int;
+  // Bit l set if some due particle steps 2^l units in this substep
+  uint32 due_levels;
+  uint64 num_due;
+  // Per page_map block, in page_map order
+  std::vector<int64> block_dt_int;
+  std::vector<uint8> block_states;
+  // Per fat_page_map block: read by the G2P of a due particle (active), or
+  // only written by the P2G of a rasterized block (buffer)
+  std::vector<uint8> fat_block_states;
+
+  MPMScheduler(MPM<dim> &mpm) : mpm(mpm) {
+  }
+
+  void initialize(const Config &config);
+
+  // Restart the schedule: every particle is due at the next substep
+  void reset();
+
+  // Called after sorting, or after MPM::is_sort_current held (resorted =
+  // false, so the page map is that of the last update). Picks the step of
+  // each due particle and returns the dt of this substep, i.e. the time until
+  // any particle is due again.
+  real update(bool resorted = true);
+
+  void finish_substep() {
+    t_int += substep_dt_int;
+  }
+
+  bool is_synchronized() const {
+    return t_int % max_dt_int == 0;
+  }
+
+  // Runs body once per step size present among the due particles, with the
+  // NGF materials integrating over that step.
+  void for_each_level(const std::function<void()> &body);
+
+  TC_FORCE_INLINE bool is_due(const Particle &p) const {
+    return (t_int & (p.dt_limit - 1)) == 0;
+  }
+
+  // 0 if p does not step in this substep (pass)
+  TC_FORCE_INLINE real get_particle_delta_t(const Particle &p) const {
+    if (!is_due(p) || (pass_dt_int != 0 && p.dt_limit != pass_dt_int)) {
+      return 0.0_f;
+    }
+    return unit_delta_t * p.dt_limit;
+  }
+
+  TC_FORCE_INLINE real get_stress_delta_t(const Particle &p) const {
+    return unit_delta_t * (is_due(p) ? p.dt_limit : substep_dt_int);
+  }
+
+  TC_FORCE_INLINE bool is_block_rasterized(uint32 b) const {
+    return block_states[b] != idle;
+  }
+
+  TC_FORCE_INLINE bool is_block_active(uint32 b) const {
+    return block_states[b] == active;
+  }
+
+  TC_FORCE_INLINE bool is_fat_block_active(uint32 b) const {
+    return fat_block_states[b] == active;
+  }
+
+  TC_FORCE_INLINE bool is_fat_block_rasterized(uint32 b) const {
+    return fat_block_states[b] != idle;
+  }
+
+ private:
+  // Largest power of two not exceeding allowed_dt, in units
+  int64 get_dt_int(real allowed_dt) const;
+  void update_neighbours();
+  void update_fat_blocks();
+
+  std::unordered_map<uint64, int> block_index;
+  std::vector<int> neighbour_begin;
+  std::vector<int> neighbours;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,155 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "baked_levelset.h"
+
+TC_NAMESPACE_BEGIN
+
+template <int dim>
+bool BakedLevelSet<dim>::is_current(
+    const DynamicLevelSet<dim> &levelset) const {
+  if (levelset0 != levelset.levelset0.get() ||
+      levelset1 != levelset.levelset1.get()) {
+    return false;
+  }
+  // A static levelset (the same at both times) does not depend on t
+  return levelset0 == levelset1 || (t0 == levelset.t0 && t1 == levelset.t1);
+}
+
+template <int dim>
+void BakedLevelSet<dim>::reset(const DynamicLevelSet<dim> &levelset,
+                               const Vectori &block_size) {
+  levelset0 = levelset.levelset0.get();
+  levelset1 = levelset.levelset1.get();
+  t0 = levelset.t0;
+  t1 = levelset.t1;
+  nodes_per_axis = block_size + Vectori(2);
+  nodes_per_block = 1;
+  for (int d = 0; d < dim; d++) {
+    nodes_per_block *= nodes_per_axis[d];
+  }
+  blocks.clear();
+  nodes.clear();
+}
+
+template <int dim>
+void BakedLevelSet<dim>::bake(
+    const DynamicLevelSet<dim> &levelset,
+    const std::vector<std::pair<uint64, Vectori>> &new_blocks) {
+  if (new_blocks.empty()) {
+    return;
+  }
+  if (!levelset.levelset0) {
+    // No levelset: nothing to do anywhere
+    for (auto &block : new_blocks) {
+      blocks[block.first] = outside;
+    }
+    return;
+  }
+  std::vector<std::vector<Node>> baked(new_blocks.size());
+  std::vector<int32> states(new_blocks.size());
+  tbb::parallel_for(0, (int)new_blocks.size(), [&](int i) {
+    auto &block_nodes = baked[i];
+    block_nodes.resize(nodes_per_block);
+    real min_phi = std::numeric_limits<real>::infinity();
+    real max_phi = -min_phi;
+    for (auto &ind : Region(Vectori(0), nodes_per_axis)) {
+      Vector pos(new_blocks[i].second + ind.get_ipos());
+      Node &node = block_nodes[get_node_index(ind.get_ipos())];
+      real times[2] = {t0, t1};
+      for (int k = 0; k < 2; k++) {
+        node.phi[k] = levelset.sample(pos, times[k]);
+        Vector n = levelset.get_spatial_gradient(pos, times[k]);
+        for (int d = 0; d < dim; d++) {
+          node.normal[k][d] = n[d];
+        }
+        min_phi = std::min(min_phi, node.phi[k]);
+        max_phi = std::max(max_phi, node.phi[k]);
+      }
+    }
+    if (min_phi > band) {
+      states[i] = outside;
+    } else if (max_phi < -band) {
+      states[i] = inside;
+    } else {
+      // In the band, numbered below
+      states[i] = 0;
+    }
+  });
+  for (int i = 0; i < (int)new_blocks.size(); i++) {
+    if (states[i] == 0) {
+      states[i] = (int32)(nodes.size() / nodes_per_block);
+      nodes.insert(nodes.end(), baked[i].begin(), baked[i].end());
+    }
+    blocks[new_blocks[i].first] = states[i];
+  }
+}
+
+template <int dim>
+void BakedLevelSet<dim>::sample_node(int32 block,
+                                     const Vectori &local,
+                                     real t,
+                                     real &phi,
+                                     Vector &normal,
+                                     real &phi_t) const {
+  const Node &node =
+      nodes[(std::size_t)block * nodes_per_block + get_node_index(local)];
+  real alpha = get_alpha(t);
+  phi = lerp(alpha, node.phi[0], node.phi[1]);
+  phi_t = t1 == t0 ? 0 : (node.phi[1] - node.phi[0]) / (t1 - t0);
+  for (int d = 0; d < dim; d++) {
+    normal[d] = lerp(alpha, node.normal[0][d], node.normal[1][d]);
+  }
+  // As DynamicLevelSet::get_spatial_gradient
+  real length = normal.length();
+  normal = length < 1e-10_f ? Vector::axis(0) : normal / length;
+}
+
+template <int dim>
+bool BakedLevelSet<dim>::sample(int32 block,
+                                const Vectori &base,
+                                const Vector &pos,
+                                real t,
+                                real &phi,
+                                Vector &normal) const {
+  Vector local = pos - Vector(base);
+  Vectori cell;
+  Vector fraction;
+  for (int d = 0; d < dim; d++) {
+    cell[d] = (int)std::floor(local[d]);
+    if (cell[d] < 0 || cell[d] + 1 >= nodes_per_axis[d]) {
+      return false;
+    }
+    fraction[d] = local[d] - cell[d];
+  }
+  const Node *block_nodes = &nodes[(std::size_t)block * nodes_per_block];
+  real phis[2] = {0, 0};
+  Vector normals[2] = {Vector(0), Vector(0)};
+  for (auto &ind : Region(Vectori(0), Vectori(2))) {
+    Vectori corner = ind.get_ipos();
+    real weight = 1;
+    for (int d = 0; d < dim; d++) {
+      weight *= corner[d] ? fraction[d] : 1 - fraction[d];
+    }
+    const Node &node = block_nodes[get_node_index(cell + corner)];
+    for (int k = 0; k < 2; k++) {
+      phis[k] += weight * node.phi[k];
+      for (int d = 0; d < dim; d++) {
+        normals[k][d] += weight * node.normal[k][d];
+      }
+    }
+  }
+  real alpha = get_alpha(t);
+  phi = lerp(alpha, phis[0], phis[1]);
+  normal = lerp(alpha, normals[0], normals[1]);
+  real length = normal.length();
+  normal = length < 1e-10_f ? Vector::axis(0) : normal / length;
+  return true;
+}
+
+template class BakedLevelSet<2>;
+template class BakedLevelSet<3>;
+
+TC_NAMESPACE_END
@@ -0,0 +1,115 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <taichi/math/levelset.h>
+#include "mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// The DynamicLevelSet sampled on the simulation grid nodes, per SPGrid block,
+// for options.baked_levelset.
+//
+// A DynamicLevelSet interpolates linearly between levelset0 at t0 and
+// levelset1 at t1, so each node keeps phi and the normalized gradient at both
+// times. Blocks are baked when first needed (bake_levelset, on the fat
+// blocks) and kept until the levelset or its times change, i.e. once per
+// frame for dynamic levelsets and once per run for static ones (the same
+// levelset at t0 and t1).
+//
+// Only blocks in the narrow band are stored, with one extra layer of nodes on
+// the upper side so that particles of the block can be interpolated without
+// looking at neighbours. A block with phi > band (or < -band) at all its
+// nodes and both times is only marked outside (inside): boundary conditions
+// skip it, as do particles if outside.
+template <int dim>
+class BakedLevelSet {
+ public:
+  using Vector = VectorND<dim, real>;
+  using Vectori = VectorND<dim, int>;
+
+  // get_block of a block out of the band
+  static constexpr int32 outside = -1;
+  static constexpr int32 inside = -2;
+  // In delta_x. Boundary conditions act at -3 <= phi <= 0 and particles at
+  // phi <= 0.25; the rest allows for particles moving a cell off their block
+  // and for phi between nodes.
+  static constexpr real band = 4 + dim;
+
+  // Whether the blocks baked so far are for levelset
+  bool is_current(const DynamicLevelSet<dim> &levelset) const;
+
+  // Forgets all blocks, to bake levelset
+  void reset(const DynamicLevelSet<dim> &levelset, const Vectori &block_size);
+
+  bool has_block(uint64 block_offset) const {
+    return blocks.find(block_offset) != blocks.end();
+  }
+
+  // (SPGrid offset, base node) of blocks to bake
+  void bake(const DynamicLevelSet<dim> &levelset,
+            const std::vector<std::pair<uint64, Vectori>> &new_blocks);
+
+  // outside, inside, or the index of a band block. The block must be baked.
+  int32 get_block(uint64 block_offset) const {
+    auto it = blocks.find(block_offset);
+    TC_ASSERT(it != blocks.end());
+    return it->second;
+  }
+
+  // At node base + local of a band block, 0 <= local <= block_size
+  void sample_node(int32 block,
+                   const Vectori &local,
+                   real t,
+                   real &phi,
+                   Vector &normal,
+                   real &phi_t) const;
+
+  // Multilinear at pos (in delta_x) of a band block with base node base;
+  // false if pos is out of the nodes of the block
+  bool sample(int32 block,
+              const Vectori &base,
+              const Vector &pos,
+              real t,
+              real &phi,
+              Vector &normal) const;
+
+  std::size_t size() const {
+    return blocks.size();
+  }
+
+ private:
+  struct Node {
+    real phi[2];
+    real normal[2][dim];
+  };
+
+  int get_node_index(const Vectori &local) const {
+    int index = 0;
+    for (int d = 0; d < dim; d++) {
+      index = index * nodes_per_axis[d] + local[d];
+    }
+    return index;
+  }
+
+  real get_alpha(real t) const {
+    return t1 == t0 ? 0 : (t - t0) / (t1 - t0);
+  }
+
+  const void *levelset0 = nullptr;
+  const void *levelset1 = nullptr;
+  real t0 = 0, t1 = 0;
+  Vectori nodes_per_axis;
+  int nodes_per_block = 0;
+  std::unordered_map<uint64, int32> blocks;
+  // nodes_per_block per band block
+  std::vector<Node> nodes;
+};
+
+TC_NAMESPACE_END
@@ -56,8 +56,9 @@ class RigidBoundaryParticle : public MPMParticle<dim> {
     return rigid->rotation.rotate(original_normal);
   }
 
+  // Velocity is kept in sync with the rigid body by align_with_rigid_body
   real get_allowed_dt(const real &dx) const override {
-    return 0.0f;
+    return dx / std::max(length(this->get_velocity()), 1e-30_f);
   }
 
   std::string get_name() const override {
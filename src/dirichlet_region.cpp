@@ -0,0 +1,106 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "dirichlet_region.h"
+
+TC_NAMESPACE_BEGIN
+
+template <int dim>
+void DirichletRegion<dim>::initialize(const Config &config) {
+  std::string type_name = config.get<std::string>("type");
+  velocity = config.get("velocity", Vector(0));
+  if (type_name == "box") {
+    type = Type::box;
+    lower = config.get<Vector>("lower");
+    upper = config.get<Vector>("upper");
+  } else if (type_name == "half_space") {
+    type = Type::half_space;
+    point = config.get<Vector>("point");
+    normal = normalized(config.get<Vector>("normal"));
+  } else if (type_name == "cylinder") {
+    type = Type::cylinder;
+    center = config.get<Vector>("center");
+    if (dim == 3) {
+      axis = normalized(config.get<Vector>("axis"));
+      half_length = config.get("half_length", half_length);
+    }
+    radius = config.get<real>("radius");
+    angular_velocity = config.get("angular_velocity", 0.0_f);
+  } else {
+    TC_ERROR("Unknown Dirichlet region type '{}'", type_name);
+  }
+}
+
+template <int dim>
+bool DirichletRegion<dim>::contains(const Vector &pos) const {
+  if (type == Type::box) {
+    for (int d = 0; d < dim; d++) {
+      if (pos[d] <= lower[d] || upper[d] <= pos[d]) {
+        return false;
+      }
+    }
+    return true;
+  } else if (type == Type::half_space) {
+    return dot(pos - point, normal) > 0;
+  } else {
+    Vector r = pos - center;
+    if (dim == 2) {
+      return r.length2() < radius * radius;
+    }
+    real along = dot(r, axis);
+    return std::abs(along) < half_length &&
+           (r - along * axis).length2() < radius * radius;
+  }
+}
+
+template <int dim>
+bool DirichletRegion<dim>::intersects(const Vector &box_lower,
+                                      const Vector &box_upper) const {
+  if (type == Type::box) {
+    for (int d = 0; d < dim; d++) {
+      if (box_upper[d] <= lower[d] || upper[d] <= box_lower[d]) {
+        return false;
+      }
+    }
+    return true;
+  } else if (type == Type::half_space) {
+    // The corner farthest along normal
+    Vector corner;
+    for (int d = 0; d < dim; d++) {
+      corner[d] = normal[d] > 0 ? box_upper[d] : box_lower[d];
+    }
+    return contains(corner);
+  } else {
+    // The bounding sphere of the box against the cylinder
+    Vector r = (box_lower + box_upper) * 0.5_f - center;
+    real half_diagonal = (box_upper - box_lower).length() * 0.5_f;
+    real along = dim == 2 ? 0 : dot(r, axis);
+    return std::abs(along) < half_length + half_diagonal &&
+           (r - along * axis).length() < radius + half_diagonal;
+  }
+}
+
+template <>
+VectorND<2, real> DirichletRegion<2>::get_velocity(const Vector &pos) const {
+  if (type != Type::cylinder || angular_velocity == 0) {
+    return velocity;
+  }
+  Vector r = pos - center;
+  return velocity + angular_velocity * Vector(-r.y, r.x);
+}
+
+template <>
+VectorND<3, real> DirichletRegion<3>::get_velocity(const Vector &pos) const {
+  if (type != Type::cylinder || angular_velocity == 0) {
+    return velocity;
+  }
+  Vector r = pos - center;
+  return velocity + cross(angular_velocity * axis, r - dot(r, axis) * axis);
+}
+
+template class DirichletRegion<2>;
+template class DirichletRegion<3>;
+
+TC_NAMESPACE_END
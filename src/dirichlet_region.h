@@ -0,0 +1,60 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// A region of the domain where the grid velocity is prescribed after the
+// boundary conditions (apply_dirichlet_boundary_conditions), keeping the
+// mass. Positions are in world units, as Vector(ind) * delta_x.
+//
+//   "box":        lower < pos < upper
+//   "half_space": dot(pos - point, normal) > 0, the side normal points to
+//   "cylinder":   within radius of the axis through center, and within
+//                 half_length of center along it (3D); a disk in 2D
+//
+// The prescribed velocity is "velocity", plus for cylinders a rotation at
+// "angular_velocity" (rad/s) about the axis (counterclockwise in 2D).
+template <int dim>
+class DirichletRegion {
+ public:
+  using Vector = VectorND<dim, real>;
+
+  enum class Type { box, half_space, cylinder };
+
+  Type type = Type::box;
+  Vector velocity = Vector(0);
+  // box
+  Vector lower = Vector(0), upper = Vector(0);
+  // half_space
+  Vector point = Vector(0), normal = Vector::axis(0);
+  // cylinder
+  Vector center = Vector(0), axis = Vector::axis(dim - 1);
+  real radius = 0;
+  real half_length = 1e30_f;
+  real angular_velocity = 0;
+
+  // Fat blocks (SPGrid offsets) that intersect the region, refreshed every
+  // substep
+  std::vector<uint64> blocks;
+
+  DirichletRegion() = default;
+
+  void initialize(const Config &config);
+
+  bool contains(const Vector &pos) const;
+
+  // Conservative: may be true for boxes close to the region
+  bool intersects(const Vector &box_lower, const Vector &box_upper) const;
+
+  Vector get_velocity(const Vector &pos) const;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,252 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tbb/tbb.h>
+#include "../mpm.h"
+#include "../boundary_particle.h"
+#include "checkpoint.h"
+
+TC_NAMESPACE_BEGIN
+
+// Particles are restored in chunks of at most this many
+constexpr uint64 checkpoint_chunk_size = 1 << 14;
+
+static_assert(std::is_trivially_copyable<NonlocalMaterial>::value,
+              "Checkpoints store material tables as they are in memory");
+
+static void write_or_fail(FILE *f, const void *data, std::size_t size,
+                          const std::string &file_name) {
+  if (size && std::fwrite(data, 1, size, f) != size) {
+    std::fclose(f);
+    TC_ERROR("Cannot write checkpoint {}", file_name);
+  }
+}
+
+template <int dim>
+void MPM<dim>::save_checkpoint(const std::string &file_name) const {
+  auto &pool = allocator.pool;
+  uint64 pool_size = pool.size();
+
+  // Runs of one particle type, told apart by their vtable pointers (the
+  // first word of a particle), and of one rigid body
+  std::vector<CheckpointRun> runs;
+  std::vector<const void *> vtables;
+  std::vector<std::string> names;
+  std::unordered_map<const RigidBody<dim> *, uint32> rigid_indices;
+  for (uint32 r = 0; r < rigids.size(); r++) {
+    rigid_indices[rigids[r].get()] = r;
+  }
+  auto get_vtable = [&](uint64 i) {
+    const void *vtable;
+    std::memcpy(&vtable, pool[i].data, sizeof(vtable));
+    return vtable;
+  };
+  auto get_rigid = [&](uint64 i) {
+    auto p = allocator.get_const((ParticlePtr)i);
+    if (!p->is_rigid()) {
+      return checkpoint_no_rigid;
+    }
+    auto rigid = static_cast<const RigidBoundaryParticle<dim> *>(p)->rigid;
+    auto it = rigid_indices.find(rigid);
+    TC_ASSERT_INFO(it != rigid_indices.end(),
+                   "Rigid boundary particle of an unknown rigid body");
+    return it->second;
+  };
+  for (uint64 i = 0; i < pool_size; i++) {
+    const void *vtable = get_vtable(i);
+    uint32 rigid = get_rigid(i);
+    if (!runs.empty() && vtables[runs.back().type] == vtable &&
+        runs.back().rigid == rigid) {
+      runs.back().end = i + 1;
+      continue;
+    }
+    uint32 type = 0;
+    while (type < vtables.size() && vtables[type] != vtable) {
+      type++;
+    }
+    if (type == vtables.size()) {
+      vtables.push_back(vtable);
+      names.push_back(allocator.get_const((ParticlePtr)i)->get_name());
+      TC_ASSERT_INFO((int)names.back().size() < checkpoint_type_name_size,
+                     "Particle type name too long for a checkpoint");
+    }
+    runs.push_back(CheckpointRun{i, i + 1, type, rigid});
+  }
+
+  CheckpointHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::strncpy(header.magic, "MPMCKPT", sizeof(header.magic));
+  header.version = checkpoint_version;
+  header.dim = dim;
+  header.particle_size = sizeof(ParticleContainer<dim>);
+  header.num_types = (uint32)names.size();
+  header.num_runs = (uint32)runs.size();
+  auto &materials = allocator.materials.nonlocal.materials;
+  header.num_materials = (uint32)materials.size();
+  header.pool_size = pool_size;
+  header.num_particles = particles.size();
+  header.num_particles_ = particles_.size();
+  header.num_keys = particle_sorter.size();
+  uint64 tables_end = sizeof(header) +
+                      names.size() * checkpoint_type_name_size +
+                      runs.size() * sizeof(CheckpointRun) +
+                      materials.size() * sizeof(NonlocalMaterial);
+  header.pool_offset = (tables_end + 4095) / 4096 * 4096;
+
+  FILE *f = std::fopen(file_name.c_str(), "wb");
+  if (!f) {
+    TC_ERROR("Cannot open {} for writing", file_name);
+  }
+  write_or_fail(f, &header, sizeof(header), file_name);
+  for (auto &name : names) {
+    char buffer[checkpoint_type_name_size] = {0};
+    std::strncpy(buffer, name.c_str(), sizeof(buffer) - 1);
+    write_or_fail(f, buffer, sizeof(buffer), file_name);
+  }
+  write_or_fail(f, runs.data(), runs.size() * sizeof(CheckpointRun),
+                file_name);
+  write_or_fail(f, materials.data(),
+                materials.size() * sizeof(NonlocalMaterial), file_name);
+  std::vector<char> padding(header.pool_offset - tables_end, 0);
+  write_or_fail(f, padding.data(), padding.size(), file_name);
+  write_or_fail(f, pool.data(), pool_size * sizeof(ParticleContainer<dim>),
+                file_name);
+  write_or_fail(f, particles.data(), particles.size() * sizeof(ParticlePtr),
+                file_name);
+  write_or_fail(f, particles_.data(), particles_.size() * sizeof(ParticlePtr),
+                file_name);
+  write_or_fail(f, particle_sorter.data(),
+                particle_sorter.size() * sizeof(uint64), file_name);
+  std::fclose(f);
+
+  // The rest, without the bulk arrays
+  BinaryOutputSerializer writer;
+  writer.initialize();
+  io_fields(writer, false);
+  writer.finalize();
+  writer.write_to_file(file_name + ".state");
+}
+
+template <int dim>
+void MPM<dim>::load_checkpoint(const std::string &file_name) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    TC_ERROR("Cannot open checkpoint {}", file_name);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  uint64 file_size = (uint64)st.st_size;
+  TC_ASSERT_INFO(file_size >= sizeof(CheckpointHeader),
+                 "Truncated checkpoint");
+  void *mapped = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    TC_ERROR("Cannot map checkpoint {}", file_name);
+  }
+  madvise(mapped, file_size, MADV_SEQUENTIAL);
+  auto data = static_cast<const char *>(mapped);
+
+  CheckpointHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  TC_ASSERT_INFO(std::strncmp(header.magic, "MPMCKPT", 8) == 0,
+                 "Not an MPM checkpoint");
+  TC_ASSERT_INFO(header.version == checkpoint_version,
+                 "Unsupported checkpoint version");
+  TC_ASSERT_INFO(header.dim == dim, "Checkpoint of another dimensionality");
+  TC_ASSERT_INFO(header.particle_size == sizeof(ParticleContainer<dim>),
+                 "Checkpoint particle size differs from this build");
+  uint64 pool_bytes = header.pool_size * sizeof(ParticleContainer<dim>);
+  TC_ASSERT_INFO(file_size == header.pool_offset + pool_bytes +
+                                  (header.num_particles +
+                                   header.num_particles_) *
+                                      sizeof(ParticlePtr) +
+                                  header.num_keys * sizeof(uint64),
+                 "Truncated checkpoint");
+
+  BinaryInputSerializer reader;
+  reader.initialize(file_name + ".state");
+  io_fields(reader, false);
+  reader.finalize();
+
+  // A particle of each type, for its vtable pointer
+  const char *tables = data + sizeof(header);
+  std::vector<ParticleContainer<dim>> prototypes(header.num_types);
+  for (uint32 t = 0; t < header.num_types; t++) {
+    std::string name(tables + t * checkpoint_type_name_size);
+    create_instance_placement<Particle>(name, &prototypes[t]);
+  }
+  std::vector<CheckpointRun> runs(header.num_runs);
+  std::memcpy(runs.data(),
+              tables + header.num_types * checkpoint_type_name_size,
+              runs.size() * sizeof(CheckpointRun));
+  auto &materials = allocator.materials;
+  materials = MaterialTables();
+  materials.nonlocal.materials.resize(header.num_materials);
+  std::memcpy(materials.nonlocal.materials.data(),
+              tables + header.num_types * checkpoint_type_name_size +
+                  runs.size() * sizeof(CheckpointRun),
+              header.num_materials * sizeof(NonlocalMaterial));
+
+  // Runs split into chunks, copied and fixed up in parallel
+  std::vector<CheckpointRun> chunks;
+  for (auto &run : runs) {
+    TC_ASSERT(run.type < header.num_types && run.end <= header.pool_size);
+    TC_ASSERT_INFO(
+        run.rigid == checkpoint_no_rigid || run.rigid < rigids.size(),
+        "Checkpoint refers to a missing rigid body");
+    for (uint64 i = run.begin; i < run.end; i += checkpoint_chunk_size) {
+      chunks.push_back(CheckpointRun{
+          i, std::min(run.end, i + checkpoint_chunk_size), run.type,
+          run.rigid});
+    }
+  }
+  auto &pool = allocator.pool;
+  pool.resize(header.pool_size);
+  allocator.pool_.resize(header.pool_size);
+  auto pool_data = reinterpret_cast<const ParticleContainer<dim> *>(
+      data + header.pool_offset);
+  tbb::parallel_for(0, (int)chunks.size(), [&](int c) {
+    auto &chunk = chunks[c];
+    std::memcpy(&pool[chunk.begin], &pool_data[chunk.begin],
+                (chunk.end - chunk.begin) * sizeof(ParticleContainer<dim>));
+    for (uint64 i = chunk.begin; i < chunk.end; i++) {
+      std::memcpy(pool[i].data, prototypes[chunk.type].data, sizeof(void *));
+      auto p = allocator[(ParticlePtr)i];
+      // Keeps the material ids, which index the restored tables
+      p->bind_materials(materials);
+      if (chunk.rigid != checkpoint_no_rigid) {
+        static_cast<RigidBoundaryParticle<dim> *>(p)->rigid =
+            rigids[chunk.rigid].get();
+      }
+    }
+  });
+
+  const char *lists = data + header.pool_offset + pool_bytes;
+  particles.resize(header.num_particles);
+  std::memcpy(particles.data(), lists, particles.size() * sizeof(ParticlePtr));
+  lists += particles.size() * sizeof(ParticlePtr);
+  particles_.resize(header.num_particles_);
+  std::memcpy(particles_.data(), lists,
+              particles_.size() * sizeof(ParticlePtr));
+  lists += particles_.size() * sizeof(ParticlePtr);
+  particle_sorter.resize(header.num_keys);
+  std::memcpy(particle_sorter.data(), lists,
+              particle_sorter.size() * sizeof(uint64));
+  munmap(mapped, file_size);
+}
+
+template void MPM<2>::save_checkpoint(const std::string &file_name) const;
+template void MPM<3>::save_checkpoint(const std::string &file_name) const;
+template void MPM<2>::load_checkpoint(const std::string &file_name);
+template void MPM<3>::load_checkpoint(const std::string &file_name);
+
+TC_NAMESPACE_END
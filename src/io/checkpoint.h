@@ -0,0 +1,59 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include "../mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// Checkpoints (.mpmc) of MPM::save_checkpoint/load_checkpoint.
+//
+// The particle pool and the particle lists (particles, particles_,
+// particle_sorter) are dumped as they are in memory, and restored by mapping
+// the file and copying it back in parallel. Particles are polymorphic: the
+// pool is split into runs of one particle type, named in the file, and the
+// vtable pointer of each particle is set again from an instance
+// of its type created on load, and particles are bound to the material tables
+// of the allocator, which are stored as they are. Runs of rigid boundary
+// particles are also split by rigid body, stored as its index in MPM::rigids,
+// and their rigid pointers are set again on load. The rest of the state
+// (rigid bodies, articulations, options...) is small and goes through the
+// serializer into <file>.state, as with save/load, but without the particles
+// (MPM::io_fields).
+//
+//   CheckpointHeader, num_types x char[64] type name,
+//   num_runs x CheckpointRun, num_materials x NonlocalMaterial, then from
+//   pool_offset (page aligned): pool, particles (uint32), particles_ (uint32),
+//   particle_sorter (uint64).
+struct CheckpointHeader {
+  char magic[8];  // "MPMCKPT"
+  uint32 version;
+  uint32 dim;
+  uint32 particle_size;
+  uint32 num_types;
+  uint32 num_runs;
+  uint32 num_materials;
+  uint64 pool_size;
+  uint64 num_particles;
+  uint64 num_particles_;
+  uint64 num_keys;
+  uint64 pool_offset;
+};
+
+struct CheckpointRun {
+  uint64 begin, end;  // Pool indices
+  uint32 type;
+  uint32 rigid;  // Index in MPM::rigids, or checkpoint_no_rigid
+};
+
+constexpr uint32 checkpoint_version = 4;
+constexpr uint32 checkpoint_no_rigid = 0xFFFFFFFFu;
+constexpr int checkpoint_type_name_size = 64;
+
+static_assert(sizeof(CheckpointHeader) == 72, "Checkpoint header layout");
+static_assert(sizeof(CheckpointRun) == 24, "Checkpoint run layout");
+
+TC_NAMESPACE_END
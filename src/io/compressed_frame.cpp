@@ -0,0 +1,475 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <tbb/tbb.h>
+#ifdef MPM_USE_ZLIB
+#include <zlib.h>
+#endif
+#include "compressed_frame.h"
+
+TC_NAMESPACE_BEGIN
+
+TC_FORCE_INLINE uint32 zigzag_encode(int32 v) {
+  return ((uint32)v << 1) ^ (uint32)(v >> 31);
+}
+
+TC_FORCE_INLINE int32 zigzag_decode(uint32 v) {
+  return (int32)(v >> 1) ^ -(int32)(v & 1);
+}
+
+// Byte k of element i goes to plane k: the high bytes of small values are
+// runs of zeros
+static void split_byte_planes(const char *src, char *dst, std::size_t n,
+                              int width) {
+  for (std::size_t i = 0; i < n; i++) {
+    for (int k = 0; k < width; k++) {
+      dst[k * n + i] = src[i * width + k];
+    }
+  }
+}
+
+static void merge_byte_planes(const char *src, char *dst, std::size_t n,
+                              int width) {
+  for (std::size_t i = 0; i < n; i++) {
+    for (int k = 0; k < width; k++) {
+      dst[i * width + k] = src[k * n + i];
+    }
+  }
+}
+
+template <int dim>
+void CompressedFrameEncoder<dim>::initialize(const std::string &bits,
+                                             int keyframe_interval,
+                                             int compression_level) {
+  TC_ASSERT_INFO(keyframe_interval >= 1,
+                 "'frame_keyframe_interval' must be at least 1");
+  this->keyframe_interval = keyframe_interval;
+  this->compression_level = compression_level;
+  for (int i = 0; i < (int)FrameField::num_fields; i++) {
+    field_bits[i] = FrameField(i) == FrameField::position ? 20 : 16;
+  }
+  std::stringstream ss(bits);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    auto colon = item.find(':');
+    if (colon == std::string::npos) {
+      TC_ERROR("Expected 'field:bits' in frame_bits, got '{}'", item);
+    }
+    auto fields = ParticleFrame<dim>::parse_fields(item.substr(0, colon));
+    int b = std::stoi(item.substr(colon + 1));
+    TC_ASSERT_INFO(0 <= b && b <= 24, "Frame field bits must be in [0, 24]");
+    for (auto field : fields) {
+      if (ParticleFrame<dim>::get_field_type(field) != FrameFieldType::f32) {
+        TC_ERROR("Frame field '{}' is not quantized",
+                 ParticleFrame<dim>::get_field_name(field));
+      }
+      field_bits[(int)field] = b;
+    }
+  }
+  num_delta_frames = -1;
+  ids.clear();
+  states.clear();
+}
+
+template <int dim>
+void CompressedFrameEncoder<dim>::write(const ParticleFrame<dim> &frame,
+                                        const std::vector<FrameField> &fields,
+                                        const std::string &file_name) {
+  using Frame = ParticleFrame<dim>;
+  int n = (int)frame.num_particles;
+
+  // Temporal deltas need the same particles, in the same order, and fields
+  auto id_column = frame.find(FrameField::id);
+  bool temporal = num_delta_frames >= 0 &&
+                  num_delta_frames + 1 < keyframe_interval && id_column &&
+                  (int)ids.size() == n && states.size() == fields.size() &&
+                  std::memcmp(ids.data(), id_column->data.data(),
+                              sizeof(int32) * n) == 0;
+  for (int c = 0; temporal && c < (int)fields.size(); c++) {
+    temporal = states[c].field == fields[c];
+  }
+
+  std::vector<State> new_states(fields.size());
+  // Per column: coded values (4 bytes, or 1 byte for raw uint8)
+  std::vector<std::vector<char>> streams(fields.size());
+  std::vector<int> widths(fields.size());
+  for (int c = 0; c < (int)fields.size(); c++) {
+    FrameField field = fields[c];
+    auto column = frame.find(field);
+    if (!column) {
+      TC_ERROR("Frame field '{}' was not gathered",
+               Frame::get_field_name(field));
+    }
+    State &state = new_states[c];
+    const State *previous = temporal ? &states[c] : nullptr;
+    state.field = field;
+    state.bits = 0;
+    for (int k = 0; k < 3; k++) {
+      state.origin[k] = 0;
+      state.step[k] = 1;
+    }
+    int components = Frame::get_field_components(field);
+    std::size_t count = (std::size_t)n * components;
+    FrameFieldType type = Frame::get_field_type(field);
+    widths[c] = type == FrameFieldType::u8 ? 1 : 4;
+    auto &stream = streams[c];
+    stream.resize(count * widths[c]);
+    auto coded = reinterpret_cast<uint32 *>(stream.data());
+
+    if (type == FrameFieldType::u8 ||
+        (type == FrameFieldType::f32 && field_bits[(int)field] == 0)) {
+      state.coding = FrameCoding::raw;
+      std::memcpy(stream.data(), column->data.data(), stream.size());
+      continue;
+    }
+    state.q.resize(count);
+
+    if (type == FrameFieldType::f32) {
+      auto v = column->template get<float32>();
+      state.bits = field_bits[(int)field];
+      float64 max_q = (float64)((1 << state.bits) - 1);
+      // Per component range of the finite values
+      using Range = std::pair<std::array<float32, 3>, std::array<float32, 3>>;
+      Range empty;
+      empty.first.fill(1e30f);
+      empty.second.fill(-1e30f);
+      Range range = tbb::parallel_reduce(
+          tbb::blocked_range<int>(0, n), empty,
+          [&](const tbb::blocked_range<int> &r, Range range) {
+            for (int i = r.begin(); i < r.end(); i++) {
+              for (int k = 0; k < components; k++) {
+                float32 x = v[i * components + k];
+                if (std::isfinite(x)) {
+                  range.first[k] = std::min(range.first[k], x);
+                  range.second[k] = std::max(range.second[k], x);
+                }
+              }
+            }
+            return range;
+          },
+          [](Range a, const Range &b) {
+            for (int k = 0; k < 3; k++) {
+              a.first[k] = std::min(a.first[k], b.first[k]);
+              a.second[k] = std::max(a.second[k], b.second[k]);
+            }
+            return a;
+          });
+      // Keep the previous quantization while the values stay within one
+      // range of it, so that the differences are small
+      bool reuse = previous && previous->bits == state.bits;
+      for (int k = 0; reuse && k < components; k++) {
+        float64 extent = previous->step[k] * max_q;
+        reuse = range.first[k] >= previous->origin[k] - extent &&
+                range.second[k] <= previous->origin[k] + 2 * extent;
+      }
+      for (int k = 0; k < components; k++) {
+        if (reuse) {
+          state.origin[k] = previous->origin[k];
+          state.step[k] = previous->step[k];
+        } else if (range.first[k] <= range.second[k]) {
+          state.origin[k] = range.first[k];
+          float64 step = (range.second[k] - range.first[k]) / max_q;
+          state.step[k] = step > 0 ? (float32)step : 1.0f;
+        }
+      }
+      state.coding =
+          reuse ? FrameCoding::quantized_delta : FrameCoding::quantized;
+      // Non-finite values are stored as the origin
+      tbb::parallel_for(0, n, [&](int i) {
+        for (int k = 0; k < components; k++) {
+          std::size_t j = (std::size_t)i * components + k;
+          float64 x = v[j];
+          int32 q = 0;
+          if (std::isfinite(x)) {
+            q = (int32)std::llround((x - state.origin[k]) / state.step[k]);
+          }
+          state.q[j] = q;
+          coded[j] = zigzag_encode(reuse ? q - previous->q[j] : q);
+        }
+      });
+    } else {
+      auto v = column->template get<int32>();
+      state.coding =
+          previous ? FrameCoding::delta : FrameCoding::particle_delta;
+      tbb::parallel_for(0, n, [&](int i) {
+        for (int k = 0; k < components; k++) {
+          std::size_t j = (std::size_t)i * components + k;
+          state.q[j] = v[j];
+          int32 reference = 0;
+          if (previous) {
+            reference = previous->q[j];
+          } else if (i > 0) {
+            reference = v[j - components];
+          }
+          coded[j] = zigzag_encode(
+              (int32)((uint32)v[j] - (uint32)reference));
+        }
+      });
+    }
+  }
+
+  // Compress every block of every column
+  struct Block {
+    int column;
+    std::size_t begin, end;  // Bytes of the stream
+    std::vector<char> data;
+    uint32 raw_size;
+  };
+  std::vector<Block> blocks;
+  std::vector<uint32> num_blocks(fields.size(), 0);
+  for (int c = 0; c < (int)fields.size(); c++) {
+    std::size_t particle_bytes =
+        (std::size_t)Frame::get_field_components(fields[c]) * widths[c];
+    for (std::size_t i = 0; i < (std::size_t)n; i += block_size) {
+      std::size_t end = std::min((std::size_t)n, i + block_size);
+      blocks.push_back(
+          Block{c, i * particle_bytes, end * particle_bytes, {}, 0});
+      num_blocks[c]++;
+    }
+  }
+  tbb::parallel_for(0, (int)blocks.size(), [&](int b) {
+    Block &block = blocks[b];
+    std::size_t size = block.end - block.begin;
+    int width = widths[block.column];
+    std::vector<char> planes(size);
+    split_byte_planes(streams[block.column].data() + block.begin,
+                      planes.data(), size / width, width);
+    block.raw_size = (uint32)size;
+#ifdef MPM_USE_ZLIB
+    uLongf compressed_size = compressBound((uLong)size);
+    block.data.resize(compressed_size);
+    int ret = compress2((Bytef *)block.data.data(), &compressed_size,
+                        (const Bytef *)planes.data(), (uLong)size,
+                        compression_level);
+    if (ret == Z_OK && compressed_size < size) {
+      block.data.resize(compressed_size);
+      return;
+    }
+#endif
+    block.data = std::move(planes);
+  });
+
+  std::vector<char> header;
+  auto put = [&](const void *data, std::size_t size) {
+    auto bytes = static_cast<const char *>(data);
+    header.insert(header.end(), bytes, bytes + size);
+  };
+  uint32 version_ = version;
+  uint32 dim_ = dim;
+  uint32 num_columns = (uint32)fields.size();
+  uint32 block_size_ = block_size;
+  uint64 num_particles = frame.num_particles;
+  put("MPMZ", 4);
+  put(&version_, 4);
+  put(&dim_, 4);
+  put(&num_columns, 4);
+  put(&num_particles, 8);
+  put(&frame.frame, 4);
+  put(&block_size_, 4);
+  put(&frame.t, 8);
+  for (int c = 0; c < (int)fields.size(); c++) {
+    auto &state = new_states[c];
+    char name[32] = {0};
+    std::strncpy(name, Frame::get_field_name(state.field), sizeof(name) - 1);
+    uint8 type = (uint8)Frame::get_field_type(state.field);
+    uint8 components = (uint8)Frame::get_field_components(state.field);
+    uint8 coding = (uint8)state.coding;
+    uint8 bits = (uint8)state.bits;
+    put(name, 32);
+    put(&type, 1);
+    put(&components, 1);
+    put(&coding, 1);
+    put(&bits, 1);
+    put(&num_blocks[c], 4);
+    put(state.origin, 12);
+    put(state.step, 12);
+  }
+  uint64 offset = header.size() + 16 * blocks.size();
+  for (auto &block : blocks) {
+    uint32 size = (uint32)block.data.size();
+    put(&offset, 8);
+    put(&size, 4);
+    put(&block.raw_size, 4);
+    offset += size;
+  }
+
+  FILE *f = std::fopen(file_name.c_str(), "wb");
+  if (!f) {
+    TC_ERROR("Cannot open {} for writing", file_name);
+  }
+  std::fwrite(header.data(), 1, header.size(), f);
+  for (auto &block : blocks) {
+    std::fwrite(block.data.data(), 1, block.data.size(), f);
+  }
+  std::fclose(f);
+
+  if (id_column) {
+    ids.assign(id_column->template get<int32>(),
+               id_column->template get<int32>() + n);
+  } else {
+    ids.clear();
+  }
+  states = std::move(new_states);
+  num_delta_frames = temporal ? num_delta_frames + 1 : 0;
+}
+
+template <int dim>
+void CompressedFrameDecoder<dim>::read(const std::string &file_name,
+                                       ParticleFrame<dim> &frame) {
+  using Frame = ParticleFrame<dim>;
+  FILE *f = std::fopen(file_name.c_str(), "rb");
+  if (!f) {
+    TC_ERROR("Cannot open {} for reading", file_name);
+  }
+  auto get = [&](void *data, std::size_t size) {
+    TC_ASSERT_INFO(std::fread(data, 1, size, f) == size,
+                   "Truncated .mpmz frame");
+  };
+  char magic[4];
+  uint32 version, dim_, num_columns, block_size;
+  uint64 num_particles;
+  get(magic, 4);
+  TC_ASSERT_INFO(std::memcmp(magic, "MPMZ", 4) == 0, "Not an .mpmz frame");
+  get(&version, 4);
+  TC_ASSERT_INFO(version == CompressedFrameEncoder<dim>::version,
+                 "Unsupported .mpmz version");
+  get(&dim_, 4);
+  TC_ASSERT_INFO(dim_ == dim, ".mpmz frame of another dimensionality");
+  get(&num_columns, 4);
+  get(&num_particles, 8);
+  get(&frame.frame, 4);
+  get(&block_size, 4);
+  get(&frame.t, 8);
+  frame.num_particles = num_particles;
+  std::size_t n = num_particles;
+
+  struct Descriptor {
+    FrameField field;
+    FrameCoding coding;
+    int components;
+    uint32 num_blocks;
+    float32 origin[3];
+    float32 step[3];
+  };
+  std::vector<Descriptor> descriptors(num_columns);
+  for (auto &d : descriptors) {
+    char name[33] = {0};
+    uint8 type, components, coding, bits;
+    get(name, 32);
+    get(&type, 1);
+    get(&components, 1);
+    get(&coding, 1);
+    get(&bits, 1);
+    get(&d.num_blocks, 4);
+    get(d.origin, 12);
+    get(d.step, 12);
+    d.field = Frame::parse_fields(name)[0];
+    d.coding = FrameCoding(coding);
+    d.components = components;
+    TC_ASSERT(components == Frame::get_field_components(d.field));
+  }
+  std::vector<std::vector<uint64>> offsets(num_columns);
+  std::vector<std::vector<uint32>> sizes(num_columns), raw_sizes(num_columns);
+  for (uint32 c = 0; c < num_columns; c++) {
+    for (uint32 b = 0; b < descriptors[c].num_blocks; b++) {
+      uint64 offset;
+      uint32 size, raw_size;
+      get(&offset, 8);
+      get(&size, 4);
+      get(&raw_size, 4);
+      offsets[c].push_back(offset);
+      sizes[c].push_back(size);
+      raw_sizes[c].push_back(raw_size);
+    }
+  }
+
+  q.resize(num_columns);
+  frame.columns.resize(num_columns);
+  std::vector<char> block, planes;
+  for (uint32 c = 0; c < num_columns; c++) {
+    auto &d = descriptors[c];
+    auto &column = frame.columns[c];
+    column.field = d.field;
+    column.data.resize(n * Frame::get_field_bytes(d.field));
+    bool temporal = d.coding == FrameCoding::quantized_delta ||
+                    d.coding == FrameCoding::delta;
+    std::size_t count = n * d.components;
+    TC_ASSERT_INFO(!temporal || q[c].size() == count,
+                   "Delta frame read without its previous frame");
+    if (d.coding != FrameCoding::raw) {
+      q[c].resize(count);
+    }
+    int width = d.coding == FrameCoding::raw &&
+                        Frame::get_field_type(d.field) == FrameFieldType::u8
+                    ? 1
+                    : 4;
+    std::size_t j = 0;  // Value index
+    for (uint32 b = 0; b < d.num_blocks; b++) {
+      std::fseek(f, (long)offsets[c][b], SEEK_SET);
+      block.resize(sizes[c][b]);
+      get(block.data(), block.size());
+      planes.resize(raw_sizes[c][b]);
+      if (sizes[c][b] == raw_sizes[c][b]) {
+        std::swap(block, planes);
+      } else {
+#ifdef MPM_USE_ZLIB
+        uLongf raw_size = raw_sizes[c][b];
+        int ret = uncompress((Bytef *)planes.data(), &raw_size,
+                             (const Bytef *)block.data(), block.size());
+        TC_ASSERT_INFO(ret == Z_OK && raw_size == raw_sizes[c][b],
+                       "Corrupt .mpmz block");
+#else
+        TC_ERROR("Compressed .mpmz frames need zlib");
+#endif
+      }
+      std::size_t num_values = planes.size() / width;
+      char *dst = column.data.data() + j * width;
+      if (d.coding == FrameCoding::raw) {
+        merge_byte_planes(planes.data(), dst, num_values, width);
+        j += num_values;
+        continue;
+      }
+      std::vector<uint32> coded(num_values);
+      merge_byte_planes(planes.data(), reinterpret_cast<char *>(coded.data()),
+                        num_values, 4);
+      for (std::size_t i = 0; i < num_values; i++, j++) {
+        int k = (int)(j % d.components);
+        int32 delta = zigzag_decode(coded[i]);
+        int32 value;
+        if (d.coding == FrameCoding::particle_delta) {
+          int32 reference = j >= (std::size_t)d.components
+                                ? q[c][j - d.components]
+                                : 0;
+          value = (int32)((uint32)reference + (uint32)delta);
+        } else if (temporal) {
+          value = (int32)((uint32)q[c][j] + (uint32)delta);
+        } else {
+          value = delta;
+        }
+        q[c][j] = value;
+        if (d.coding == FrameCoding::quantized ||
+            d.coding == FrameCoding::quantized_delta) {
+          column.template get<float32>()[j] =
+              (float32)(d.origin[k] + (float64)value * d.step[k]);
+        } else {
+          column.template get<int32>()[j] = value;
+        }
+      }
+    }
+    TC_ASSERT_INFO(j == count, "Corrupt .mpmz column");
+  }
+  std::fclose(f);
+}
+
+template class CompressedFrameEncoder<2>;
+template class CompressedFrameEncoder<3>;
+template class CompressedFrameDecoder<2>;
+template class CompressedFrameDecoder<3>;
+
+TC_NAMESPACE_END
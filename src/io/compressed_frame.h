@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "particle_frame.h"
+
+TC_NAMESPACE_BEGIN
+
+// Compressed particle frames (.mpmz), an encoding of ParticleFrame.
+//
+// Float fields are quantized to a fixed number of bits over their per-frame
+// range, per component (for positions, the bounding box), with an error of at
+// most half a step; 0 bits keeps them exact. Between keyframes, quantized and
+// integer fields store the difference to the previous frame, as long as the
+// particles (ids) are the same. In keyframes, integer fields store the
+// difference to the previous particle (ids are increasing). The values are
+// zigzag coded, split into byte planes and zlib compressed in blocks of
+// particles, so that frames can be decoded block by block.
+//
+//   char[4] "MPMZ", uint32 version, uint32 dim, uint32 num_columns,
+//   uint64 num_particles, int32 frame, uint32 block_size, float64 t,
+//   num_columns x {char[32] name, uint8 type, uint8 components, uint8 coding,
+//                  uint8 bits, uint32 num_blocks, float32 origin[3],
+//                  float32 step[3]},
+//   for each column, num_blocks x {uint64 offset, uint32 size,
+//                                  uint32 raw_size},
+//   blocks; a block with size == raw_size is stored uncompressed.
+//
+// A value is origin + q * step, q the (accumulated) quantized value. See
+// scripts/mpm_frame.py for a numpy reader.
+enum class FrameCoding : uint8 {
+  raw = 0,              // Bytes as they are
+  quantized = 1,        // q
+  quantized_delta = 2,  // q - q of the previous frame
+  delta = 3,            // Integers, minus the previous frame
+  particle_delta = 4,   // Integers, minus the previous particle
+};
+
+// Keeps the previous frame, for temporal deltas. Frames must be written in
+// order.
+template <int dim>
+class CompressedFrameEncoder {
+ public:
+  static constexpr uint32 version = 1;
+  static constexpr uint32 block_size = 1 << 16;
+
+  // Quantization bits of float fields ("field:bits,...", others keep 16,
+  // positions 20), keyframe interval (1: no temporal deltas) and zlib level
+  void initialize(const std::string &bits,
+                  int keyframe_interval,
+                  int compression_level);
+
+  void write(const ParticleFrame<dim> &frame,
+             const std::vector<FrameField> &fields,
+             const std::string &file_name);
+
+ private:
+  struct State {
+    FrameField field;
+    FrameCoding coding;
+    int bits;
+    float32 origin[3];
+    float32 step[3];
+    // Quantized values, or the integer values
+    std::vector<int32> q;
+  };
+
+  int field_bits[(int)FrameField::num_fields];
+  int keyframe_interval = 10;
+  int compression_level = 1;
+  // Frames since the last keyframe, -1 before the first frame
+  int num_delta_frames = -1;
+  std::vector<int32> ids;
+  std::vector<State> states;
+};
+
+// Decodes .mpmz frames, block by block. Frames must be read in order from a
+// keyframe on.
+template <int dim>
+class CompressedFrameDecoder {
+ public:
+  // Columns are decoded to their ParticleFrame types
+  void read(const std::string &file_name, ParticleFrame<dim> &frame);
+
+ private:
+  // Per column of the previous frame
+  std::vector<std::vector<int32>> q;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,432 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <Partio.h>
+#include <taichi/system/timer.h>
+#include <tbb/tbb.h>
+#include "frame_writer.h"
+
+TC_NAMESPACE_BEGIN
+
+// Text outputs are formatted in chunks of particles in parallel, then written
+// in order
+constexpr int frame_text_chunk_size = 1 << 14;
+
+static FILE *open_output(const std::string &file_name) {
+  FILE *f = std::fopen(file_name.c_str(), "w");
+  if (!f) {
+    TC_ERROR("Cannot open {} for writing", file_name);
+  }
+  return f;
+}
+
+template <typename F>
+static void write_text(FILE *f, int n, const F &format_particle) {
+  int num_chunks = (n + frame_text_chunk_size - 1) / frame_text_chunk_size;
+  std::vector<std::string> chunks(num_chunks);
+  tbb::parallel_for(0, num_chunks, [&](int c) {
+    int end = std::min(n, (c + 1) * frame_text_chunk_size);
+    for (int i = c * frame_text_chunk_size; i < end; i++) {
+      chunks[c] += format_particle(i);
+    }
+  });
+  for (auto &chunk : chunks) {
+    std::fwrite(chunk.data(), 1, chunk.size(), f);
+  }
+}
+
+template <int dim>
+void FrameSnapshot<dim>::set_outputs(const Config &config) {
+  directory = config.get_string("frame_directory");
+  output_partio = config.get("write_partio", false);
+  output_rigid_body = config.get("write_rigid_body", false);
+  output_particle = config.get("write_particle", false);
+  output_dataset = config.get("write_dataset", false);
+  output_frame = config.get("write_frame", false);
+  output_compressed_frame = config.get("write_compressed_frame", false);
+  verbose_bgeo = config.get("verbose_bgeo", false);
+  frame_fields = ParticleFrame<dim>::parse_fields(
+      config.get("frame_fields", std::string(default_frame_fields)));
+}
+
+template <int dim>
+std::vector<FrameField> FrameSnapshot<dim>::get_fields() const {
+  using F = FrameField;
+  bool needed[(int)F::num_fields] = {false};
+  auto need = [&](std::initializer_list<F> fields) {
+    for (auto field : fields) {
+      needed[(int)field] = true;
+    }
+  };
+  if (output_partio) {
+    need({F::id, F::type, F::position, F::velocity, F::dt_limit,
+          F::stiffness_limit, F::cfl_limit, F::gf, F::pressure,
+          F::rigid_impulse});
+    if (verbose_bgeo) {
+      need({F::mass, F::boundary_normal, F::debug, F::states,
+            F::boundary_distance, F::near_boundary, F::apic_frobenius_norm});
+    }
+  }
+  if (output_particle) {
+    need({F::type, F::position, F::velocity, F::near_boundary,
+          F::boundary_distance, F::shear_stress, F::pressure, F::gf});
+  }
+  if (output_dataset) {
+    need({F::type, F::position, F::velocity});
+  }
+  if (output_frame || output_compressed_frame) {
+    for (auto field : frame_fields) {
+      needed[(int)field] = true;
+    }
+  }
+  if (output_compressed_frame) {
+    // For temporal deltas
+    need({F::id});
+  }
+  std::vector<FrameField> fields;
+  for (int i = 0; i < (int)F::num_fields; i++) {
+    if (needed[i]) {
+      fields.push_back(F(i));
+    }
+  }
+  return fields;
+}
+
+template <int dim>
+void FrameSnapshot<dim>::write(CompressedFrameEncoder<dim> &encoder) const {
+  if (output_partio) {
+    write_partio(fmt::format("{}/{:04}.bgeo", directory, frame_count));
+  }
+  if (output_rigid_body) {
+    for (auto &rigid : rigids) {
+      write_rigid_body(rigid, fmt::format("{}/rigid_{:03}_{:04}", directory,
+                                          rigid.id, frame_count));
+    }
+  }
+  if (output_particle) {
+    write_particle(fmt::format("{}/particle_{:04}", directory, frame_count));
+  }
+  if (output_dataset) {
+    TC_ASSERT_INFO(!rigids.empty(), "'write_dataset' needs a rigid body");
+    write_dataset(rigids[0],
+                  fmt::format("{}/ds_{:04}", directory, frame_count));
+  }
+  if (output_frame) {
+    particles.write(
+        fmt::format("{}/frame_{:04}.mpmf", directory, frame_count),
+        frame_fields);
+  }
+  if (output_compressed_frame) {
+    encoder.write(particles, frame_fields,
+                  fmt::format("{}/frame_{:04}.mpmz", directory, frame_count));
+  }
+}
+
+template <int dim>
+void FrameSnapshot<dim>::write_partio(const std::string &file_name) const {
+  using F = FrameField;
+  Partio::ParticlesDataMutable *parts = Partio::create();
+  Partio::ParticleAttribute posH, vH, mH, typeH, normH, statH, boundH, distH,
+      debugH, indexH, limitH, apicH, gfH, prH, muH, rigid_impulseH, isFreeH;
+
+  posH = parts->addAttribute("position", Partio::VECTOR, 3);
+  typeH = parts->addAttribute("type", Partio::INT, 1);
+  indexH = parts->addAttribute("index", Partio::INT, 1);
+  limitH = parts->addAttribute("limit", Partio::INT, 3);
+  vH = parts->addAttribute("v", Partio::VECTOR, 3);
+  gfH = parts->addAttribute("gf", Partio::FLOAT, 1);  // granular fluidity
+  prH = parts->addAttribute("pr", Partio::FLOAT, 1);  // pressure
+  muH = parts->addAttribute("mu", Partio::FLOAT, 1);  // friction coeff
+  rigid_impulseH = parts->addAttribute("rigid_impulse", Partio::VECTOR, 3);
+  isFreeH = parts->addAttribute("free", Partio::INT, 1);
+  if (verbose_bgeo) {
+    mH = parts->addAttribute("m", Partio::VECTOR, 1);
+    normH = parts->addAttribute("boundary_normal", Partio::VECTOR, 3);
+    debugH = parts->addAttribute("debug", Partio::VECTOR, 3);
+    statH = parts->addAttribute("states", Partio::INT, 1);
+    distH = parts->addAttribute("boundary_distance", Partio::FLOAT, 1);
+    boundH = parts->addAttribute("near_boundary", Partio::INT, 1);
+    apicH = parts->addAttribute("apic_frobenius_norm", Partio::FLOAT, 1);
+  }
+
+  auto column = [&](FrameField field) { return particles.find(field); };
+  auto id = column(F::id)->template get<int32>();
+  auto type = column(F::type)->template get<uint8>();
+  auto pos = column(F::position)->template get<float32>();
+  auto vel = column(F::velocity)->template get<float32>();
+  auto dt_limit = column(F::dt_limit)->template get<int32>();
+  auto stiffness_limit = column(F::stiffness_limit)->template get<int32>();
+  auto cfl_limit = column(F::cfl_limit)->template get<int32>();
+  auto gf = column(F::gf)->template get<float32>();
+  auto pressure = column(F::pressure)->template get<float32>();
+  auto rigid_impulse = column(F::rigid_impulse)->template get<float32>();
+
+  // Attribute storage does not move once the particles are added
+  int n = (int)particles.num_particles;
+  parts->addParticles(n);
+  auto write_vector = [&](Partio::ParticleAttribute &attr, int i,
+                          const float32 *v, int components) {
+    float32 *p = parts->dataWrite<float32>(attr, i);
+    for (int k = 0; k < 3; k++) {
+      p[k] = k < components ? v[i * components + k] : 0.f;
+    }
+  };
+  tbb::parallel_for(0, n, [&](int i) {
+    write_vector(posH, i, pos, dim);
+    write_vector(vH, i, vel, dim);
+    write_vector(rigid_impulseH, i, rigid_impulse, dim);
+    parts->dataWrite<int>(typeH, i)[0] = type[i];
+    parts->dataWrite<int>(indexH, i)[0] = id[i];
+    int *limit_p = parts->dataWrite<int>(limitH, i);
+    limit_p[0] = dt_limit[i];
+    limit_p[1] = stiffness_limit[i];
+    limit_p[2] = cfl_limit[i];
+    parts->dataWrite<float32>(gfH, i)[0] = gf[i];
+    parts->dataWrite<float32>(prH, i)[0] = pressure[i];
+    // mu_visual and is_free are no longer kept on the particles
+    parts->dataWrite<float32>(muH, i)[0] = 0.f;
+    parts->dataWrite<int>(isFreeH, i)[0] = 0;
+  });
+  if (verbose_bgeo) {
+    auto mass = column(F::mass)->template get<float32>();
+    auto normal = column(F::boundary_normal)->template get<float32>();
+    auto debug = column(F::debug)->template get<float32>();
+    auto states = column(F::states)->template get<uint32>();
+    auto distance = column(F::boundary_distance)->template get<float32>();
+    auto near_boundary = column(F::near_boundary)->template get<uint8>();
+    auto apic = column(F::apic_frobenius_norm)->template get<float32>();
+    tbb::parallel_for(0, n, [&](int i) {
+      parts->dataWrite<float32>(mH, i)[0] = mass[i];
+      write_vector(normH, i, normal, dim);
+      write_vector(debugH, i, debug, 3);
+      parts->dataWrite<int>(statH, i)[0] = (int)states[i];
+      parts->dataWrite<int>(boundH, i)[0] = near_boundary[i];
+      parts->dataWrite<float32>(distH, i)[0] =
+          distance[i] * (float32)inv_delta_x;
+      parts->dataWrite<float32>(apicH, i)[0] = apic[i];
+    });
+  }
+  Partio::write(file_name.c_str(), *parts);
+  parts->release();
+}
+
+template <int dim>
+void FrameSnapshot<dim>::write_rigid_body(const Rigid &rigid,
+                                          const std::string &file_name) const {
+  TC_STATIC_IF(dim == 2) {
+    FILE *f = open_output(file_name + std::string(".poly"));
+    fmt::print(f, "POINTS\n");
+    int index = 0;
+    for (auto &v : rigid.vertices) {
+      fmt::print(f, "{}: {} {} 0.0\n", ++index, v.x, v.y);
+    }
+    fmt::print(f, "POLYS\n");
+    for (int i = 1; i <= index / 2; ++i) {
+      fmt::print(f, "{}: {} {}\n", i, i * 2 - 1, i * 2);
+    }
+    fmt::print(f, "END\n");
+    fclose(f);
+  }
+  TC_STATIC_ELSE {
+    FILE *f = open_output(file_name + std::string(".obj"));
+    for (auto &v : rigid.vertices) {
+      fmt::print(f, "v {} {} {}\n", v[0], v[1], v[2]);
+    }
+    int num_elements = (int)rigid.vertices.size() / dim;
+    for (int counter = 0; counter < num_elements; counter++) {
+      fmt::print(f, "f {} {} {}\n", dim * counter + 1, dim * counter + 2,
+                 dim * counter + 3);
+    }
+    std::fclose(f);
+
+    FILE *g = open_output(file_name + std::string(".txt"));
+    auto &force = rigid.force;
+    auto &torque = rigid.torque;
+    auto &position = rigid.position;
+    fmt::print(g, "{} {} {} {} {} {} {} {} {}\n", force[0], force[1],
+               force[2], torque[0], torque[1], torque[2], position[0],
+               position[1], position[2]);
+    std::fclose(g);
+  }
+  TC_STATIC_END_IF
+}
+
+template <int dim>
+void FrameSnapshot<dim>::write_particle(const std::string &file_name) const {
+  using F = FrameField;
+  auto type = particles.find(F::type)->template get<uint8>();
+  auto pos = particles.find(F::position)->template get<float32>();
+  auto vel = particles.find(F::velocity)->template get<float32>();
+  auto bound = particles.find(F::near_boundary)->template get<uint8>();
+  auto dist = particles.find(F::boundary_distance)->template get<float32>();
+  auto tau = particles.find(F::shear_stress)->template get<float32>();
+  auto pres = particles.find(F::pressure)->template get<float32>();
+  auto gf = particles.find(F::gf)->template get<float32>();
+  // Missing components of 2D vectors are written as 0
+  auto component = [](const float32 *v, int i, int k) {
+    return k < dim ? v[i * dim + k] : 0.f;
+  };
+
+  FILE *f = open_output(file_name + std::string(".txt"));
+  write_text(f, (int)particles.num_particles, [&](int i) {
+    return fmt::format("{} {} {} {} {} {} {} {} {} {} {} {}\n", (int)type[i],
+                       component(pos, i, 0), component(pos, i, 1),
+                       component(pos, i, 2), component(vel, i, 0),
+                       component(vel, i, 1), component(vel, i, 2),
+                       (int)bound[i], dist[i], tau[i], pres[i], gf[i]);
+  });
+  std::fclose(f);
+}
+
+template <int dim>
+void FrameSnapshot<dim>::write_dataset(const Rigid &rigid,
+                                       const std::string &file_name) const {
+  using F = FrameField;
+  auto type = particles.find(F::type)->template get<uint8>();
+  auto pos = particles.find(F::position)->template get<float32>();
+  auto vel = particles.find(F::velocity)->template get<float32>();
+  auto component = [](const float32 *v, int i, int k) {
+    return k < dim ? v[i * dim + k] : 0.f;
+  };
+
+  Vector3 force(0.0_f);
+  for (int k = 0; k < dim; k++) {
+    force[k] = rigid.force[k];
+  }
+  FILE *f = open_output(file_name + std::string(".csv"));
+  fmt::print(f, "{}, {}, {}, {}\n", force[0], force[1], force[2],
+             length(rigid.velocity));
+  write_text(f, (int)particles.num_particles, [&](int i) {
+    if (type[i] == 0) {
+      float32 vel_mag = 0;
+      for (int k = 0; k < dim; k++) {
+        vel_mag += vel[i * dim + k] * vel[i * dim + k];
+      }
+      return fmt::format("{}, {}, {}, {}, {}\n", 0, component(pos, i, 0),
+                         component(pos, i, 1), component(pos, i, 2),
+                         std::sqrt(vel_mag));
+    } else {
+      return fmt::format("{}, {}, {}, {}\n", (int)type[i],
+                         component(pos, i, 0), component(pos, i, 1),
+                         component(pos, i, 2));
+    }
+  });
+  std::fclose(f);
+}
+
+template <int dim>
+FrameWriter<dim>::FrameWriter(const Config &config) {
+  int num_buffers = config.get("output_buffers", 2);
+  TC_ASSERT_INFO(num_buffers >= 1, "'output_buffers' must be at least 1");
+  encoder.initialize(config.get("frame_bits", std::string("")),
+                     config.get("frame_keyframe_interval", 10),
+                     config.get("frame_compression_level", 1));
+  for (int i = 0; i < num_buffers; i++) {
+    buffers.push_back(std::make_unique<FrameSnapshot<dim>>());
+    free_buffers.push_back(buffers.back().get());
+  }
+  thread = std::thread([this]() { run(); });
+}
+
+template <int dim>
+FrameWriter<dim>::~FrameWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  thread.join();
+  if (error) {
+    try {
+      std::rethrow_exception(error);
+    } catch (const std::exception &e) {
+      TC_WARN("Frame output failed: {}", e.what());
+    } catch (...) {
+      TC_WARN("Frame output failed");
+    }
+  }
+}
+
+template <int dim>
+void FrameWriter<dim>::rethrow() {
+  if (error) {
+    auto e = error;
+    error = nullptr;
+    std::rethrow_exception(e);
+  }
+}
+
+template <int dim>
+FrameSnapshot<dim> &FrameWriter<dim>::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  TC_ASSERT_INFO(acquired == nullptr, "Previous snapshot not submitted");
+  rethrow();
+  if (free_buffers.empty()) {
+    if (!stalled) {
+      TC_WARN("Frame output is falling behind; waiting for the writer");
+      stalled = true;
+    }
+    auto t0 = Time::get_time();
+    cv.wait(lock, [&]() { return !free_buffers.empty() || error; });
+    stall_time += Time::get_time() - t0;
+    rethrow();
+  }
+  acquired = free_buffers.back();
+  free_buffers.pop_back();
+  return *acquired;
+}
+
+template <int dim>
+void FrameWriter<dim>::submit() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    TC_ASSERT_INFO(acquired != nullptr, "No snapshot acquired");
+    queue.push_back(acquired);
+    acquired = nullptr;
+  }
+  cv.notify_all();
+}
+
+template <int dim>
+void FrameWriter<dim>::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return (queue.empty() && !writing) || error; });
+  rethrow();
+}
+
+template <int dim>
+void FrameWriter<dim>::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [&]() { return !queue.empty() || stopping; });
+    if (queue.empty()) {
+      break;
+    }
+    FrameSnapshot<dim> *snapshot = queue.front();
+    queue.pop_front();
+    writing = true;
+    lock.unlock();
+    std::exception_ptr e;
+    try {
+      snapshot->write(encoder);
+    } catch (...) {
+      e = std::current_exception();
+    }
+    lock.lock();
+    writing = false;
+    if (e && !error) {
+      error = e;
+    }
+    free_buffers.push_back(snapshot);
+    cv.notify_all();
+  }
+}
+
+template class FrameSnapshot<2>;
+template class FrameSnapshot<3>;
+template class FrameWriter<2>;
+template class FrameWriter<3>;
+
+TC_NAMESPACE_END
@@ -0,0 +1,122 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "compressed_frame.h"
+#include "particle_frame.h"
+
+TC_NAMESPACE_BEGIN
+
+// Everything the frame outputs (write_partio, write_rigid_body,
+// write_particle, write_dataset, write_frame, write_compressed_frame) need
+// from the solver, copied at
+// frame time, so that they can be encoded and written later on another
+// thread. Buffers are reused from frame to frame.
+template <int dim>
+class FrameSnapshot {
+ public:
+  using Vector = VectorND<dim, real>;
+
+  struct Rigid {
+    int id;
+    // World space, dim per mesh element. Only with output_rigid_body.
+    std::vector<Vector> vertices;
+    Vector force, torque, position, velocity;
+  };
+
+  // Requested outputs, from the config 'write_*' flags
+  std::string directory;
+  bool output_partio = false;
+  bool output_rigid_body = false;
+  bool output_particle = false;
+  bool output_dataset = false;
+  bool output_frame = false;
+  bool output_compressed_frame = false;
+  bool verbose_bgeo = false;
+  std::vector<FrameField> frame_fields;
+
+  uint32 frame_count = 0;
+  real inv_delta_x = 0;
+  // In id order
+  ParticleFrame<dim> particles;
+  // Excluding the background rigid body
+  std::vector<Rigid> rigids;
+
+  void set_outputs(const Config &config);
+
+  // Particle fields the requested outputs need
+  std::vector<FrameField> get_fields() const;
+
+  // Writes every requested output, named after frame_count in directory.
+  // Compressed frames go through encoder, which keeps the previous frame.
+  void write(CompressedFrameEncoder<dim> &encoder) const;
+
+  void write_partio(const std::string &file_name) const;
+  void write_rigid_body(const Rigid &rigid, const std::string &file_name) const;
+  void write_particle(const std::string &file_name) const;
+  void write_dataset(const Rigid &rigid, const std::string &file_name) const;
+};
+
+// Writes snapshots on a thread of its own while the solver carries on.
+//
+// There are num_buffers snapshots, so output memory is bounded: when all of
+// them are queued (the disk is falling behind), acquire() waits for the
+// oldest to be written. An error on the writer thread is rethrown by the next
+// acquire() or flush().
+//
+// Config: 'output_buffers' (2), and for compressed frames 'frame_bits' (see
+// CompressedFrameEncoder::initialize), 'frame_keyframe_interval' (10) and
+// 'frame_compression_level' (1).
+template <int dim>
+class FrameWriter {
+ public:
+  explicit FrameWriter(const Config &config);
+
+  // Writes the queued snapshots first
+  ~FrameWriter();
+
+  // A free snapshot to fill in, then hand over with submit()
+  FrameSnapshot<dim> &acquire();
+
+  void submit();
+
+  // Waits until every submitted snapshot is written
+  void flush();
+
+  // Seconds acquire() spent waiting for a free buffer
+  float64 get_stall_time() const {
+    return stall_time;
+  }
+
+ private:
+  void run();
+  void rethrow();
+
+  CompressedFrameEncoder<dim> encoder;
+  std::vector<std::unique_ptr<FrameSnapshot<dim>>> buffers;
+  std::vector<FrameSnapshot<dim> *> free_buffers;
+  std::deque<FrameSnapshot<dim> *> queue;
+  FrameSnapshot<dim> *acquired = nullptr;
+  // A snapshot is being written
+  bool writing = false;
+  bool stopping = false;
+  std::exception_ptr error;
+  float64 stall_time = 0;
+  bool stalled = false;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread thread;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,336 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <cstring>
+#include <numeric>
+#include <sstream>
+#include <tbb/tbb.h>
+#include "../mpm.h"
+#include "particle_frame.h"
+
+TC_NAMESPACE_BEGIN
+
+static const char *frame_field_names[] = {
+    "id",
+    "type",
+    "position",
+    "velocity",
+    "mass",
+    "volume",
+    "pressure",
+    "shear_stress",
+    "gf",
+    "near_boundary",
+    "boundary_distance",
+    "states",
+    "dt_limit",
+    "rigid_impulse",
+    "stiffness_limit",
+    "cfl_limit",
+    "boundary_normal",
+    "debug",
+    "apic_frobenius_norm"};
+
+static_assert(sizeof(frame_field_names) / sizeof(frame_field_names[0]) ==
+                  (int)FrameField::num_fields,
+              "A name is needed for every frame field");
+
+template <int dim>
+const char *ParticleFrame<dim>::get_field_name(FrameField field) {
+  return frame_field_names[(int)field];
+}
+
+template <int dim>
+FrameFieldType ParticleFrame<dim>::get_field_type(FrameField field) {
+  switch (field) {
+    case FrameField::id:
+    case FrameField::dt_limit:
+    case FrameField::stiffness_limit:
+    case FrameField::cfl_limit:
+      return FrameFieldType::i32;
+    case FrameField::type:
+    case FrameField::near_boundary:
+      return FrameFieldType::u8;
+    case FrameField::states:
+      return FrameFieldType::u32;
+    default:
+      return FrameFieldType::f32;
+  }
+}
+
+template <int dim>
+int ParticleFrame<dim>::get_field_components(FrameField field) {
+  switch (field) {
+    case FrameField::position:
+    case FrameField::velocity:
+    case FrameField::rigid_impulse:
+    case FrameField::boundary_normal:
+      return dim;
+    case FrameField::debug:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+template <int dim>
+int ParticleFrame<dim>::get_field_bytes(FrameField field) {
+  int component_bytes = get_field_type(field) == FrameFieldType::u8 ? 1 : 4;
+  return component_bytes * get_field_components(field);
+}
+
+template <int dim>
+std::vector<FrameField> ParticleFrame<dim>::parse_fields(
+    const std::string &names) {
+  std::vector<FrameField> fields;
+  std::stringstream ss(names);
+  std::string name;
+  while (std::getline(ss, name, ',')) {
+    name.erase(0, name.find_first_not_of(' '));
+    name.erase(name.find_last_not_of(' ') + 1);
+    if (name == "all") {
+      for (int i = 0; i < (int)FrameField::num_fields; i++) {
+        fields.push_back(FrameField(i));
+      }
+      continue;
+    }
+    int i = 0;
+    while (i < (int)FrameField::num_fields && name != frame_field_names[i]) {
+      i++;
+    }
+    if (i == (int)FrameField::num_fields) {
+      TC_ERROR("Unknown frame field '{}'", name);
+    }
+    fields.push_back(FrameField(i));
+  }
+  return fields;
+}
+
+template <int dim>
+static void gather_field(const MPMParticle<dim> &p,
+                         FrameField field,
+                         char *dst) {
+  auto f = reinterpret_cast<float32 *>(dst);
+  auto write_vector = [&](const VectorND<dim, real> &v) {
+    for (int k = 0; k < dim; k++) {
+      f[k] = (float32)v[k];
+    }
+  };
+  switch (field) {
+    case FrameField::id:
+      *reinterpret_cast<int32 *>(dst) = p.id;
+      break;
+    case FrameField::type:
+      *reinterpret_cast<uint8 *>(dst) = (uint8)p.is_rigid();
+      break;
+    case FrameField::position:
+      write_vector(p.pos);
+      break;
+    case FrameField::velocity:
+      write_vector(p.get_velocity());
+      break;
+    case FrameField::mass:
+      f[0] = (float32)p.get_mass();
+      break;
+    case FrameField::volume:
+      f[0] = (float32)p.vol;
+      break;
+    case FrameField::pressure:
+      f[0] = (float32)p.p;
+      break;
+    case FrameField::shear_stress:
+      f[0] = (float32)p.tau;
+      break;
+    case FrameField::gf:
+      f[0] = (float32)p.gf;
+      break;
+    case FrameField::near_boundary:
+      *reinterpret_cast<uint8 *>(dst) = (uint8)p.near_boundary();
+      break;
+    case FrameField::boundary_distance:
+      f[0] = (float32)p.boundary_distance;
+      break;
+    case FrameField::states:
+      *reinterpret_cast<uint32 *>(dst) = p.states;
+      break;
+    case FrameField::dt_limit:
+      *reinterpret_cast<int32 *>(dst) = p.dt_limit;
+      break;
+    case FrameField::rigid_impulse:
+      write_vector(p.rigid_impulse);
+      break;
+    case FrameField::stiffness_limit:
+      *reinterpret_cast<int32 *>(dst) = p.stiffness_limit;
+      break;
+    case FrameField::cfl_limit:
+      *reinterpret_cast<int32 *>(dst) = p.cfl_limit;
+      break;
+    case FrameField::boundary_normal:
+      write_vector(p.boundary_normal);
+      break;
+    case FrameField::debug: {
+      Vector3 debug = p.get_debug_info();
+      for (int k = 0; k < 3; k++) {
+        f[k] = (float32)debug[k];
+      }
+      break;
+    }
+    case FrameField::apic_frobenius_norm:
+      f[0] = (float32)(0.5_f * (p.apic_b - p.apic_b.transposed()))
+                 .frobenius_norm();
+      break;
+    default:
+      TC_NOT_IMPLEMENTED
+  }
+}
+
+template <int dim>
+void ParticleFrame<dim>::gather(const MPM<dim> &mpm,
+                                const std::vector<FrameField> &fields) {
+  auto &particles = mpm.particles;
+  auto &allocator = mpm.allocator;
+  int n = (int)particles.size();
+  frame = (int32)mpm.frame_count;
+  t = mpm.current_t;
+  num_particles = (uint64)n;
+
+  // Rank of each id among the ids present: mark, then prefix-sum by chunks
+  int32 max_id = tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, n), int32(-1),
+      [&](const tbb::blocked_range<int> &range, int32 m) {
+        for (int i = range.begin(); i < range.end(); i++) {
+          m = std::max(m, allocator.get_const(particles[i])->id);
+        }
+        return m;
+      },
+      [](int32 a, int32 b) { return std::max(a, b); });
+  uint32 num_ids = (uint32)(max_id + 1);
+  id_ranks.assign(num_ids, 0);
+  tbb::parallel_for(0, n, [&](int i) {
+    id_ranks[allocator.get_const(particles[i])->id] = 1;
+  });
+  constexpr uint32 chunk_size = 1 << 16;
+  int num_chunks = (int)((num_ids + chunk_size - 1) / chunk_size);
+  std::vector<uint32> chunk_begins(num_chunks + 1, 0);
+  tbb::parallel_for(0, num_chunks, [&](int c) {
+    uint32 end = std::min(num_ids, (c + 1) * chunk_size);
+    for (uint32 i = c * chunk_size; i < end; i++) {
+      chunk_begins[c + 1] += id_ranks[i];
+    }
+  });
+  std::partial_sum(chunk_begins.begin(), chunk_begins.end(),
+                   chunk_begins.begin());
+  TC_ASSERT_INFO(chunk_begins[num_chunks] == (uint32)n,
+                 "Particle ids are not unique");
+  tbb::parallel_for(0, num_chunks, [&](int c) {
+    uint32 end = std::min(num_ids, (c + 1) * chunk_size);
+    uint32 rank = chunk_begins[c];
+    for (uint32 i = c * chunk_size; i < end; i++) {
+      uint32 present = id_ranks[i];
+      id_ranks[i] = rank;
+      rank += present;
+    }
+  });
+
+  columns.resize(fields.size());
+  std::vector<int> bytes(fields.size());
+  for (int c = 0; c < (int)fields.size(); c++) {
+    columns[c].field = fields[c];
+    bytes[c] = get_field_bytes(fields[c]);
+    columns[c].data.resize((std::size_t)n * bytes[c]);
+  }
+  tbb::parallel_for(0, n, [&](int i) {
+    const MPMParticle<dim> &p = *allocator.get_const(particles[i]);
+    std::size_t rank = id_ranks[p.id];
+    for (int c = 0; c < (int)columns.size(); c++) {
+      gather_field(p, columns[c].field, &columns[c].data[rank * bytes[c]]);
+    }
+  });
+}
+
+template <int dim>
+const typename ParticleFrame<dim>::Column *ParticleFrame<dim>::find(
+    FrameField field) const {
+  for (auto &column : columns) {
+    if (column.field == field) {
+      return &column;
+    }
+  }
+  return nullptr;
+}
+
+template <int dim>
+void ParticleFrame<dim>::write(const std::string &file_name) const {
+  std::vector<FrameField> fields;
+  for (auto &column : columns) {
+    fields.push_back(column.field);
+  }
+  write(file_name, fields);
+}
+
+template <int dim>
+void ParticleFrame<dim>::write(const std::string &file_name,
+                               const std::vector<FrameField> &fields) const {
+  std::vector<const Column *> selected;
+  for (auto field : fields) {
+    auto column = find(field);
+    if (!column) {
+      TC_ERROR("Frame field '{}' was not gathered", get_field_name(field));
+    }
+    selected.push_back(column);
+  }
+  auto align = [](uint64 offset) { return (offset + 63) / 64 * 64; };
+  std::vector<char> header;
+  auto put = [&](const void *data, std::size_t size) {
+    auto bytes = static_cast<const char *>(data);
+    header.insert(header.end(), bytes, bytes + size);
+  };
+  uint32 zero = 0;
+  uint32 version_ = version;
+  uint32 dim_ = dim;
+  uint32 num_columns = (uint32)selected.size();
+  put("MPMF", 4);
+  put(&version_, 4);
+  put(&dim_, 4);
+  put(&num_columns, 4);
+  put(&num_particles, 8);
+  put(&frame, 4);
+  put(&zero, 4);
+  put(&t, 8);
+  uint64 offset = align(header.size() + 48 * selected.size());
+  for (auto column : selected) {
+    char name[32] = {0};
+    std::strncpy(name, get_field_name(column->field), sizeof(name) - 1);
+    uint8 type = (uint8)get_field_type(column->field);
+    uint8 components = (uint8)get_field_components(column->field);
+    put(name, 32);
+    put(&type, 1);
+    put(&components, 1);
+    put(&zero, 2);
+    put(&zero, 4);
+    put(&offset, 8);
+    offset = align(offset + column->data.size());
+  }
+
+  FILE *f = std::fopen(file_name.c_str(), "wb");
+  if (!f) {
+    TC_ERROR("Cannot open {} for writing", file_name);
+  }
+  static const char padding[64] = {0};
+  uint64 position = header.size();
+  std::fwrite(header.data(), 1, header.size(), f);
+  for (auto column : selected) {
+    std::fwrite(padding, 1, align(position) - position, f);
+    position = align(position);
+    std::fwrite(column->data.data(), 1, column->data.size(), f);
+    position += column->data.size();
+  }
+  std::fclose(f);
+}
+
+template class ParticleFrame<2>;
+template class ParticleFrame<3>;
+
+TC_NAMESPACE_END
@@ -0,0 +1,104 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "../mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// Particle output fields. Vectors have dim components.
+enum class FrameField : uint8 {
+  id,                   // int32
+  type,                 // uint8, 1 for rigid boundary particles
+  position,             // float32 x dim
+  velocity,             // float32 x dim
+  mass,                 // float32
+  volume,               // float32
+  pressure,             // float32, p
+  shear_stress,         // float32, tau
+  gf,                   // float32, granular fluidity
+  near_boundary,        // uint8
+  boundary_distance,    // float32
+  states,               // uint32
+  dt_limit,             // int32
+  rigid_impulse,        // float32 x dim
+  stiffness_limit,      // int32
+  cfl_limit,            // int32
+  boundary_normal,      // float32 x dim
+  debug,                // float32 x 3, get_debug_info()
+  apic_frobenius_norm,  // float32, of the skew part of apic_b
+  num_fields
+};
+
+constexpr const char *default_frame_fields =
+    "id,type,position,velocity,pressure,shear_stress,gf";
+
+enum class FrameFieldType : uint8 { f32 = 0, i32 = 1, u8 = 2, u32 = 3 };
+
+// One frame of particle data, stored by column, particles in id order.
+//
+// gather() ranks particles by id with a counting pass over the id range
+// instead of a comparison sort, then scatters every particle's fields to its
+// rank in parallel. write() stores the columns as they are (.mpmf):
+//
+//   char[4] "MPMF", uint32 version, uint32 dim, uint32 num_columns,
+//   uint64 num_particles, int32 frame, uint32 0, float64 t,
+//   num_columns x {char[32] name, uint8 type, uint8 components, uint16 0,
+//                  uint32 0, uint64 offset},
+//   columns, each starting at its offset (64-byte aligned).
+//
+// See scripts/mpm_frame.py for a numpy reader.
+template <int dim>
+class ParticleFrame {
+ public:
+  static constexpr uint32 version = 1;
+
+  struct Column {
+    FrameField field;
+    std::vector<char> data;
+
+    template <typename T>
+    T *get() {
+      return reinterpret_cast<T *>(data.data());
+    }
+
+    template <typename T>
+    const T *get() const {
+      return reinterpret_cast<const T *>(data.data());
+    }
+  };
+
+  int32 frame = 0;
+  float64 t = 0;
+  uint64 num_particles = 0;
+  std::vector<Column> columns;
+
+  // Comma-separated field names, or "all"
+  static std::vector<FrameField> parse_fields(const std::string &names);
+  static const char *get_field_name(FrameField field);
+  static FrameFieldType get_field_type(FrameField field);
+  static int get_field_components(FrameField field);
+  static int get_field_bytes(FrameField field);
+
+  // Reuses the column buffers of earlier frames
+  void gather(const MPM<dim> &mpm, const std::vector<FrameField> &fields);
+
+  // nullptr if the field was not gathered
+  const Column *find(FrameField field) const;
+
+  void write(const std::string &file_name) const;
+  // Only the given columns, which must have been gathered
+  void write(const std::string &file_name,
+             const std::vector<FrameField> &fields) const;
+
+ private:
+  // Per id: rank among the ids present
+  std::vector<uint32> id_ranks;
+};
+
+TC_NAMESPACE_END
@@ -7,6 +7,8 @@
 #include <mpi.h>
 #endif
 
+#include <fstream>
+#include <sys/resource.h>
 #include <taichi/system/threading.h>
 #include <taichi/visual/texture.h>
 #include <taichi/math/svd.h>
@@ -14,6 +16,8 @@
 #include <taichi/common/asset_manager.h>
 #include <taichi/common/testing.h>
 #include <taichi/system/profiler.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_reduce.h>
 
 #include "articulation.h"
 #include "mpm.h"
@@ -23,6 +27,98 @@
 
 TC_NAMESPACE_BEGIN
 
+// options ---------------------------------------------------------------------
+void MPMOptions::initialize(const Config &config) {
+  optimized = config.get("optimized", true);
+  incremental_sort = config.get("incremental_sort", true);
+  benchmark_rasterize = config.get("benchmark_rasterize", false);
+  benchmark_resample = config.get("benchmark_resample", false);
+  coupling_iterations = config.get("coupling_iterations", 1);
+  visualize_cdf = config.get("visualize_cdf", false);
+  visualize_particle_cdf = config.get("visualize_particle_cdf", false);
+  particle_bc_at_levelset = config.get("particle_bc_at_levelset", false);
+  rigid_body_levelset_collision =
+      config.get("rigid_body_levelset_collision", false);
+  clean_boundary = config.get("clean_boundary", true);
+  particle_collision = config.get("particle_collision", false);
+  print_energy = config.get("print_energy", false);
+
+  compute_particle_impulses = config.get("compute_particle_impulses", false);
+  visualize_particle_impulses = config.get("visualize_particle_impulses", false);
+  affect_particle_impulses = config.get("affect_particle_impulses", false);
+  cdf_3d_modified = config.get("cdf_3d_modified", false);
+  cdf_expand = config.get<int>("cdf_expand", 0);
+  rigid_sdf = config.get("rigid_sdf", false);
+  rigid_sdf_band = config.get("rigid_sdf_band", 2.0_f);
+  baked_levelset = config.get("baked_levelset", false);
+  articulation_iterations = config.get("articulation_iterations", 100);
+  sand_climb = config.get("sand_climb", false);
+  rigid_body_gravity = config.get("rigidBody_gravity", true);
+  free_axis_in_position = config.get("free_axis_in_position", 0);
+  print_rigid_body_state = config.get("print_rigid_body_state", true);
+  rigid_body_collision = config.get<bool>("rigid_body_collision", true);
+  rigid_body_iterations = config.get("rigid_body_iterations", 5);
+  rigid_penalty = config.get("rigid_penalty", 1e3_f);
+  rigid_body_position_iterations =
+      config.get("rigid_body_position_iterations", true);
+
+  expr_leaky_levelset = config.get<int>("expr_leaky_levelset", 0);
+  hack_velocity = config.get<real>("hack_velocity", 0.0_f);
+  hack_time = config.get("hack_time", 0.0_f);
+  sand_speed = config.get("sand_speed", 0.0_f);
+  gravity_cutting = config.get("gravity_cutting", false);
+  sand_crawler = config.get("sand_crawler", false);
+  dirichlet_boundary_radius = config.get("dirichlet_boundary_radius", 0.0_f);
+
+  adaptive_dt = config.get("adaptive_dt", false);
+  real base_delta_t = config.get("base_delta_t", 1e-4_f) *
+                      config.get("dt-multiplier", 1.0_f);
+  min_delta_t = config.get("min_delta_t", 1e-2_f * base_delta_t);
+  max_delta_t = config.get("max_delta_t", 10.0_f * base_delta_t);
+  dt_history_size = config.get("dt_history_size", 100000);
+  dt_log_interval = config.get("dt_log_interval", 100);
+
+  async = config.get("async", false);
+  async_output = config.get("async_output", true);
+
+  remove_particles = config.get("remove_particles", 0);
+  remove_height = config.get("remove_height", 0.02_f);
+  warn_particle_deletion = config.get("warn_particle_deletion", true);
+
+  TC_ASSERT_INFO(coupling_iterations >= 1,
+                 "'coupling_iterations' must be positive");
+  TC_ASSERT_INFO(cdf_expand >= 0, "'cdf_expand' must be non-negative");
+  TC_ASSERT_INFO(rigid_sdf_band >= 1, "'rigid_sdf_band' must be at least 1");
+  if (rigid_sdf && cdf_3d_modified) {
+    TC_WARN("'cdf_3d_modified' has no effect with 'rigid_sdf'");
+  }
+  TC_ASSERT_INFO(0 < min_delta_t && min_delta_t <= max_delta_t,
+                 "Need 0 < 'min_delta_t' <= 'max_delta_t'");
+  TC_ASSERT_INFO(dt_history_size >= 0,
+                 "'dt_history_size' must be non-negative");
+  TC_ASSERT_INFO(dt_log_interval >= 1, "'dt_log_interval' must be positive");
+  if (async_output && config.get("perf_counters", false)) {
+    // The writer's tbb::parallel_for runs on the workers whose counters the
+    // stages sum, and would be counted in whatever stage overlaps it
+    TC_WARN("'perf_counters' turns 'async_output' off");
+    async_output = false;
+  }
+  if (async) {
+    TC_ASSERT_INFO(!adaptive_dt, "'async' and 'adaptive_dt' are exclusive");
+    TC_ASSERT_INFO(optimized, "'async' requires 'optimized' transfers");
+  }
+  if (sand_climb) {
+    TC_ASSERT_INFO(config.has_key("sand_texture"),
+                   "'sand_climb' requires 'sand_texture'");
+  }
+  if (!compute_particle_impulses &&
+      (visualize_particle_impulses || affect_particle_impulses)) {
+    TC_WARN(
+        "'visualize/affect_particle_impulses' have no effect without "
+        "'compute_particle_impulses'");
+  }
+}
+
 // initialize ------------------------------------------------------------------
 template <int dim>
 void MPM<dim>::initialize(const Config &config) {
@@ -30,6 +126,10 @@ void MPM<dim>::initialize(const Config &config) {
   TC_TRACE("BaseParticle size: {} B", sizeof(Particle));
   Simulation<dim>::initialize(config);
   config_backup = config;
+  options.initialize(config);
+  stage_metrics.initialize(config, false);
+  timeline.initialize(config);
+  perf_counters.initialize(config);
   res = config.get<Vectori>("res");
   apic_damping = config.get("apic_damping", 0.0f);
   rpic_damping = config.get("rpic_damping", 0.0f);
@@ -43,12 +143,19 @@ void MPM<dim>::initialize(const Config &config) {
                  "Please use 'base_delta_t' instead of 'delta_t'");
   base_delta_t = config.get("base_delta_t", 1e-4_f);
   base_delta_t *= config.get("dt-multiplier", 1.0_f);
+  current_delta_t = base_delta_t;
   reorder_interval = config.get<int>("reorder_interval", 1000);
   // cfl number
   cfl = config.get("cfl", 1.0f);
   particle_gravity = config.get<bool>("particle_gravity", true);
   // affine damping
   TC_LOAD_CONFIG(affine_damping, 0.0f);
+  if (options.async) {
+    // Grid gravity would need a per-node dt
+    TC_ASSERT_INFO(particle_gravity, "'async' requires 'particle_gravity'");
+    scheduler = std::make_unique<MPMScheduler<dim>>(*this);
+    scheduler->initialize(config);
+  }
 
   // spgrid --------------------------------------------------------------------
   spgrid_size = 4096;
@@ -65,11 +172,18 @@ void MPM<dim>::initialize(const Config &config) {
     grid = std::make_unique<SparseGrid>(spgrid_size, spgrid_size, spgrid_size);
   }
   TC_STATIC_END_IF
-  page_map = std::make_unique<SPGrid_Page_Map<log2_size>>(*grid);
-  rigid_page_map = std::make_unique<SPGrid_Page_Map<log2_size>>(*grid);
-  fat_page_map = std::make_unique<SPGrid_Page_Map<log2_size>>(*grid);
+  page_map = std::make_unique<PageMap>(*grid);
+  rigid_page_map = std::make_unique<PageMap>(*grid);
+  fat_page_map = std::make_unique<PageMap>(*grid);
   grid_region = Region(Vectori(0), res + VectorI(1), Vector(0)); // start, end, offset
 
+  // dirichlet boundary conditions ---------------------------------------------
+  // More regions may be added with the "add_dirichlet_region" action
+  dirichlet_regions.clear();
+  if (options.dirichlet_boundary_radius > 0.0_f) {
+    add_legacy_dirichlet_regions(config);
+  }
+
   /*
   // Restart?
   pakua = create_instance<Pakua>("json");
@@ -114,6 +228,9 @@ std::string MPM<dim>::add_particles(const Config &config) {
       ParticlePtr p_i;
       Particle *p;
       std::string type = config.get<std::string>("type");
+      if (options.adaptive_dt && type == "visco") {
+        TC_ERROR("Visco particles store a fixed dt; disable 'adaptive_dt'");
+      }
       std::tie(p_i, p) = allocator.allocate_particle(type);
 
       Config config_new = config;
@@ -130,10 +247,10 @@ std::string MPM<dim>::add_particles(const Config &config) {
       p->initialize(config_new);
       p->pos = coord;
 
-      if (config_backup.get("sand_climb", false)) {
+      if (options.sand_climb) {
         std::shared_ptr<Texture> texture = AssetManager::get_asset<Texture>(
             config_backup.get<int>("sand_texture"));
-        real speed = config_backup.get("sand_speed", 0.0_f);
+        real speed = options.sand_speed;
         real radius = 15.0_f / 180 * (real)M_PI;
         real x = p->pos[0] + this->current_t * speed * cos(radius);
         real y = p->pos[1] + this->current_t * speed * sin(radius);
@@ -346,9 +463,15 @@ std::vector<RenderParticle> MPM<dim>::get_render_particles() const {
 // added: Reset grid granular fluidity
 template <int dim>
 void MPM<dim>::reset_grid_granular_fluidity() {
-  parallel_for_each_active_grid([&](GridState<dim> &g) {
-    g.granular_fluidity = 0.0_f;
-  });
+  auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (!is_fat_block_needed(b)) {
+      return;
+    }
+    for (int i = 0; i < (int)SparseMask::elements_per_block; i++) {
+      g[i].granular_fluidity = 0.0_f;
+    }
+  };
+  parallel_for_each_block_with_index(block_op, true);
 }
 
 // normalize grid & apply external force ---------------------------------------
@@ -356,20 +479,45 @@ template <int dim>
 void MPM<dim>::normalize_grid_and_apply_external_force(
     Vector velocity_increment_) {
   VectorP velocity_increment(velocity_increment_, 0);
-  parallel_for_each_active_grid([&](GridState<dim> &g) {
-    // dim'th elements of "velocity_and_mass" store mass
-    real mass = g.velocity_and_mass[dim];
-    if (mass > 0) {
-      real inv_mass = 1.0_f / mass;
-      VectorP alpha(Vector(inv_mass), 1);
-      // Original:
-      // g.velocity_and_mass *= alpha;
-      // g.velocity_and_mass += velocity_increment;
-      g.velocity_and_mass =
-          fused_mul_add(g.velocity_and_mass,
-            alpha, velocity_increment); // a*b + c from "vector.h"
+  auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g_) {
+    if (!is_fat_block_needed(b)) {
+      return;
     }
-  });
+    for (int i = 0; i < (int)SparseMask::elements_per_block; i++) {
+      GridState<dim> &g = g_[i];
+      // dim'th elements of "velocity_and_mass" store mass
+      real mass = g.velocity_and_mass[dim];
+      if (mass > 0) {
+        real inv_mass = 1.0_f / mass;
+        VectorP alpha(Vector(inv_mass), 1);
+        // Original:
+        // g.velocity_and_mass *= alpha;
+        // g.velocity_and_mass += velocity_increment;
+        g.velocity_and_mass =
+            fused_mul_add(g.velocity_and_mass,
+              alpha, velocity_increment); // a*b + c from "vector.h"
+      }
+    }
+  };
+  parallel_for_each_block_with_index(block_op, true);
+}
+
+// bake levelset ---------------------------------------------------------------
+template <int dim>
+void MPM<dim>::bake_levelset() {
+  if (!baked_levelset.is_current(this->levelset)) {
+    baked_levelset.reset(this->levelset, grid_block_size());
+  }
+  auto blocks = fat_page_map->Get_Blocks();
+  std::vector<std::pair<uint64, Vectori>> new_blocks;
+  for (uint32 b = 0; b < blocks.second; b++) {
+    uint64 offset = blocks.first[b];
+    if (!baked_levelset.has_block(offset)) {
+      new_blocks.emplace_back(offset,
+                              Vectori(SparseMask::LinearToCoord(offset)));
+    }
+  }
+  baked_levelset.bake(this->levelset, new_blocks);
 }
 
 // apply grid boundary conditions ----------------------------------------------
@@ -377,18 +525,30 @@ template <int dim>
 void MPM<dim>::apply_grid_boundary_conditions(
     const DynamicLevelSet<dim> &levelset,
     real t) {
-  int expr_leaky_levelset = config_backup.get<int>("expr_leaky_levelset", 0);
-  real hack_velocity = config_backup.get<real>("hack_velocity", 0.0_f);
+  int expr_leaky_levelset = options.expr_leaky_levelset;
+  real hack_velocity = options.hack_velocity;
+  // The leaky levelset does not sample the levelset
+  bool baked = options.baked_levelset && !expr_leaky_levelset;
 
   int grid_block_size_max = grid_block_size().max();
 
   auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (!is_fat_block_needed(b)) {
+      return;
+    }
     Vectori block_base_coord(SparseMask::LinearToCoord(block_offset));
     Vector center = Vector(block_base_coord + grid_block_size() / Vectori(2));
 
-    //
-    if (!expr_leaky_levelset && levelset.inside(center) &&
-        std::abs(levelset.sample(center, t)) >= (real)grid_block_size_max) {
+    // Blocks away from the boundary
+    int32 baked_block = 0;
+    if (baked) {
+      baked_block = baked_levelset.get_block(block_offset);
+      if (baked_block < 0) {
+        return;
+      }
+    } else if (!expr_leaky_levelset && levelset.inside(center) &&
+               std::abs(levelset.sample(center, t)) >=
+                   (real)grid_block_size_max) {
       return;
     }
 
@@ -412,16 +572,25 @@ void MPM<dim>::apply_grid_boundary_conditions(
       // if grid node's -3 <= phi <= 0 (boundary grid) -------------------------
       // and if not leaky levelset
       if (expr_leaky_levelset == 0) {
-        phi = levelset.sample(pos, t);
+        real phi_t = 0;
+        if (baked) {
+          baked_levelset.sample_node(baked_block, ind_.get_ipos(), t, phi, n,
+                                     phi_t);
+        } else {
+          phi = levelset.sample(pos, t);
+        }
         if (phi < -3 || 0 < phi)  // was 0 
           continue;
         // normall to the levelset which its phi<0
-        n = levelset.get_spatial_gradient(pos, t);
+        if (!baked) {
+          n = levelset.get_spatial_gradient(pos, t);
+          phi_t = levelset.get_temporal_derivative(pos, t);
+        }
 
         // if hack velocity is ON
         if (hack_velocity != 0.0_f) {
           if (0.5_f < pos.y * delta_x && pos.y * delta_x < 0.7_f &&
-              t <= config_backup.get("hack_time", 0.0_f)) {
+              t <= options.hack_time) {
             boundary_velocity = hack_velocity * Vector::axis(0);
           } else {
             boundary_velocity = Vector(0);
@@ -429,8 +598,7 @@ void MPM<dim>::apply_grid_boundary_conditions(
         // main ----------------------------------------------------------------
         } else {
           // for non-dynamic levelset, d(phi)/dt=0
-          boundary_velocity =
-              -levelset.get_temporal_derivative(pos, t) * n * delta_x;
+          boundary_velocity = -phi_t * n * delta_x;
 
           // added: Grid granular fluidity boundary condition
           get_grid(ind).granular_fluidity = 0.0_f;
@@ -440,8 +608,8 @@ void MPM<dim>::apply_grid_boundary_conditions(
         mu = levelset.levelset0->friction;
 
         // sand speed ----------------------------------------------------------
-        if (config_backup.get("sand_speed", 0.0_f) > 0) {
-          real speed = config_backup.get("sand_speed", 0.0_f);
+        if (options.sand_speed > 0) {
+          real speed = options.sand_speed;
           real radius = 15.0_f / 180 * (real)M_PI;
           boundary_velocity = Vector(0);
           boundary_velocity.x = speed * (-cos(radius));
@@ -449,13 +617,13 @@ void MPM<dim>::apply_grid_boundary_conditions(
         }
 
         // gravity cutting -----------------------------------------------------
-        if (config_backup.get("gravity_cutting", false)) {
+        if (options.gravity_cutting) {
           if (real(ind.y) > 0.7_f * res[1])
             mu = -1;
         }
 
         // sand crawler --------------------------------------------------------
-        if (config_backup.get("sand_crawler", false)) {
+        if (options.sand_crawler) {
           if (real(ind.y) < 0.535_f * res[1])
             mu = -1;
         }
@@ -488,93 +656,108 @@ void MPM<dim>::apply_grid_boundary_conditions(
 }
 
 // apply dirichlet boundary conditions (like sticky bc) ------------------------
-// 2D
-template <>
-void MPM<2>::apply_dirichlet_boundary_conditions() {
-  real distance   = config_backup.get("dirichlet_boundary_radius", 0.0_f);
-  real distance_l = config_backup.get("dirichlet_distance_left", distance);
-  real distance_r = config_backup.get("dirichlet_distance_right", distance);
-
-  real velocity   = config_backup.get("dirichlet_boundary_velocity", 0.0_f);
-  real velocity_l = config_backup.get("dirichlet_boundary_left", velocity);
-  real velocity_r = config_backup.get("dirichlet_boundary_right", velocity);
-
-  Vector vl(0.0_f), vr(0.0_f);
-  vl[0] = velocity_l;
-  vr[0] = velocity_r;
-
-  for (auto &ind_ : grid_region) {
-    Vectori ind = ind_.get_ipos();
-    Vector pos = Vector(ind) * delta_x;
-    if (pos[0] < distance_l) {
-      get_grid(ind).velocity_and_mass =
-          VectorP(vl, get_grid(ind).velocity_and_mass[3]);
-    } else if (pos[0] > 1.0_f - distance_r) {
-      get_grid(ind).velocity_and_mass =
-          VectorP(vr, get_grid(ind).velocity_and_mass[3]);
+template <int dim>
+void MPM<dim>::apply_dirichlet_boundary_conditions() {
+  // Block lists, from the fat blocks of this substep
+  for (auto &region : dirichlet_regions) {
+    region.blocks.clear();
+  }
+  auto blocks = fat_page_map->Get_Blocks();
+  for (uint32 b = 0; b < blocks.second; b++) {
+    if (!is_fat_block_needed(b)) {
+      continue;
+    }
+    Vectori base(SparseMask::LinearToCoord(blocks.first[b]));
+    Vector lower = Vector(base) * delta_x;
+    Vector upper = Vector(base + grid_block_size() - Vectori(1)) * delta_x;
+    for (auto &region : dirichlet_regions) {
+      if (region.intersects(lower, upper)) {
+        region.blocks.push_back(blocks.first[b]);
+      }
     }
   }
+
+  // In order: later regions override earlier ones
+  for (auto &region : dirichlet_regions) {
+    ThreadedTaskManager::run(
+        (int)region.blocks.size(), this->num_threads, [&](int b) {
+          Vectori base(SparseMask::LinearToCoord(region.blocks[b]));
+          for (auto &ind_ : Region(Vectori(0), grid_block_size())) {
+            Vectori ind = base + ind_.get_ipos();
+            Vector pos = Vector(ind) * delta_x;
+            if (region.contains(pos)) {
+              get_grid(ind).velocity_and_mass =
+                  VectorP(region.get_velocity(pos), grid_mass(ind));
+            }
+          }
+        });
+  }
 }
-// 3D
+
+// The "dirichlet_boundary_radius" setups, as regions
+// 2D: prescribed x velocity left of "dirichlet_distance_left" and right of
+// 1 - "dirichlet_distance_right"
+template <>
+void MPM<2>::add_legacy_dirichlet_regions(const Config &config) {
+  real distance   = options.dirichlet_boundary_radius;
+  real distance_l = config.get("dirichlet_distance_left", distance);
+  real distance_r = config.get("dirichlet_distance_right", distance);
+
+  real velocity   = config.get("dirichlet_boundary_velocity", 0.0_f);
+  real velocity_l = config.get("dirichlet_boundary_left", velocity);
+  real velocity_r = config.get("dirichlet_boundary_right", velocity);
+
+  // Right first: the left one wins where they overlap
+  DirichletRegion<2> right;
+  right.type = DirichletRegion<2>::Type::half_space;
+  right.point = Vector(1.0_f - distance_r, 0.0_f);
+  right.normal = Vector(1.0_f, 0.0_f);
+  right.velocity = Vector(velocity_r, 0.0_f);
+  dirichlet_regions.push_back(right);
+
+  DirichletRegion<2> left;
+  left.type = DirichletRegion<2>::Type::half_space;
+  left.point = Vector(distance_l, 0.0_f);
+  left.normal = Vector(-1.0_f, 0.0_f);
+  left.velocity = Vector(velocity_l, 0.0_f);
+  dirichlet_regions.push_back(left);
+}
+// 3D: at rest above "dirichlet_boundary_height"
 template <>
-void MPM<3>::apply_dirichlet_boundary_conditions() {
-  for (auto &ind_ : grid_region) {
-    Vectori ind = ind_.get_ipos();
-    Vector pos = Vector(ind) * delta_x;
-    Vector v(0);
-    if (pos.y > 0.525_f) {
-      get_grid(ind).velocity_and_mass =
-          VectorP(v, get_grid(ind).velocity_and_mass[3]);
-    }
-  }
-  //  real radius = config_backup.get("dirichlet_boundary_radius", 0.0_f);
-  //  real linear_v =
-  //      config_backup.get("dirichlet_boundary_linear_velocity", 0.0_f);
-  //
-  //  TC_ASSERT_INFO(!config_backup.has_key("dirichlet_boundary_angular_velocity"),
-  //                 "Use 'dirichlet_boundary_rotation_cycle' instead of "
-  //                 "'dirichlet_boundary_angular_velocity'.")
-  //  real rotation_cycle =
-  //      config_backup.get("dirichlet_boundary_rotation_cycle", 0.0_f);
-  //  for (auto &ind_ : grid_region) {
-  //    Vectori ind = ind_.get_ipos();
-  //    Vector pos = Vector(ind) * delta_x;
-  //    real dist_to_x = sqrt(sqr(pos[1] - 0.5_f) + sqr(pos[2] - 0.5_f));
-  //    if (sqrt(sqr(pos[0] - 0.5f) + sqr(pos[1] - 0.5_f) + sqr(pos[2] - 0.5_f))
-  //    <
-  //        radius) {
-  //      Vector v;
-  //      // avoid atan2(0, 0)
-  //      if (dist_to_x < eps) {
-  //        v = Vector(linear_v, 0.0_f, 0.0_f);
-  //      } else {
-  //        real rotation_angle = atan2(pos[1] - 0.5_f, pos[2] - 0.5_f);
-  //        real rotation_speed;
-  //        if (rotation_cycle > 0.0_f) {
-  //          rotation_speed = dist_to_x * 2.0_f * M_PI / rotation_cycle;
-  //        } else {
-  //          rotation_speed = 0.0_f;
-  //        }
-  //        v = Vector(linear_v, rotation_speed * cos(rotation_angle),
-  //                   -rotation_speed * sin(rotation_angle));
-  //      }
-  //      get_grid(ind).velocity_and_mass =
-  //          VectorP(v, get_grid(ind).velocity_and_mass[3]);
-  //    }
-  //  }
+void MPM<3>::add_legacy_dirichlet_regions(const Config &config) {
+  DirichletRegion<3> top;
+  top.type = DirichletRegion<3>::Type::half_space;
+  top.point = Vector(0.0_f, config.get("dirichlet_boundary_height", 0.525_f),
+                     0.0_f);
+  top.normal = Vector(0.0_f, 1.0_f, 0.0_f);
+  dirichlet_regions.push_back(top);
 }
 
 // particle-levelset interaction -------------------------------------- : ON/OFF
 template <int dim>
 void MPM<dim>::particle_collision_resolution(real t) {
+  auto resolve = [&](Particle &p, real phi, const Vector &gradient) {
+    p.pos -= gradient * phi * delta_x;
+    p.set_velocity(p.get_velocity()-dot(gradient, p.get_velocity())*gradient);
+  };
+  // Unless clean_boundary removed particles since the sort
+  if (options.baked_levelset &&
+      block_meta[page_map->Get_Blocks().second].particle_offset ==
+          particles.size()) {
+    parallel_for_each_particle_near_levelset(
+        t, [&](Particle &p, real phi, const Vector &gradient) {
+          if (phi <= 0.25) {
+            resolve(p, phi, gradient);
+          }
+        });
+    return;
+  }
   parallel_for_each_particle([&](Particle &p) {
     Vector pos = p.pos * inv_delta_x;
     real phi = this->levelset.sample(pos, t);
     // if there is collision (phi<0)
     if (phi <= 0.25) {
-      Vector gradient = this->levelset.get_spatial_gradient(pos, t);
-      p.pos -= gradient * phi * delta_x;
-      p.set_velocity(p.get_velocity()-dot(gradient, p.get_velocity())*gradient);
+      resolve(p, phi, this->levelset.get_spatial_gradient(pos, t));
     }
   });
 }
@@ -582,6 +765,14 @@ void MPM<dim>::particle_collision_resolution(real t) {
 // added: particle_bc_at_levelset ------------------------------------- : ON/OFF
 template <int dim>
 void MPM<dim>::particle_bc_at_levelset(real t) {
+  if (options.baked_levelset) {
+    parallel_for_each_particle_near_levelset(
+        t, [&](Particle &p, real phi, const Vector &) {
+          if (phi < 0.25)
+            p.gf = 0.0_f;
+        });
+    return;
+  }
   parallel_for_each_particle([&](Particle &p) {
     Vector pos = p.pos * inv_delta_x;
     real phi = this->levelset.sample(pos, t);
@@ -594,13 +785,51 @@ void MPM<dim>::particle_bc_at_levelset(real t) {
 template <int dim>
 void MPM<dim>::step(real dt) {
   if (dt < 0) {
-    substep();
+    substep(get_next_delta_t(std::numeric_limits<real>::infinity()));
     request_t = this->current_t;
+  } else if (options.adaptive_dt) {
+    request_t += dt;
+    if (dt_log_frames == 0) {
+      dt_log_substeps = 0;
+      dt_log_min = std::numeric_limits<real>::infinity();
+      dt_log_max = 0;
+      unstable_substeps = 0;
+    }
+    // A remainder below min_delta_t is carried over to the next frame
+    while (request_t - this->current_t >= options.min_delta_t) {
+      update_counter += this->particles.size();
+      real delta_t = get_next_delta_t(request_t - this->current_t);
+      dt_log_min = std::min(dt_log_min, delta_t);
+      dt_log_max = std::max(dt_log_max, delta_t);
+      dt_log_substeps++;
+      substep(delta_t);
+    }
+    if (++dt_log_frames == options.dt_log_interval) {
+      dt_log_frames = 0;
+      TC_INFO("{} substeps in {} frames, dt in [{:.3e}, {:.3e}]",
+              dt_log_substeps, options.dt_log_interval, dt_log_min,
+              dt_log_max);
+      if (unstable_substeps) {
+        TC_WARN(
+            "{} substeps ran at min_delta_t={:.3e}, above the stable dt "
+            "(down to {:.3e}): the run may be unstable, lower 'min_delta_t'",
+            unstable_substeps, options.min_delta_t, min_unstable_delta_t);
+      }
+    }
+  } else if (scheduler) {
+    request_t += dt;
+    while (this->current_t + base_delta_t < request_t) {
+      // Until every particle has advanced by base_delta_t
+      do {
+        substep(base_delta_t);
+        update_counter += scheduler->num_due;
+      } while (!scheduler->is_synchronized());
+    }
   } else {
     request_t += dt;
     while (this->current_t + base_delta_t < request_t) {
       update_counter += this->particles.size();
-      substep();
+      substep(base_delta_t);
     }
   }
   TC_TRACE("#Particles {}", particles.size());
@@ -609,20 +838,95 @@ void MPM<dim>::step(real dt) {
                  rigid_block_fractions.size();
   TC_TRACE("Average rigid block fraction: {:.2f}%", 100 * average);
   step_counter += 1;
-  if (config_backup.get("print_energy", false)) {
+  if (stage_metrics.enabled) {
+    stage_metrics.end_frame(step_counter);
+  }
+  timeline.flush();
+  if (perf_counters.enabled) {
+    perf_counters.write();
+  }
+  if (options.print_energy) {
     TC_P(calculate_energy());
   }
   TC_WARN("Times of particle updating : {}", update_counter);
 }
 
+// adaptive time stepping ------------------------------------------------------
+template <int dim>
+real MPM<dim>::get_allowed_dt() {
+  return tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, (int)particles.size()),
+      std::numeric_limits<real>::infinity(),
+      [&](const tbb::blocked_range<int> &range, real allowed) {
+        for (int i = range.begin(); i < range.end(); i++) {
+          allowed = std::min(allowed,
+                             allocator[particles[i]]->get_allowed_dt(delta_x));
+        }
+        return allowed;
+      },
+      [](real a, real b) { return std::min(a, b); });
+}
+
+template <int dim>
+real MPM<dim>::get_next_delta_t(real remaining_t) {
+  if (!options.adaptive_dt) {
+    return base_delta_t;
+  }
+  real stable_dt = cfl * get_allowed_dt();
+  if (stable_dt < options.min_delta_t) {
+    // Reported by step every options.dt_log_interval frames
+    min_unstable_delta_t = unstable_substeps
+                               ? std::min(min_unstable_delta_t, stable_dt)
+                               : stable_dt;
+    unstable_substeps++;
+  }
+  real dt = clamp(stable_dt, options.min_delta_t, options.max_delta_t);
+  // Land on the frame boundary without leaving a tiny last substep
+  if (dt >= remaining_t) {
+    dt = remaining_t;
+  } else if (dt > 0.5_f * remaining_t) {
+    dt = 0.5_f * remaining_t;
+  }
+  return dt;
+}
+
 //------------------------------------------------------------------------------
 // MPM subset (MAIN LOOP) ------------------------------------------------------
 template <int dim>
-void MPM<dim>::substep() {
+void MPM<dim>::substep(real delta_t) {
   Profiler _p("mpm_substep");
+  if (stage_metrics.enabled) {
+    stage_metrics.begin_substep();
+  }
+  perf_counters.particles = particles.size();
   cutting_counter    = 0;
   plasticity_counter = 0;
-  const real delta_t = base_delta_t;
+
+  bool resort = !is_sort_current();
+  if (resort) {
+    MPM_PROFILE(sort_particles_and_populate_grid,
+                sort_particles_and_populate_grid());
+  }
+
+  if (scheduler) {
+    // The substep lasts until the next particle is due
+    MPM_PROFILE(async_schedule, delta_t = scheduler->update(resort));
+    if (!resort) {
+      MPM_PROFILE(reset_grid, reset_substep_grid());
+    }
+  }
+  current_delta_t = delta_t;
+  if (options.adaptive_dt) {
+    dt_history.emplace_back(this->current_t, delta_t);
+    if ((int)dt_history.size() > options.dt_history_size) {
+      dt_history.pop_front();
+    }
+    // NGF integrates the granular fluidity with the material's dt (the
+    // tables are this MPM's, see ParticleAllocator::materials)
+    for (auto &material : allocator.materials.nonlocal.materials) {
+      material.delta_t = delta_t;
+    }
+  }
   if (particles.empty()) {
     // TC_DEBUG("dt = {}, No particles", base_delta_t);
   } else {
@@ -630,27 +934,24 @@ void MPM<dim>::substep() {
     // particles.size());
   }
 
-  TC_PROFILE("sort_particles_and_populate_grid",
-             sort_particles_and_populate_grid());
-
   // added: Reset grid granular fluidity
-  TC_PROFILE("reset_grid_granular_fluidity",
+  MPM_PROFILE(reset_grid_granular_fluidity,
               reset_grid_granular_fluidity());
 
   // articulate ----------------------------------------------------------------
   if (has_rigid_body()) {
-    for (int i = 0; i < config_backup.get("coupling_iterations", 1); i++) {
+    for (int i = 0; i < options.coupling_iterations; i++) {
       // check rigidBody collision --------------------------------------- : OFF
-      TC_PROFILE("rigidify", rigidify(delta_t));
+      MPM_PROFILE(rigidify, rigidify(delta_t));
       // rigid body articulation in "mpm.h" ------------------------------------
-      TC_PROFILE("articulate", articulate(delta_t));
+      MPM_PROFILE(articulate, articulate(delta_t));
       // modified (CDF)
-      TC_PROFILE("rasterize_rigid_boundary", rasterize_rigid_boundary());
+      MPM_PROFILE(rasterize_rigid_boundary, rasterize_rigid_boundary());
     }
   }
 
   // visualize CDF ------------------------------------------------------- : OFF
-  if (config_backup.get("visualize_cdf", false)) {
+  if (options.visualize_cdf) {
     int counter = 0;
     for (auto &ind : grid_region) {
       Particle *p = allocator[counter];
@@ -660,14 +961,15 @@ void MPM<dim>::substep() {
       p->states = g.states;
       counter++;
     }
-    TC_PROFILE("advect_rigid_bodies", advect_rigid_bodies(delta_t));
+    MPM_PROFILE(advect_rigid_bodies, advect_rigid_bodies(delta_t));
     this->current_t += delta_t;
     substep_counter += 1;
+    record_substep_metrics(delta_t);
     return;
   }
 
   // visualize particle CDF ---------------------------------------------- : OFF
-  if (config_backup.get("visualize_particle_cdf", false)) {
+  if (options.visualize_particle_cdf) {
     int counter = 0;
     for (auto &ind : grid_region) {
       Region region(Vectori(0), Vectori(4));
@@ -679,33 +981,38 @@ void MPM<dim>::substep() {
         counter++;
       }
     }
-    TC_PROFILE("gather_cdf", gather_cdf());
-    TC_PROFILE("advect_rigid_bodies", advect_rigid_bodies(delta_t));
+    MPM_PROFILE(gather_cdf, gather_cdf());
+    MPM_PROFILE(advect_rigid_bodies, advect_rigid_bodies(delta_t));
     this->current_t += delta_t;
     substep_counter += 1;
+    record_substep_metrics(delta_t);
     return;
   }
 
   // gather CDF ----------------------------------------------------------------
   if (has_rigid_body()) {
-    TC_PROFILE("gather_cdf", gather_cdf());
+    MPM_PROFILE(gather_cdf, gather_cdf());
+  }
+
+  // baked levelset ----------------------------------------------------- : OFF
+  if (options.baked_levelset) {
+    MPM_PROFILE(bake_levelset, bake_levelset());
   }
 
   // added: particle bc near levelsets -------------------------------- : On/OFF
-  if (config_backup.get("particle_bc_at_levelset", false)) {
-    TC_PROFILE("particle_bc_at_levelset",
+  if (options.particle_bc_at_levelset) {
+    MPM_PROFILE(particle_bc_at_levelset,
       particle_bc_at_levelset(this->current_t));
   }
 
   // rasterize (particle to grid) ----------------------------------------------
-  if (!config_backup.get("benchmark_rasterize", false)) {
+  if (!options.benchmark_rasterize) {
     // optimized : ON
-    if (config_backup.get("optimized", true)) {
-      TC_PROFILE_TPE("P2G optimized",
-      rasterize_optimized(delta_t), particles.size());
+    if (options.optimized) {
+      MPM_PROFILE_TPE(p2g, rasterize_optimized(delta_t), particles.size());
     // else : OFF
     } else {
-      TC_PROFILE_TPE("P2G", rasterize(delta_t), particles.size());
+      MPM_PROFILE_TPE(p2g, rasterize(delta_t), particles.size());
     }
   } else {
     while (true) {
@@ -722,34 +1029,34 @@ void MPM<dim>::substep() {
   if (particle_gravity) {
     gravity_velocity_increment = Vector(0);
   }
-  TC_PROFILE(
-      "normalize_grid_and_apply_external_force",
+  MPM_PROFILE(
+      normalize_grid_and_apply_external_force,
       normalize_grid_and_apply_external_force(gravity_velocity_increment));
 
   // rigidBody-levelset collision ---------------------------------------- : OFF
-  if (config_backup.get("rigid_body_levelset_collision", false)) {
-    TC_PROFILE("rigid_body_levelset_collision",
+  if (options.rigid_body_levelset_collision) {
+    MPM_PROFILE(rigid_body_levelset_collision,
       rigid_body_levelset_collision(this->current_t, delta_t));
   }
 
   // boundary condition --------------------------------------------------------
-  TC_PROFILE("boundary_condition",
+  MPM_PROFILE(boundary_condition,
     apply_grid_boundary_conditions(this->levelset, this->current_t));
 
   // ---------------------------------------------------------------------------
-  if (config_backup.get("dirichlet_boundary_radius", 0.0_f) > 0.0_f) {
-    TC_PROFILE("apply_dirichlet_boundary_conditions",
+  if (!dirichlet_regions.empty()) {
+    MPM_PROFILE(apply_dirichlet_boundary_conditions,
       apply_dirichlet_boundary_conditions());
   }
 
   // resample (grid to particle) -----------------------------------------------
-  if (!config_backup.get("benchmark_resample", false)) {
+  if (!options.benchmark_resample) {
     // optimized : ON
-    if (config_backup.get("optimized", true)) {
-      TC_PROFILE_TPE("G2P optimized", resample_optimized(), particles.size());
+    if (options.optimized) {
+      MPM_PROFILE_TPE(g2p, resample_optimized(), particles.size());
     // else : OFF
     } else {
-      TC_PROFILE_TPE("G2P", resample(), particles.size());
+      MPM_PROFILE_TPE(g2p, resample(), particles.size());
     }
   } else {
     // NOTE: debugging here
@@ -763,23 +1070,48 @@ void MPM<dim>::substep() {
   }
 
   // clean boundary particles --------------------------------------------------
-  if (config_backup.get("clean_boundary", true)) {
-    TC_PROFILE("clean boundary", clear_boundary_particles());
+  if (options.clean_boundary) {
+    MPM_PROFILE(clean_boundary, clear_boundary_particles());
   }
 
   // particle collision ------------------------------------------------ : On/OFF
-  if (config_backup.get("particle_collision", false)) {
-    TC_PROFILE("particle_collision",
+  if (options.particle_collision) {
+    MPM_PROFILE(particle_collision,
       particle_collision_resolution(this->current_t));
   }
 
   // advect rigid body ---------------------------------------------------------
   if (has_rigid_body()) {
-    TC_PROFILE("advect_rigid_bodies", advect_rigid_bodies(delta_t));
+    MPM_PROFILE(advect_rigid_bodies, advect_rigid_bodies(delta_t));
   }
 
+  if (scheduler) {
+    scheduler->finish_substep();
+  }
   this->current_t += delta_t;
   substep_counter += 1;
+  record_substep_metrics(delta_t);
+}
+
+template <int dim>
+void MPM<dim>::record_substep_metrics(real delta_t) {
+  if (!stage_metrics.enabled) {
+    return;
+  }
+  auto &record = stage_metrics.current();
+  record.substep = substep_counter;
+  record.frame = step_counter;
+  record.t = this->current_t;
+  record.dt = delta_t;
+  record.particles = particles.size();
+  record.active_blocks = page_map->Get_Blocks().second;
+  record.fat_blocks = fat_page_map->Get_Blocks().second;
+  record.rigid_blocks = rigid_page_map->Get_Blocks().second;
+  record.rigid_block_fraction =
+      rigid_block_fractions.empty() ? 0 : rigid_block_fractions.back();
+  record.cutting_counter = cutting_counter;
+  record.plasticity_counter = plasticity_counter;
+  stage_metrics.end_substep();
 }
 // subset end ------------------------------------------------------------------
 //------------------------------------------------------------------------------
@@ -794,8 +1126,8 @@ template <int dim>
 void MPM<dim>::clear_boundary_particles() {
   std::vector<ParticlePtr> particles_new;
   static bool has_deleted = false;
-  int remove_particles = config_backup.get("remove_particles", 0);
-  real remove_height = config_backup.get("remove_height", 0.02_f);
+  int remove_particles = options.remove_particles;
+  real remove_height = options.remove_height;
 
   // Do not use bool here for concurrency
   std::vector<uint8> particle_remaining(particles.size(), 0);
@@ -835,7 +1167,10 @@ void MPM<dim>::clear_boundary_particles() {
   if (!has_deleted && this->current_t >= 0.1)
     has_deleted = true;
   int deleted = (int)particles.size() - (int)particles_new.size();
-  if (deleted != 0 && config_backup.get("warn_particle_deletion", true)) {
+  if (deleted != 0) {
+    num_sorted_particles = 0;
+  }
+  if (deleted != 0 && options.warn_particle_deletion) {
     TC_WARN(
         "{} boundary (or abnormal) particles deleted.\n{} Particles remained\n",
         deleted, particles_new.size());
@@ -902,7 +1237,7 @@ void MPM<2>::draw_cdf(const Config &config) {
   base_delta_t = 0.001;
   TC_P("seeded");
   for (int i = 0; i < 5; i++) {
-    substep();
+    substep(base_delta_t);
   }
   TC_P("stepped");
   Array2D<Vector3> img_dist, img_affinity, img_normal;
@@ -970,45 +1305,155 @@ void MPM<dim>::sort_allocator() {
   allocator.gc(particles.size());
 }
 
-// sort particles & populate grid ----------------------------------------------
-template <int dim>
-void MPM<dim>::sort_particles_and_populate_grid() {
-  // Profiler::disable();
-  constexpr int index_bits = (32 - SparseMask::block_bits);
-
-  TC_ASSERT(particles.size() < (1 << index_bits));
+// Indices i in [0, n) with pred(i), in increasing order. Each chunk counts
+// its matches, then writes them after those of the chunks before it.
+template <typename Pred>
+std::vector<uint32> find_if_ordered(uint32 n, const Pred &pred) {
+  constexpr uint32 chunk_size = 1 << 16;
+  int num_chunks = (int)((n + chunk_size - 1) / chunk_size);
+  std::vector<uint32> chunk_begins(num_chunks + 1, 0);
+  tbb::parallel_for(0, num_chunks, [&](int c) {
+    uint32 end = std::min(n, (c + 1) * chunk_size);
+    for (uint32 i = c * chunk_size; i < end; i++) {
+      chunk_begins[c + 1] += pred(i);
+    }
+  });
+  std::partial_sum(chunk_begins.begin(), chunk_begins.end(),
+                   chunk_begins.begin());
+  std::vector<uint32> indices(chunk_begins[num_chunks]);
+  tbb::parallel_for(0, num_chunks, [&](int c) {
+    uint32 end = std::min(n, (c + 1) * chunk_size);
+    uint32 j = chunk_begins[c];
+    for (uint32 i = c * chunk_size; i < end; i++) {
+      if (pred(i)) {
+        indices[j++] = i;
+      }
+    }
+  });
+  return indices;
+}
 
-  if (particles.size() > particle_sorter.size()) {
-    particle_sorter.resize(particles.size());
+// Sorted keys (cell << index_bits) + index of all particles in
+// particle_sorter, see get_sorter_index_bits. The incremental mode starts
+// from the keys of the previous sort, which are still in particle order: only
+// particles that changed cell (or are new) are sorted, then merged with the
+// others, which are in order already. The result is the same as with a full
+// sort.
+template <int dim>
+void MPM<dim>::sort_particle_keys(bool incremental) {
+  const int index_bits = get_sorter_index_bits();
+  int n = (int)particles.size();
+  incremental = incremental && 0 < num_sorted_particles &&
+                num_sorted_particles <= particles.size();
+
+  std::vector<uint64> &keys = incremental ? particle_sorter_ : particle_sorter;
+  if ((int)keys.size() < n) {
+    keys.resize(n);
   }
-
-  auto grid_array = grid->Get_Array();
-
   {
-    Profiler _("prepare array to sort");
-    tbb::parallel_for(0, (int)particles.size(), [&](int i) {
+    MPM_PROFILE_SCOPE(sort_prepare_keys);
+    tbb::parallel_for(0, n, [&](int i) {
       uint64 offset = SparseMask::Linear_Offset(to_std_array(
           get_grid_base_pos(allocator[particles[i]]->pos * inv_delta_x)));
-      particle_sorter[i] =
-          ((offset >> SparseMask::data_bits) << index_bits) + i;
+      keys[i] = ((offset >> SparseMask::data_bits) << index_bits) + uint64(i);
     });
   }
+  if (!incremental) {
+    MPM_PROFILE(sort_parallel_sort,
+                tbb::parallel_sort(particle_sorter.begin(),
+                                   particle_sorter.begin() + n));
+    return;
+  }
 
-  TC_PROFILE("parallel_sort",
-             tbb::parallel_sort(particle_sorter.begin(),
-                                particle_sorter.begin() + particles.size()));
+  std::vector<uint64> stayers, movers;
+  {
+    MPM_PROFILE_SCOPE(sort_detect_movers);
+    auto moved = [&](uint32 i) {
+      return i >= num_sorted_particles ||
+             (keys[i] >> index_bits) != (particle_sorter[i] >> index_bits);
+    };
+    auto mover_indices = find_if_ordered((uint32)n, moved);
+    if (mover_indices.size() * 4 > (std::size_t)n) {
+      // Mostly shuffled, a full sort is cheaper
+      std::swap(particle_sorter, particle_sorter_);
+      MPM_PROFILE(sort_parallel_sort,
+                  tbb::parallel_sort(particle_sorter.begin(),
+                                     particle_sorter.begin() + n));
+      return;
+    }
+    movers.resize(mover_indices.size());
+    tbb::parallel_for(0, (int)movers.size(),
+                      [&](int j) { movers[j] = keys[mover_indices[j]]; });
+    auto stayer_indices =
+        find_if_ordered((uint32)n, [&](uint32 i) { return !moved(i); });
+    stayers.resize(stayer_indices.size());
+    tbb::parallel_for(0, (int)stayers.size(),
+                      [&](int j) { stayers[j] = keys[stayer_indices[j]]; });
+  }
+  MPM_PROFILE(sort_movers, tbb::parallel_sort(movers.begin(), movers.end()));
 
   {
-    Profiler _("reorder particle pointers");
+    MPM_PROFILE_SCOPE(sort_merge);
+    if ((int)particle_sorter.size() < n) {
+      particle_sorter.resize(n);
+    }
+    // Each chunk of stayers merges with the movers that fall in its range
+    constexpr int chunk_size = 1 << 16;
+    int num_stayers = (int)stayers.size();
+    int num_chunks = (num_stayers + chunk_size - 1) / chunk_size;
+    auto mover_begin = [&](int c) -> int {
+      if (c == 0) {
+        return 0;
+      }
+      if (c == num_chunks) {
+        return (int)movers.size();
+      }
+      return (int)(std::lower_bound(movers.begin(), movers.end(),
+                                    stayers[c * chunk_size]) -
+                   movers.begin());
+    };
+    if (num_chunks == 0) {
+      std::copy(movers.begin(), movers.end(), particle_sorter.begin());
+    }
+    tbb::parallel_for(0, num_chunks, [&](int c) {
+      int s0 = c * chunk_size, s1 = std::min(num_stayers, s0 + chunk_size);
+      int m0 = mover_begin(c), m1 = mover_begin(c + 1);
+      std::merge(stayers.begin() + s0, stayers.begin() + s1,
+                 movers.begin() + m0, movers.begin() + m1,
+                 particle_sorter.begin() + s0 + m0);
+    });
+  }
+}
+
+// sort particles & populate grid ----------------------------------------------
+template <int dim>
+void MPM<dim>::sort_particles_and_populate_grid() {
+  // Profiler::disable();
+  const int index_bits = get_sorter_index_bits();
+  // A block is a page; its index is the key without the element bits
+  const int page_shift = index_bits + SparseMask::block_bits;
+
+  TC_ASSERT_INFO(particles.size() < (1ull << index_bits),
+                 "Too many particles for the sort key at this spgrid_size");
+
+  auto grid_array = grid->Get_Array();
+
+  sort_particle_keys(options.incremental_sort);
+
+  {
+    MPM_PROFILE_SCOPE(reorder_particle_pointers);
     // Reorder particles
     std::swap(particles, particles_);
     // if (particles.size() < particles_.size()) {
     // TODO: make it more efficient
     particles.resize(particles_.size());
     //}
-    for (int i = 0; i < (int)particles.size(); i++) {
-      particles[i] = particles_[particle_sorter[i] & ((1ll << index_bits) - 1)];
-    }
+    tbb::parallel_for(0, (int)particles.size(), [&](int i) {
+      particles[i] =
+          particles_[particle_sorter[i] & ((1ull << index_bits) - 1)];
+    });
+    // particle_sorter[i] now holds the key of particles[i]
+    num_sorted_particles = (uint32)particles.size();
   }
 
   // Reorder particles
@@ -1016,35 +1461,55 @@ void MPM<dim>::sort_particles_and_populate_grid() {
     sort_allocator();
   }
 
+  static_assert(SparseMask::data_bits + SparseMask::block_bits == log2_size,
+                "A block should take a page");
+  std::vector<uint32> block_begins;
+  {
+    MPM_PROFILE_SCOPE(block_particle_offset);
+    block_begins = find_if_ordered((uint32)particles.size(), [&](uint32 i) {
+      return i == 0 || (particle_sorter[i] >> page_shift) !=
+                           (particle_sorter[i - 1] >> page_shift);
+    });
+    block_meta.resize(block_begins.size() + 1);
+    tbb::parallel_for(0, (int)block_begins.size(), [&](int b) {
+      block_meta[b] = {block_begins[b], 0};
+    });
+    block_meta.back() = {(uint32)particles.size(), 0};
+  }
+
   // Reset page_map
   {
-    Profiler _("reset page map");
-    page_map->Clear();
-    for (int i = 0; i < (int)particles.size(); i++) {
-      uint64 offset = (particle_sorter[i] >> index_bits)
-                      << SparseMask::data_bits;
-      page_map->Set_Page(offset);
-    }
-    page_map->Update_Block_Offsets();
+    MPM_PROFILE_SCOPE(reset_page_map);
+    std::vector<uint64_t> offsets(block_begins.size());
+    tbb::parallel_for(0, (int)offsets.size(), [&](int b) {
+      offsets[b] = (particle_sorter[block_begins[b]] >> page_shift)
+                   << log2_size;
+    });
+    page_map->Set_Blocks(std::move(offsets));
   }
 
   // Update particle offset
   auto blocks = page_map->Get_Blocks();
+  TC_ASSERT(block_meta.size() == blocks.second + 1);
 
   {
-    Profiler _("fat page map");
+    MPM_PROFILE_SCOPE(fat_page_map);
     // Reset fat_page_map
-    fat_page_map->Clear();
-    for (int b = 0; b < (int)blocks.second; b++) {
+    constexpr int num_neighbours = dim == 2 ? 9 : 27;
+    constexpr uint64_t invalid = std::numeric_limits<uint64_t>::max();
+    std::vector<uint64_t> fat_offsets(blocks.second * num_neighbours);
+    tbb::parallel_for(0, (int)blocks.second, [&](int b) {
       auto base_offset = blocks.first[b];
+      uint64_t *nei = &fat_offsets[b * num_neighbours];
+      int n = 0;
       TC_STATIC_IF(dim == 2) {
         auto x = 1 << SparseMask::block_xbits;
         auto y = 1 << SparseMask::block_ybits;
         auto c = SparseMask::LinearToCoord(base_offset);
         for (int i = -1 + (c[0] == 0); i < 2; i++) {
           for (int j = -1 + (c[1] == 0); j < 2; j++) {
-            fat_page_map->Set_Page(SparseMask::Packed_Add(
-                base_offset, SparseMask::Linear_Offset(x * i, y * j)));
+            nei[n++] = SparseMask::Packed_Add(
+                base_offset, SparseMask::Linear_Offset(x * i, y * j));
           }
         }
       }
@@ -1056,68 +1521,189 @@ void MPM<dim>::sort_particles_and_populate_grid() {
         for (int i = -1 + (c[0] == 0); i < 2; i++) {
           for (int j = -1 + (c[1] == 0); j < 2; j++) {
             for (int k = -1 + (c[2] == 0); k < 2; k++) {
-              fat_page_map->Set_Page(SparseMask::Packed_Add(
-                  base_offset, SparseMask::Linear_Offset(x * i, y * j, z * k)));
+              nei[n++] = SparseMask::Packed_Add(
+                  base_offset, SparseMask::Linear_Offset(x * i, y * j, z * k));
             }
           }
         }
       }
       TC_STATIC_END_IF
+      while (n < num_neighbours) {
+        nei[n++] = invalid;
+      }
+    });
+    tbb::parallel_sort(fat_offsets.begin(), fat_offsets.end());
+    fat_offsets.erase(std::unique(fat_offsets.begin(), fat_offsets.end()),
+                      fat_offsets.end());
+    if (!fat_offsets.empty() && fat_offsets.back() == invalid) {
+      fat_offsets.pop_back();
     }
-    fat_page_map->Update_Block_Offsets();
+    fat_page_map->Set_Blocks(std::move(fat_offsets));
   }
 
   auto fat_blocks = fat_page_map->Get_Blocks();
   {
-    Profiler _("reset grid");
-    for (int i = 0; i < (int)fat_blocks.second; i++) {
+    MPM_PROFILE_SCOPE(reset_grid);
+    tbb::parallel_for(0, (int)fat_blocks.second, [&](int i) {
       auto offset = fat_blocks.first[i];
       std::memset(&grid_array(offset), 0, 1 << log2_size);
-    }
-  }
-
-  {
-    Profiler _("block particle offset");
-    block_meta.clear();
-    uint64 last_offset = -1;
-    for (uint32 i = 0; i < particles.size(); i++) {
-      if (last_offset != (particle_sorter[i] >> 32)) {
-        block_meta.push_back({i, 0});
-      }
-      last_offset = particle_sorter[i] >> 32;
-    }
-
-    block_meta.push_back({(uint32)particles.size(), 0});
-    TC_ASSERT(block_meta.size() == blocks.second + 1);
+    });
   }
 
   {
-    Profiler _("grid particle offset");
+    MPM_PROFILE_SCOPE(grid_particle_offset);
+    auto node_index = [&](uint32 i) {
+      auto base_pos =
+          get_grid_base_pos(allocator[particles[i]]->pos * inv_delta_x);
+      uint64 offset = SparseMask::Linear_Offset(to_std_array(base_pos));
+      return (offset >> SparseMask::data_bits) &
+             ((1 << SparseMask::block_bits) - 1);
+    };
+    // GridState::particle_count is 16-bit: blocks that may overflow it are
+    // counted again below
+    std::vector<uint8> block_may_overflow(blocks.second, 0);
     parallel_for_each_block_with_index(
         [&](uint32 b, uint64 base_offset, GridState<dim> *g) {
           auto particle_begin = block_meta[b].particle_offset;
           auto particle_end = block_meta[b + 1].particle_offset;
-
-          int count = 0;
+          if (particle_end - particle_begin >=
+              GridState<dim>::particle_count_overflow) {
+            block_may_overflow[b] = 1;
+          }
           for (uint32 i = particle_begin; i < particle_end; i++) {
-            auto base_pos =
-                get_grid_base_pos(allocator[particles[i]]->pos * inv_delta_x);
-            uint64 offset = SparseMask::Linear_Offset(to_std_array(base_pos));
-            auto index = (offset >> SparseMask::data_bits) &
-                         ((1 << SparseMask::block_bits) - 1);
-            g[index].particle_count += 1;
-            count++;
+            auto &count = g[node_index(i)].particle_count;
+            if (count != GridState<dim>::particle_count_overflow) {
+              count += 1;
+            }
           }
-          // TC_ASSERT(count == particle_end - particle_begin);
         },
         false);
+    particle_count_overflows.clear();
+    for (uint32 b = 0; b < blocks.second; b++) {
+      if (!block_may_overflow[b]) {
+        continue;
+      }
+      std::vector<uint32> counts(SparseMask::elements_per_block, 0);
+      for (uint32 i = block_meta[b].particle_offset;
+           i < block_meta[b + 1].particle_offset; i++) {
+        counts[node_index(i)]++;
+      }
+      for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
+        if (counts[t] >= GridState<dim>::particle_count_overflow) {
+          particle_count_overflows[(uint64)b * SparseMask::elements_per_block +
+                                   t] = counts[t];
+        }
+      }
+    }
   }
   // Profiler::enable();
-  TC_STATIC_IF(dim == 3) {
-    Profiler _("update rigid page map");
+  {
+    MPM_PROFILE_SCOPE(update_rigid_page_map);
     this->update_rigid_page_map();
+    this->update_rigid_slots();
+  }
+}
+
+// Only the due particles of the last substep, in its active blocks, moved.
+// The others keep their cell (and particle_sorter key) until they are due.
+// Rigid bodies, particle collision and particles added or removed change the
+// page maps or other particles, so these always sort.
+template <int dim>
+bool MPM<dim>::is_sort_current() const {
+  if (!scheduler || scheduler->is_synchronized() || has_rigid_body() ||
+      options.particle_collision || particles.empty() ||
+      num_sorted_particles != particles.size() ||
+      block_meta.empty() ||
+      block_meta.back().particle_offset != particles.size() ||
+      scheduler->block_states.size() != page_map->Get_Blocks().second) {
+    return false;
+  }
+  const int index_bits = get_sorter_index_bits();
+  int num_blocks = (int)scheduler->block_states.size();
+  return tbb::parallel_reduce(
+      tbb::blocked_range<int>(0, num_blocks), true,
+      [&](const tbb::blocked_range<int> &range, bool current) {
+        for (int b = range.begin(); current && b < range.end(); b++) {
+          if (!scheduler->is_block_active(b)) {
+            continue;
+          }
+          for (uint32 i = block_meta[b].particle_offset;
+               i < block_meta[b + 1].particle_offset; i++) {
+            auto base_pos = get_grid_base_pos(
+                allocator.get_const(particles[i])->pos * inv_delta_x);
+            uint64 cell =
+                SparseMask::Linear_Offset(to_std_array(base_pos)) >>
+                SparseMask::data_bits;
+            if (cell != (particle_sorter[i] >> index_bits)) {
+              return false;
+            }
+          }
+        }
+        return current;
+      },
+      [](bool a, bool b) { return a && b; });
+}
+
+// Without a sort, the P2G writes the fat blocks around rasterized blocks. The
+// other fat blocks keep the grid of earlier substeps, which no pass reads.
+template <int dim>
+void MPM<dim>::reset_substep_grid() {
+  auto grid_array = grid->Get_Array();
+  auto fat_blocks = fat_page_map->Get_Blocks();
+  tbb::parallel_for(0, (int)fat_blocks.second, [&](int i) {
+    if (!scheduler->is_fat_block_rasterized(i)) {
+      return;
+    }
+    GridState<dim> *g =
+        reinterpret_cast<GridState<dim> *>(&grid_array(fat_blocks.first[i]));
+    for (int t = 0; t < (int)SparseMask::elements_per_block; t++) {
+      auto particle_count = g[t].particle_count;
+      std::memset(&g[t], 0, sizeof(GridState<dim>));
+      g[t].particle_count = particle_count;
+    }
+  });
+}
+
+// post load -------------------------------------------------------------------
+template <int dim>
+void MPM<dim>::post_load(const Config &config) {
+  options.initialize(config_backup);
+  current_delta_t = base_delta_t;
+  dt_history.clear();
+  dt_log_frames = 0;
+  num_sorted_particles = 0;
+  scheduler = nullptr;
+  if (options.async) {
+    scheduler = std::make_unique<MPMScheduler<dim>>(*this);
+    scheduler->initialize(config_backup);
+  }
+  rigid_hulls.clear();
+  rigid_sdfs.clear();
+  // Writes the frames so far; compressed frames start with a keyframe
+  frame_writer = nullptr;
+  baked_levelset = BakedLevelSet<dim>();
+  stage_metrics.initialize(config_backup, true);
+  rigid_neighbourhoods.clear();
+  rigid_block_bodies.clear();
+  if (options.rigid_sdf) {
+    bake_rigid_sdfs();
+  }
+  for (auto &r : rigids) {
+    if (r->pos_func_id != -1) {
+      typename RigidBody<dim>::PositionFunctionType *f =
+          (typename RigidBody<dim>::PositionFunctionType *)config.get<uint64>(
+              fmt::format("script{:05d}", r->pos_func_id));
+      r->pos_func = *f;
+      TC_INFO("scripted position loaded");
+    }
+    if (r->rot_func_id != -1) {
+      typename RigidBody<dim>::RotationFunctionType *f =
+          (typename RigidBody<dim>::RotationFunctionType *)config.get<uint64>(
+              fmt::format("script{:05d}", r->rot_func_id));
+      r->rot_func = *f;
+      TC_INFO("scripted rotation loaded");
+    }
   }
-  TC_STATIC_END_IF
 }
 
 // general actions -------------------------------------------------------------
@@ -1142,11 +1728,26 @@ std::string MPM<dim>::general_action(const Config &config) {
   } else if (action == "cdf") {
     draw_cdf(config);
 
+  // dirichlet region, see dirichlet_region.h ----------------------------------
+  } else if (action == "add_dirichlet_region") {
+    DirichletRegion<dim> region;
+    region.initialize(config);
+    dirichlet_regions.push_back(region);
+
   // save ----------------------------------------------------------------------
   } else if (action == "save") {
     TC_P(this->get_name());
     write_to_binary_file_dynamic(this, config.get<std::string>("file_name"));
 
+  // flush output --------------------------------------------------------------
+  // Waits for the frames queued on the writer thread (see write_bgeo)
+  } else if (action == "flush_output") {
+    if (frame_writer) {
+      frame_writer->flush();
+      return fmt::format("{}", frame_writer->get_stall_time());
+    }
+    return "0";
+
   // calculate energy ----------------------------------------------------------
   } else if (action == "calculate_energy") {
     return fmt::format("{}", calculate_energy());
@@ -1154,22 +1755,274 @@ std::string MPM<dim>::general_action(const Config &config) {
   // load rigid body from binary file ------------------------------------------
   } else if (action == "load") {
     read_from_binary_file_dynamic(this, config.get<std::string>("file_name"));
+    post_load(config);
+
+  // fast checkpoints, see io/checkpoint.h -------------------------------------
+  } else if (action == "save_checkpoint") {
+    auto t0 = Time::get_time();
+    save_checkpoint(config.get<std::string>("file_name"));
+    TC_INFO("Checkpoint of {} particles saved in {:.3f} s", particles.size(),
+            Time::get_time() - t0);
+  } else if (action == "load_checkpoint") {
+    auto t0 = Time::get_time();
+    load_checkpoint(config.get<std::string>("file_name"));
+    post_load(config);
+    TC_INFO("Checkpoint of {} particles loaded in {:.3f} s", particles.size(),
+            Time::get_time() - t0);
+
+  // stage metrics, see profiling/stage_metrics.h ------------------------------
+  // The last substep ("substep"), frame ("frame") or the sum since
+  // initialize/load ("total"), as JSON
+  } else if (action == "metrics") {
+    TC_ASSERT_INFO(stage_metrics.enabled,
+                   "Set 'metrics' or 'metrics_file' to record metrics");
+    return stage_metrics.get(config.get<std::string>("scope", "substep"))
+        .to_json();
+
+  // hardware counters per stage, see profiling/perf_counters.h ----------------
+  } else if (action == "perf_counters") {
+    TC_ASSERT_INFO(perf_counters.enabled,
+                   "Set 'perf_counters' (Linux, perf_event_open) first");
+    return perf_counters.to_json();
+
+  // substep dt history --------------------------------------------------------
+  } else if (action == "dt_history") {
+    std::string ret;
+    for (auto &entry : dt_history) {
+      ret += fmt::format("{} {}\n", entry.first, entry.second);
+    }
+    return ret;
+
+  // benchmark P2G -------------------------------------------------------------
+  // Times rasterize_optimized on the current state (e.g. after a few steps of
+  // scripts/excav.py) at the current dt, with the rigid-block options cached
+  // (CachedP2GOptions, as in substep) and in a separate instantiation with
+  // them looked up in config_backup at every use (ConfigP2GOptions), as
+  // before MPMOptions.
+  } else if (action == "benchmark_p2g") {
+    // The populated grid, particle velocities/impulses and rigid bodies are
+    // restored before every run and at the end, so the simulation goes on
+    // unaffected (the next substep sorts again)
+    int iterations = config.get("iterations", 20);
+    real delta_t = current_delta_t > 0 ? current_delta_t : base_delta_t;
+    sort_particles_and_populate_grid();
+    if (has_rigid_body()) {
+      rasterize_rigid_boundary();
+      gather_cdf();
+    }
+    uint64 rigid_particles = 0;
+    auto blocks = page_map->Get_Blocks();
+    for (uint32 b = 0; b < blocks.second; b++) {
+      if (rigid_page_map->Test_Page(blocks.first[b])) {
+        rigid_particles +=
+            block_meta[b + 1].particle_offset - block_meta[b].particle_offset;
+      }
+    }
+
+    auto fat_blocks = fat_page_map->Get_Blocks();
+    auto grid_array = grid->Get_Array();
+    constexpr std::size_t block_bytes = 1 << log2_size;
+    std::vector<uint8> saved_grid(fat_blocks.second * block_bytes);
+    tbb::parallel_for(0, (int)fat_blocks.second, [&](int i) {
+      std::memcpy(&saved_grid[i * block_bytes],
+                  &grid_array(fat_blocks.first[i]), block_bytes);
+    });
+    std::vector<Vector> saved_velocities(particles.size());
+    std::vector<Vector> saved_impulses(particles.size());
+    tbb::parallel_for(0, (int)particles.size(), [&](int i) {
+      Particle &p = *allocator[particles[i]];
+      saved_velocities[i] = p.get_velocity();
+      saved_impulses[i] = p.rigid_impulse;
+    });
+    struct RigidState {
+      decltype(RigidBody<dim>::velocity) velocity;
+      decltype(RigidBody<dim>::angular_velocity) angular_velocity;
+      decltype(RigidBody<dim>::rigid_force) rigid_force;
+      decltype(RigidBody<dim>::rigid_torque) rigid_torque;
+    };
+    std::vector<RigidState> saved_rigids;
     for (auto &r : rigids) {
-      if (r->pos_func_id != -1) {
-        typename RigidBody<dim>::PositionFunctionType *f =
-            (typename RigidBody<dim>::PositionFunctionType *)config.get<uint64>(
-                fmt::format("script{:05d}", r->pos_func_id));
-        r->pos_func = *f;
-        TC_INFO("scripted position loaded");
+      saved_rigids.push_back(RigidState{r->velocity, r->angular_velocity,
+                                        r->rigid_force, r->rigid_torque});
+    }
+    auto restore = [&]() {
+      tbb::parallel_for(0, (int)fat_blocks.second, [&](int i) {
+        std::memcpy(&grid_array(fat_blocks.first[i]),
+                    &saved_grid[i * block_bytes], block_bytes);
+      });
+      tbb::parallel_for(0, (int)particles.size(), [&](int i) {
+        Particle &p = *allocator[particles[i]];
+        p.set_velocity(saved_velocities[i]);
+        p.rigid_impulse = saved_impulses[i];
+      });
+      for (std::size_t i = 0; i < rigids.size(); i++) {
+        auto &r = *rigids[i];
+        r.velocity = saved_rigids[i].velocity;
+        r.angular_velocity = saved_rigids[i].angular_velocity;
+        r.rigid_force = saved_rigids[i].rigid_force;
+        r.rigid_torque = saved_rigids[i].rigid_torque;
+        r.reset_tmp_velocity();
       }
-      if (r->rot_func_id != -1) {
-        typename RigidBody<dim>::RotationFunctionType *f =
-            (typename RigidBody<dim>::RotationFunctionType *)config.get<uint64>(
-                fmt::format("script{:05d}", r->rot_func_id));
-        r->rot_func = *f;
-        TC_INFO("scripted rotation loaded");
+    };
+    auto time_p2g = [&](auto p2g_options) {
+      real total = 0;
+      for (int i = 0; i < iterations; i++) {
+        restore();
+        auto t0 = Time::get_time();
+        rasterize_optimized(delta_t, p2g_options);
+        total += Time::get_time() - t0;
+      }
+      restore();
+      return total / iterations;
+    };
+    real lookup_time = time_p2g(ConfigP2GOptions{&config_backup});
+    real p2g_time = time_p2g(CachedP2GOptions(options));
+    TC_INFO("P2G: {:.3f} ms, {} particles ({} in rigid blocks), dt {}",
+            p2g_time * 1000, particles.size(), rigid_particles, delta_t);
+    TC_INFO("P2G with per-node config lookups: {:.3f} ms ({:+.1f}%)",
+            lookup_time * 1000, 100 * (lookup_time / p2g_time - 1));
+    return fmt::format("{} {}", p2g_time, lookup_time);
+
+  // benchmark particle sorting ------------------------------------------------
+  } else if (action == "benchmark_sort") {
+    // Moves particles by up to 'displacement' cells, as in a substep, then
+    // times the full and the incremental sort of the keys
+    int iterations = config.get("iterations", 10);
+    real displacement = config.get("displacement", 0.1_f);
+    sort_particles_and_populate_grid();
+    std::vector<Vector> positions(particles.size());
+    for (std::size_t i = 0; i < particles.size(); i++) {
+      Particle &p = *allocator[particles[i]];
+      positions[i] = p.pos;
+      p.pos += (Vector::rand() * 2.0_f - Vector(1.0_f)) *
+               (displacement * delta_x);
+      p.pos = p.pos.clamp(Vector(0.0_f),
+                          (res.template cast<real>() - Vector(eps)) * delta_x);
+    }
+    auto sorted = particle_sorter;
+    real times[2] = {0, 0};
+    for (int i = 0; i < iterations; i++) {
+      for (int incremental = 0; incremental < 2; incremental++) {
+        particle_sorter = sorted;
+        auto t0 = Time::get_time();
+        sort_particle_keys(incremental == 1);
+        times[incremental] += (Time::get_time() - t0) / iterations;
+      }
+    }
+    particle_sorter = sorted;
+    for (std::size_t i = 0; i < particles.size(); i++) {
+      allocator[particles[i]]->pos = positions[i];
+    }
+    TC_INFO("Sort of {} particles: full {:.3f} ms, incremental {:.3f} ms",
+            particles.size(), times[0] * 1000, times[1] * 1000);
+    return fmt::format("{} {}", times[0], times[1]);
+
+  // benchmark output ----------------------------------------------------------
+  // Times the text/csv/partio writers against the columnar and compressed
+  // frames on the current particles. Returns seconds per frame, "particle
+  // dataset frame partio compressed", then bytes, "frame partio compressed".
+  // Compressed frames are keyframes.
+  } else if (action == "benchmark_output") {
+    int iterations = config.get("iterations", 3);
+    std::string directory = config.get<std::string>("directory");
+    auto time = [&](const std::function<void()> &write) {
+      auto t0 = Time::get_time();
+      for (int i = 0; i < iterations; i++) {
+        write();
+      }
+      return (Time::get_time() - t0) / iterations;
+    };
+    auto file_size = [](const std::string &file_name) {
+      std::ifstream f(file_name, std::ios::binary | std::ios::ate);
+      return (uint64)f.tellg();
+    };
+    real particle_time = time(
+        [&]() { write_particle(fmt::format("{}/benchmark", directory)); });
+    real dataset_time = 0;
+    if (rigids.size() > 1) {
+      dataset_time = time([&]() {
+        write_dataset(rigids[1].get(), fmt::format("{}/benchmark", directory));
+      });
+    }
+    std::string frame_file = fmt::format("{}/benchmark.mpmf", directory);
+    real frame_time = time([&]() { write_frame(frame_file); });
+    std::string partio_file = fmt::format("{}/benchmark.bgeo", directory);
+    real partio_time = time([&]() { write_partio(partio_file); });
+    std::string compressed_file = fmt::format("{}/benchmark.mpmz", directory);
+    real compressed_time = time([&]() {
+      ParticleFrame<dim> frame;
+      auto fields = ParticleFrame<dim>::parse_fields(config_backup.get(
+          "frame_fields", std::string(default_frame_fields)));
+      frame.gather(*this, fields);
+      CompressedFrameEncoder<dim> encoder;
+      encoder.initialize(config_backup.get("frame_bits", std::string("")), 1,
+                         config_backup.get("frame_compression_level", 1));
+      encoder.write(frame, fields, compressed_file);
+    });
+    TC_INFO(
+        "Output of {} particles: .txt {:.3f} s, .csv {:.3f} s, .mpmf {:.3f} s "
+        "({} B), .bgeo {:.3f} s ({} B), .mpmz {:.3f} s ({} B)",
+        particles.size(), particle_time, dataset_time, frame_time,
+        file_size(frame_file), partio_time, file_size(partio_file),
+        compressed_time, file_size(compressed_file));
+    return fmt::format("{} {} {} {} {} {} {} {}", particle_time, dataset_time,
+                       frame_time, partio_time, compressed_time,
+                       file_size(frame_file), file_size(partio_file),
+                       file_size(compressed_file));
+
+  // benchmark substeps --------------------------------------------------------
+  // Runs "warmup" substeps, then times "substeps" more on "threads" threads,
+  // for scripts/benchmark_suite.py. Returns JSON: the stage metrics of the
+  // timed substeps, particle updates per second overall and per stage, and
+  // the peak resident memory of the process.
+  } else if (action == "benchmark_substeps") {
+    int warmup = config.get("warmup", 0);
+    int substeps = config.get("substeps", 100);
+    int threads = config.get("threads", this->num_threads);
+    bool metrics_enabled = stage_metrics.enabled;
+    int num_threads = this->num_threads;
+    stage_metrics.enabled = true;
+    this->num_threads = threads;
+    StageRecord record;
+    // Also limits the TBB loops
+    tbb::task_arena arena(threads);
+    arena.execute([&]() {
+      auto next_substep = [&]() {
+        substep(get_next_delta_t(std::numeric_limits<real>::infinity()));
+      };
+      for (int i = 0; i < warmup; i++) {
+        next_substep();
+      }
+      auto before = stage_metrics.get("total");
+      for (int i = 0; i < substeps; i++) {
+        next_substep();
+      }
+      record = stage_metrics.get("total").since(before);
+    });
+    request_t = this->current_t;
+    this->num_threads = num_threads;
+    stage_metrics.enabled = metrics_enabled;
+
+    // Every particle is updated once per substep (not so with options.async)
+    float64 updates = (float64)particles.size() * substeps;
+    std::string stage_rates;
+    for (int i = 0; i < num_mpm_stages; i++) {
+      if (record.stage_time[i] > 0) {
+        stage_rates += fmt::format(
+            "{}\"{}\": {}", stage_rates.empty() ? "" : ", ",
+            get_stage_name((MPMStage)i), updates / record.stage_time[i]);
       }
     }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return fmt::format(
+        "{{\"threads\": {}, \"particles\": {}, \"substeps\": {}, "
+        "\"wall\": {}, \"particle_updates_per_second\": {}, "
+        "\"max_rss_bytes\": {}, \"stage_updates_per_second\": {{{}}}, "
+        "\"metrics\": {}}}",
+        threads, particles.size(), substeps, record.wall,
+        updates / std::max(record.wall, 1e-9), (uint64)usage.ru_maxrss * 1024,
+        stage_rates, record.to_json());
 
   // delete particles inside level set -----------------------------------------
   } else if (action == "delete_particles_inside_level_set") {
@@ -1187,6 +2040,7 @@ std::string MPM<dim>::general_action(const Config &config) {
         "{} boundary (or abnormal) particles deleted.\n{} Particles remained\n",
         deleted, particles_new.size());
     particles = particles_new;
+    num_sorted_particles = 0;
   } else {
     TC_ERROR("Unknown action: {}", action);
   }
@@ -1227,19 +2081,263 @@ TC_TEST("mpm_serialization") {
   }
 }
 
-// update rigid page map -------------------------------------------------------
-// 2D
-template <>
-void MPM<2>::update_rigid_page_map() {
-  TC_NOT_IMPLEMENTED
+TC_TEST("mpm_checkpoint") {
+  using Vector = Vector2;
+  std::string fn = "/tmp/checkpoint.mpmc";
+  Config config;
+  config.set("res", Vector2i(64));
+  config.set("delta_x", 1.0_f / 64);
+  config.set("base_delta_t", 1e-4_f);
+  MPM<2> mpm, mpm_loaded;
+  mpm.initialize(config);
+  // A rigid body besides the background one
+  mpm.rigids.emplace_back(std::make_unique<RigidBody<2>>());
+  mpm.rigids.back()->set_as_background();
+  mpm.rigids.back()->position = Vector(0.3_f, 0.4_f);
+  // Runs of each rigid body, between other particles
+  std::vector<int> rigid_indices;
+  for (int i = 0; i < 100; i++) {
+    auto alias = i % 50 < 20 ? "jelly" : "rigid_boundary";
+    auto alloc = mpm.allocator.allocate_particle(alias);
+    alloc.second->pos = Vector(0.2_f) + Vector::rand() * 0.6_f;
+    int rigid = -1;
+    if (alloc.second->is_rigid()) {
+      rigid = i < 50 ? 1 : 0;
+      static_cast<RigidBoundaryParticle<2> *>(alloc.second)->rigid =
+          mpm.rigids[rigid].get();
+    }
+    rigid_indices.push_back(rigid);
+    mpm.particles.push_back(alloc.first);
+  }
+  auto pos = mpm.allocator[mpm.particles[0]]->pos;
+  mpm.save_checkpoint(fn);
+  // Saving leaves the simulation as it is
+  CHECK(mpm.particles.size() == 100);
+  CHECK(mpm.allocator.pool.size() == 100);
+  CHECK(mpm.allocator[mpm.particles[0]]->pos == pos);
+  mpm_loaded.load_checkpoint(fn);
+  mpm_loaded.post_load(config);
+  remove(fn.c_str());
+  remove((fn + ".state").c_str());
+  CHECK(mpm_loaded.rigids.size() == 2);
+  CHECK(mpm_loaded.rigids[1]->position == mpm.rigids[1]->position);
+  CHECK(mpm_loaded.particles == mpm.particles);
+  for (int i = 0; i < 100; i++) {
+    auto p = mpm_loaded.allocator[mpm_loaded.particles[i]];
+    CHECK(p->get_name() == mpm.allocator[mpm.particles[i]]->get_name());
+    CHECK(p->pos == mpm.allocator[mpm.particles[i]]->pos);
+    if (rigid_indices[i] != -1) {
+      CHECK(static_cast<RigidBoundaryParticle<2> *>(p)->rigid ==
+            mpm_loaded.rigids[rigid_indices[i]].get());
+    }
+  }
+  // Both step the same way from there
+  mpm.step(-1);
+  mpm_loaded.step(-1);
+  CHECK(mpm_loaded.get_current_time() == mpm.get_current_time());
+  for (int i = 0; i < 100; i++) {
+    auto p = mpm_loaded.allocator[mpm_loaded.particles[i]];
+    auto q = mpm.allocator[mpm.particles[i]];
+    CHECK(std::memcmp(&p->pos, &q->pos, sizeof(p->pos)) == 0);
+  }
 }
-// 3D
-template <>
-void MPM<3>::update_rigid_page_map() {
-  constexpr int dim = 3;
+
+TC_TEST("incremental_sort") {
+  using Vector = Vector2;
+  constexpr int n = 5000;
+  Config config;
+  config.set("res", Vector2i(64));
+  config.set("delta_x", 1.0_f / 64);
+  config.set("base_delta_t", 1e-4_f);
+  MPM<2> mpm;
+  mpm.initialize(config);
+  for (int i = 0; i < n; i++) {
+    auto alloc = mpm.allocator.allocate_particle("jelly");
+    alloc.second->pos = Vector(0.2_f) + Vector::rand() * 0.6_f;
+    mpm.particles.push_back(alloc.first);
+  }
+  mpm.sort_particles_and_populate_grid();
+  // Some particles change cell, and a few are added
+  for (int i = 0; i < n; i += 7) {
+    mpm.allocator[mpm.particles[i]]->pos += Vector(1.5_f / 64, 0.0_f);
+  }
+  for (int i = 0; i < 10; i++) {
+    auto alloc = mpm.allocator.allocate_particle("jelly");
+    alloc.second->pos = Vector(0.2_f) + Vector::rand() * 0.6_f;
+    mpm.particles.push_back(alloc.first);
+  }
+  auto sorted = mpm.particle_sorter;
+  mpm.sort_particle_keys(false);
+  std::vector<uint64> full(mpm.particle_sorter.begin(),
+                           mpm.particle_sorter.begin() + n + 10);
+  mpm.particle_sorter = sorted;
+  mpm.sort_particle_keys(true);
+  for (int i = 0; i < n + 10; i++) {
+    CHECK(mpm.particle_sorter[i] == full[i]);
+  }
+}
+
+TC_TEST("particle_count_overflow") {
+  using Vector = Vector2;
+  using SparseMask = MPM<2>::SparseMask;
+  // More particles in one cell than GridState::particle_count holds
+  constexpr int n = 70000;
+  Config config;
+  config.set("res", Vector2i(64));
+  config.set("delta_x", 1.0_f / 64);
+  config.set("base_delta_t", 1e-4_f);
+  MPM<2> mpm;
+  mpm.initialize(config);
+  for (int i = 0; i < n + 100; i++) {
+    auto alloc = mpm.allocator.allocate_particle("jelly");
+    alloc.second->pos = i < n ? Vector(0.505_f) : Vector::rand() * 0.6_f;
+    mpm.particles.push_back(alloc.first);
+  }
+  mpm.sort_particles_and_populate_grid();
+  CHECK(mpm.particle_count_overflows.size() == 1);
+  auto blocks = mpm.page_map->Get_Blocks();
+  auto grid_array = mpm.grid->Get_Array();
+  uint32 largest = 0;
+  for (uint32 b = 0; b < blocks.second; b++) {
+    auto g = reinterpret_cast<GridState<2> *>(&grid_array(blocks.first[b]));
+    uint32 particle_end = mpm.block_meta[b].particle_offset;
+    for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
+      auto count = mpm.get_particle_count(b, t, g[t]);
+      largest = std::max(largest, count);
+      particle_end += count;
+    }
+    CHECK(particle_end == mpm.block_meta[b + 1].particle_offset);
+  }
+  CHECK(largest >= (uint32)n);
+}
+
+TC_TEST("rigid_slots") {
+  using Vector = Vector2;
+  // More bodies than affinity slots
+  constexpr int n = 20;
+  Config config;
+  config.set("res", Vector2i(512));
+  config.set("delta_x", 1.0_f / 512);
+  config.set("base_delta_t", 1e-4_f);
+  MPM<2> mpm;
+  mpm.initialize(config);
+  // Bodies far apart, except the last one, next to the first
+  int first = (int)mpm.rigids.size();
+  for (int i = 0; i < n; i++) {
+    mpm.rigids.emplace_back(std::make_unique<RigidBody<2>>());
+    Vector center = i + 1 < n ? Vector(0.1_f + 0.2_f * (i % 5),
+                                       0.1_f + 0.2_f * (i / 5))
+                              : Vector(0.12_f, 0.1_f);
+    for (int k = 0; k < 10; k++) {
+      auto alloc = mpm.allocator.allocate_particle("rigid_boundary");
+      alloc.second->pos = center + Vector::rand() * 0.005_f;
+      static_cast<RigidBoundaryParticle<2> *>(alloc.second)->rigid =
+          mpm.rigids.back().get();
+      mpm.particles.push_back(alloc.first);
+    }
+  }
+  for (int r = 0; r < (int)mpm.rigids.size(); r++) {
+    mpm.rigids[r]->id = r;
+  }
+  mpm.sort_particles_and_populate_grid();
+  for (int i = 0; i < n; i++) {
+    CHECK(mpm.get_affinity_slot(first + i) == (i + 1 < n ? 0 : 1));
+  }
+  // No body changed block: the neighbourhoods are not rebuilt
+  auto neighbourhoods = mpm.rigid_neighbourhoods;
+  CHECK(!neighbourhoods.empty());
+  mpm.rigid_neighbourhoods.clear();
+  mpm.sort_particles_and_populate_grid();
+  CHECK(mpm.rigid_neighbourhoods.empty());
+  CHECK(mpm.get_affinity_slot(first + n - 1) == 1);
+}
+
+TC_TEST("async_schedule") {
+  using Vector = Vector2;
+  using SparseMask = MPM<2>::SparseMask;
+  constexpr int n = 4000;
+  Config config;
+  config.set("res", Vector2i(64));
+  config.set("delta_x", 1.0_f / 64);
+  config.set("base_delta_t", 1e-4_f);
+  config.set("async", true);
+  config.set("async_levels", 3);
+  MPM<2> mpm;
+  mpm.initialize(config);
+  auto &scheduler = *mpm.scheduler;
+  for (int i = 0; i < n; i++) {
+    auto alloc = mpm.allocator.allocate_particle("jelly");
+    alloc.second->pos = Vector(0.2_f) + Vector::rand() * 0.6_f;
+    // Over dx / (base_delta_t / 4): the right half takes the finest step
+    if (alloc.second->pos.x > 0.5_f) {
+      alloc.second->set_velocity(Vector(400.0_f, 0.0_f));
+    }
+    mpm.particles.push_back(alloc.first);
+  }
+  // Particles do not move; only the schedule of one base_delta_t is checked
+  std::vector<real> advanced(n, 0.0_f);
+  int substeps = 0;
+  do {
+    // Only the first substep sorts, as no particle changes cell
+    bool resort = !mpm.is_sort_current();
+    CHECK(resort == (substeps == 0));
+    if (resort) {
+      mpm.sort_particles_and_populate_grid();
+    }
+    real delta_t = scheduler.update(resort);
+    auto blocks = mpm.page_map->Get_Blocks();
+    auto fat_blocks = mpm.fat_page_map->Get_Blocks();
+    auto fat_block = [&](const Vector2i &node) {
+      uint64 offset = SparseMask::Linear_Offset(to_std_array(node));
+      offset = (offset >> MPM<2>::log2_size) << MPM<2>::log2_size;
+      auto it = std::lower_bound(fat_blocks.first,
+                                 fat_blocks.first + fat_blocks.second, offset);
+      return uint32(it - fat_blocks.first);
+    };
+    for (uint32 b = 0; b < blocks.second; b++) {
+      for (uint32 i = mpm.block_meta[b].particle_offset;
+           i < mpm.block_meta[b + 1].particle_offset; i++) {
+        auto &p = *mpm.allocator[mpm.particles[i]];
+        real particle_delta_t = scheduler.get_particle_delta_t(p);
+        advanced[p.id] += particle_delta_t;
+        Vector2i base = mpm.get_grid_base_pos(p.pos * mpm.inv_delta_x);
+        if (scheduler.is_block_rasterized(b)) {
+          // The grid reset clears every node the P2G of p writes
+          for (auto &ind : RegionND<2>(Vector2i(0), Vector2i(3))) {
+            CHECK(scheduler.is_fat_block_rasterized(
+                fat_block(base + ind.get_ipos())));
+          }
+        }
+        if (!scheduler.is_due(p)) {
+          CHECK(particle_delta_t == 0);
+          // Its stress still acts over the substep
+          CHECK(scheduler.get_stress_delta_t(p) == Approx(delta_t));
+          continue;
+        }
+        CHECK(particle_delta_t >= delta_t);
+        CHECK(scheduler.is_block_active(b));
+        // The grid passes visit every node the G2P of p reads
+        for (auto &ind : RegionND<2>(Vector2i(0), Vector2i(3))) {
+          CHECK(scheduler.is_fat_block_active(
+              fat_block(base + ind.get_ipos())));
+        }
+      }
+    }
+    scheduler.finish_substep();
+    substeps++;
+  } while (!scheduler.is_synchronized());
+  CHECK(substeps == 4);
+  for (int i = 0; i < n; i++) {
+    CHECK(advanced[i] == Approx(1e-4_f));
+  }
+}
+
+// update rigid page map -------------------------------------------------------
+template <int dim>
+void MPM<dim>::update_rigid_page_map() {
   auto block_size = grid_block_size();
   rigid_page_map->Clear();
-  std::vector<int> block_has_rigid(page_map->Get_Blocks().second, 0);
+  block_has_rigid.assign(page_map->Get_Blocks().second, 0);
   auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
     int particle_begin;
     int particle_end = block_meta[b].particle_offset;
@@ -1247,14 +2345,14 @@ void MPM<3>::update_rigid_page_map() {
     bool has_rigid = false;
     for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
       particle_begin = particle_end;
-      particle_end += g[t].particle_count;
+      particle_end += get_particle_count(b, t, g[t]);
       for (int k = particle_begin; k < particle_end; k++) {
         Particle &p = *allocator[particles[k]];
         has_rigid = has_rigid || p.is_rigid();
       }
     }
     if (has_rigid) {
-      block_has_rigid[b] = true;
+      block_has_rigid[b] = 1;
     }
   };
   parallel_for_each_block_with_index(block_op, false, false);
@@ -1278,8 +2376,244 @@ void MPM<3>::update_rigid_page_map() {
   rigid_page_map->Update_Block_Offsets();
   rigid_block_fractions.push_back(1.0_f * rigid_page_map->Get_Blocks().second /
                                   fat_page_map->Get_Blocks().second);
+
+  // Impulse slots for the blocks transfers treat as rigid
+  rigid_block_slots.resize(blocks.second);
+  int num_slots = 0;
+  for (uint i = 0; i < blocks.second; i++) {
+    rigid_block_slots[i] =
+        rigid_page_map->Test_Page(blocks.first[i]) ? num_slots++ : -1;
+  }
+  rigid_impulses.resize(std::max(num_slots, 1) * rigids.size());
 }
 
+template <int dim>
+void MPM<dim>::reset_rigid_impulses() {
+  tbb::parallel_for(0, (int)rigid_impulses.size(),
+                    [&](int i) { rigid_impulses[i].reset(); });
+}
+
+template <int dim>
+void MPM<dim>::reduce_rigid_impulses() {
+  int num_rigids = (int)rigids.size();
+  int num_slots = (int)rigid_impulses.size() / std::max(num_rigids, 1);
+  // Pairwise, so that the summation order is fixed
+  for (int stride = 1; stride < num_slots; stride *= 2) {
+    tbb::parallel_for(0, (num_slots + 2 * stride - 1) / (2 * stride),
+                      [&](int k) {
+                        int i = k * 2 * stride;
+                        if (i + stride >= num_slots) {
+                          return;
+                        }
+                        for (int r = 0; r < num_rigids; r++) {
+                          rigid_impulses[i * num_rigids + r] +=
+                              rigid_impulses[(i + stride) * num_rigids + r];
+                        }
+                      });
+  }
+  for (int r = 0; r < num_rigids && num_slots > 0; r++) {
+    const RigidImpulse<dim> &sum = rigid_impulses[r];
+    RigidBody<dim> &rigid = *rigids[r];
+    rigid.rigid_force_tmp += sum.force;
+    rigid.rigid_torque_tmp += sum.torque;
+    rigid.tmp_velocity += sum.impulse * rigid.get_inv_mass();
+    TC_STATIC_IF(dim == 2) {
+      id(rigid).tmp_angular_velocity +=
+          id(rigid).get_transformed_inversed_inertia() *
+          id(sum).angular_impulse[0];
+    }
+    TC_STATIC_ELSE {
+      id(rigid).tmp_angular_velocity +=
+          id(rigid).get_transformed_inversed_inertia() *
+          id(sum).angular_impulse;
+    }
+    TC_STATIC_END_IF
+  }
+}
+
+// update affinity slots ------------------------------------------------------
+template <int dim>
+void MPM<dim>::update_rigid_slots() {
+  constexpr int num_slots = GridState<dim>::num_affinity_slots;
+  int num_rigids = (int)rigids.size();
+  if (num_rigids > GridState<dim>::max_num_rigid_bodies) {
+    TC_ERROR("At most {} rigid bodies are supported",
+             GridState<dim>::max_num_rigid_bodies);
+  }
+  if (num_rigids <= num_slots) {
+    rigid_slots.resize(num_rigids);
+    for (int r = 0; r < num_rigids; r++) {
+      rigid_slots[r] = r;
+    }
+    rigid_block_bodies.clear();
+    return;
+  }
+
+  // Bodies present in each rigid block
+  auto blocks = page_map->Get_Blocks();
+  std::vector<std::vector<int>> block_rigids(blocks.second);
+  tbb::parallel_for(0, (int)blocks.second, [&](int b) {
+    if (!block_has_rigid[b]) {
+      return;
+    }
+    auto &ids = block_rigids[b];
+    for (uint32 k = block_meta[b].particle_offset;
+         k < block_meta[b + 1].particle_offset; k++) {
+      Particle &p = *allocator[particles[k]];
+      if (p.is_rigid()) {
+        ids.push_back(static_cast<RigidBoundaryParticle<dim> &>(p).rigid->id);
+      }
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  });
+  std::vector<uint32> body_offsets(blocks.second + 1, 0);
+  for (uint32 b = 0; b < blocks.second; b++) {
+    body_offsets[b + 1] = body_offsets[b] + (uint32)block_rigids[b].size();
+  }
+  std::vector<std::pair<uint64, int>> bodies(body_offsets.back());
+  tbb::parallel_for(0, (int)blocks.second, [&](int b) {
+    for (std::size_t i = 0; i < block_rigids[b].size(); i++) {
+      bodies[body_offsets[b] + i] =
+          std::make_pair(blocks.first[b], block_rigids[b][i]);
+    }
+  });
+  // Slots and neighbourhoods only depend on which bodies are in which blocks
+  if (bodies == rigid_block_bodies && (int)rigid_slots.size() == num_rigids) {
+    return;
+  }
+  rigid_block_bodies = std::move(bodies);
+
+  // A particle sees the tags of bodies up to two blocks away: bodies sharing a
+  // neighbourhood (of radius 2) conflict
+  constexpr int num_neighbours = dim == 2 ? 25 : 125;
+  constexpr uint64 invalid = std::numeric_limits<uint64>::max();
+  auto block_size = grid_block_size();
+  std::vector<std::pair<uint64, int>> neighbourhoods(
+      rigid_block_bodies.size() * num_neighbours);
+  tbb::parallel_for(0, (int)rigid_block_bodies.size(), [&](int i) {
+    auto body = rigid_block_bodies[i];
+    Vectori base_pos(SparseMask::LinearToCoord(body.first));
+    int n = 0;
+    for (auto &ind : Region(Vectori(-2), Vectori(3))) {
+      Vectori nei_pos = base_pos + ind.get_ipos() * block_size;
+      auto &nei = neighbourhoods[i * num_neighbours + n++];
+      if (VectorI(0) <= VectorI(nei_pos) &&
+          VectorI(nei_pos) < VectorI(spgrid_size)) {
+        nei = std::make_pair(SparseMask::Linear_Offset(nei_pos), body.second);
+      } else {
+        nei = std::make_pair(invalid, -1);
+      }
+    }
+  });
+  tbb::parallel_sort(neighbourhoods.begin(), neighbourhoods.end());
+  neighbourhoods.erase(
+      std::unique(neighbourhoods.begin(), neighbourhoods.end()),
+      neighbourhoods.end());
+  if (!neighbourhoods.empty() && neighbourhoods.back().first == invalid) {
+    neighbourhoods.pop_back();
+  }
+  // Per body, the bodies it conflicts with
+  std::vector<std::vector<int>> conflicts(num_rigids);
+  for (std::size_t begin = 0, end; begin < neighbourhoods.size(); begin = end) {
+    end = begin;
+    while (end < neighbourhoods.size() &&
+           neighbourhoods[end].first == neighbourhoods[begin].first) {
+      end++;
+    }
+    for (std::size_t i = begin; i < end; i++) {
+      for (std::size_t j = begin; j < end; j++) {
+        if (i != j) {
+          conflicts[neighbourhoods[i].second].push_back(
+              neighbourhoods[j].second);
+        }
+      }
+    }
+  }
+  tbb::parallel_for(0, num_rigids, [&](int r) {
+    std::sort(conflicts[r].begin(), conflicts[r].end());
+    conflicts[r].erase(std::unique(conflicts[r].begin(), conflicts[r].end()),
+                       conflicts[r].end());
+  });
+
+  // Greedy coloring, keeping previous slots first
+  std::vector<int> previous = rigid_slots;
+  previous.resize(num_rigids, -1);
+  rigid_slots.assign(num_rigids, -1);
+  auto taken_slots = [&](int r) {
+    uint32 taken = 0;
+    for (int s : conflicts[r]) {
+      if (rigid_slots[s] != -1) {
+        taken |= 1u << rigid_slots[s];
+      }
+    }
+    return taken;
+  };
+  for (int r = 0; r < num_rigids; r++) {
+    if (previous[r] != -1 && !((taken_slots(r) >> previous[r]) & 1)) {
+      rigid_slots[r] = previous[r];
+    }
+  }
+  bool changed = false;
+  for (int r = 0; r < num_rigids; r++) {
+    if (rigid_slots[r] != -1) {
+      continue;
+    }
+    uint32 taken = taken_slots(r);
+    for (int s = 0; s < num_slots && rigid_slots[r] == -1; s++) {
+      if (!((taken >> s) & 1)) {
+        rigid_slots[r] = s;
+      }
+    }
+    if (rigid_slots[r] == -1) {
+      TC_ERROR("More than {} rigid bodies within two blocks of each other",
+               num_slots);
+    }
+    changed = changed || previous[r] != -1;
+  }
+
+  // Move particle tags of bodies that changed slot. A tag belongs to the one
+  // body that had its slot around the particle's block.
+  if (changed) {
+    auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+      auto begin = std::lower_bound(rigid_neighbourhoods.begin(),
+                                    rigid_neighbourhoods.end(),
+                                    std::make_pair(block_offset, -1));
+      auto end = begin;
+      while (end != rigid_neighbourhoods.end() && end->first == block_offset) {
+        end++;
+      }
+      for (uint32 k = block_meta[b].particle_offset;
+           k < block_meta[b + 1].particle_offset; k++) {
+        Particle &p = *allocator[particles[k]];
+        if (p.is_rigid() || p.states == 0) {
+          continue;
+        }
+        AffinityType states = 0;
+        for (auto it = begin; it != end; it++) {
+          int r = it->second;
+          if (previous[r] != -1) {
+            states |= ((p.states >> (2 * previous[r])) & 3)
+                      << (2 * rigid_slots[r]);
+          }
+        }
+        p.states = states;
+      }
+    };
+    parallel_for_each_block_with_index(block_op, false, false);
+  }
+  rigid_neighbourhoods = std::move(neighbourhoods);
+}
+
+template void MPM<2>::update_rigid_page_map();
+template void MPM<3>::update_rigid_page_map();
+template void MPM<2>::update_rigid_slots();
+template void MPM<3>::update_rigid_slots();
+template void MPM<2>::reset_rigid_impulses();
+template void MPM<3>::reset_rigid_impulses();
+template void MPM<2>::reduce_rigid_impulses();
+template void MPM<3>::reduce_rigid_impulses();
+
 // calculate energy ------------------------------------------------------------
 template <int dim>
 real MPM<dim>::calculate_energy() {
@@ -7,10 +7,12 @@
 
 #include <memory>
 #include <vector>
+#include <deque>
 #include <memory.h>
 #include <string>
 #include <functional>
 #include <utility>
+#include <unordered_map>
 
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/common/meta.h>
@@ -26,6 +28,14 @@
 #include "kernel.h"
 #include "particles.h"
 #include "articulation.h"
+#include "async/mpm_scheduler.h"
+#include "rigid_hull.h"
+#include "rigid_sdf.h"
+#include "baked_levelset.h"
+#include "dirichlet_region.h"
+#include "io/checkpoint.h"
+#include "io/frame_writer.h"
+#include "profiling/stage_metrics.h"
 #include "taichi/dynamics/rigid_body.h"
 
 TC_NAMESPACE_BEGIN
@@ -35,6 +45,120 @@ struct MPMKernel;
 
 constexpr uint64 state_mask = 0xAAAAAAAAAAAAAAAA;
 
+// Options read inside the substep stages. Parsed once from the config so that
+// inner loops read plain fields instead of doing string lookups.
+struct MPMOptions {
+  // substep stages
+  bool optimized;
+  bool incremental_sort;
+  bool benchmark_rasterize;
+  bool benchmark_resample;
+  int coupling_iterations;
+  bool visualize_cdf;
+  bool visualize_particle_cdf;
+  bool particle_bc_at_levelset;
+  bool rigid_body_levelset_collision;
+  bool clean_boundary;
+  bool particle_collision;
+  bool print_energy;
+
+  // rigid body coupling
+  bool compute_particle_impulses;
+  bool visualize_particle_impulses;
+  bool affect_particle_impulses;
+  bool cdf_3d_modified;
+  int cdf_expand;
+  // rigid CDF from baked body-frame SDFs instead of the mesh triangles
+  bool rigid_sdf;
+  real rigid_sdf_band;
+  // Levelset sampled on the grid nodes once per frame (baked_levelset.h)
+  bool baked_levelset;
+  int articulation_iterations;
+  bool sand_climb;
+  bool rigid_body_gravity;
+  int free_axis_in_position;
+  bool print_rigid_body_state;
+  bool rigid_body_collision;
+  int rigid_body_iterations;
+  real rigid_penalty;
+  bool rigid_body_position_iterations;
+
+  // grid boundary conditions
+  int expr_leaky_levelset;
+  real hack_velocity;
+  real hack_time;
+  real sand_speed;
+  bool gravity_cutting;
+  bool sand_crawler;
+  real dirichlet_boundary_radius;
+
+  // adaptive time stepping
+  bool adaptive_dt;
+  real min_delta_t;
+  real max_delta_t;
+  // Substeps kept in MPM::dt_history
+  int dt_history_size;
+  // Frames between reports of the adaptive dt range and of clamped substeps
+  int dt_log_interval;
+
+  // asynchronous time stepping, see async/mpm_scheduler.h
+  bool async;
+  // frames written on the writer thread, see io/frame_writer.h; off with
+  // perf_counters
+  bool async_output;
+
+  // boundary particle removal
+  int remove_particles;
+  real remove_height;
+  bool warn_particle_deletion;
+
+  void initialize(const Config &config);
+};
+
+// The rigid-block options of rasterize_optimized. Copied from MPMOptions once
+// per call, so the kernel reads plain locals.
+struct CachedP2GOptions {
+  bool compute_particle_impulses_;
+  bool visualize_particle_impulses_;
+  bool affect_particle_impulses_;
+
+  explicit CachedP2GOptions(const MPMOptions &options)
+      : compute_particle_impulses_(options.compute_particle_impulses),
+        visualize_particle_impulses_(options.visualize_particle_impulses),
+        affect_particle_impulses_(options.affect_particle_impulses) {
+  }
+
+  bool compute_particle_impulses() const {
+    return compute_particle_impulses_;
+  }
+
+  bool visualize_particle_impulses() const {
+    return visualize_particle_impulses_;
+  }
+
+  bool affect_particle_impulses() const {
+    return affect_particle_impulses_;
+  }
+};
+
+// The same options looked up in the Config at every use, as before
+// MPMOptions. Only for the comparison in the "benchmark_p2g" action.
+struct ConfigP2GOptions {
+  const Config *config;
+
+  bool compute_particle_impulses() const {
+    return config->get("compute_particle_impulses", false);
+  }
+
+  bool visualize_particle_impulses() const {
+    return config->get("visualize_particle_impulses", false);
+  }
+
+  bool affect_particle_impulses() const {
+    return config->get("affect_particle_impulses", false);
+  }
+};
+
 template <typename T>
 void read_from_binary_file_dynamic(T *t, const std::string &file_name) {
   BinaryInputSerializer reader;
@@ -53,6 +177,55 @@ void write_to_binary_file_dynamic(const T *t, const std::string &file_name) {
   writer.write_to_file(file_name);
 }
 
+// Impulses from particles on one rigid body, summed without locking.
+// Note, torques are stored as vectors; the 2D torque is a scalar kept in x.
+template <int dim>
+struct RigidImpulse {
+  using Vector = VectorND<dim, real>;
+  Vector force, torque;             // on the center of mass
+  Vector impulse, angular_impulse;  // for the tmp (angular) velocity
+
+  RigidImpulse() {
+    reset();
+  }
+
+  void reset() {
+    force = torque = impulse = angular_impulse = Vector(0.0_f);
+  }
+
+  TC_FORCE_INLINE static Vector moment(const Vector &arm, const Vector &f) {
+    Vector ret(0.0_f);
+    TC_STATIC_IF(dim == 2) {
+      ret[0] = id(arm)[0] * id(f)[1] - id(arm)[1] * id(f)[0];
+    }
+    TC_STATIC_ELSE {
+      ret = cross(id(arm), id(f));
+    }
+    TC_STATIC_END_IF
+    return ret;
+  }
+
+  // Equivalent to RigidBody::apply_tmp_impulse
+  TC_FORCE_INLINE void add_impulse(const Vector &impulse_,
+                                   const Vector &arm) {
+    impulse += impulse_;
+    angular_impulse += moment(arm, impulse_);
+  }
+
+  TC_FORCE_INLINE void add_force(const Vector &force_, const Vector &arm) {
+    force += force_;
+    torque += moment(arm, force_);
+  }
+
+  RigidImpulse &operator+=(const RigidImpulse &o) {
+    force += o.force;
+    torque += o.torque;
+    impulse += o.impulse;
+    angular_impulse += o.angular_impulse;
+    return *this;
+  }
+};
+
 template <int dim>
 class MPM : public Simulation<dim> {
  public:
@@ -77,11 +250,64 @@ class MPM : public Simulation<dim> {
   using ParticlePtr = typename ParticleAllocator<dim>::ParticlePtr;
 
   // No need to serialize grid
-  using PageMap = SPGrid_Page_Map<log2_size>;
+  using PageMap = ParallelPageMap<log2_size>;
   std::unique_ptr<PageMap> page_map;
   std::unique_ptr<PageMap> rigid_page_map;
   std::unique_ptr<PageMap> fat_page_map;
   std::unique_ptr<SparseGrid> grid;
+  // Rebuilt from config_backup on initialize/load
+  MPMOptions options;
+  // dt of the current substep, base_delta_t unless options.adaptive_dt or
+  // options.async
+  real current_delta_t = 0;
+  // (t, dt) of the last options.dt_history_size adaptive substeps since
+  // initialize/load
+  std::deque<std::pair<real, real>> dt_history;
+  // Since the last report (options.dt_log_interval): frames, substeps and
+  // their dt range, substeps clamped up to min_delta_t, i.e. run above the
+  // stable dt, and the smallest stable dt among them
+  int dt_log_frames = 0;
+  int dt_log_substeps = 0;
+  real dt_log_min = 0, dt_log_max = 0;
+  int unstable_substeps = 0;
+  real min_unstable_delta_t = 0;
+  // One partial sum per (rigid block, rigid body), see get_rigid_impulses
+  std::vector<int> rigid_block_slots;
+  std::vector<RigidImpulse<dim>> rigid_impulses;
+  // Per rigid body (the background one has an empty field), see
+  // options.rigid_sdf
+  std::vector<RigidSDF<dim>> rigid_sdfs;
+  // options.baked_levelset; rebuilt as needed, see bake_levelset
+  BakedLevelSet<dim> baked_levelset;
+  // Applied in order; not serialized
+  std::vector<DirichletRegion<dim>> dirichlet_regions;
+  // Per rigid body, for rigid-rigid collision detection (3D only). Built
+  // lazily; not serialized.
+  std::vector<RigidHull> rigid_hulls;
+  // Per page_map block: whether it holds rigid particles
+  std::vector<uint8> block_has_rigid;
+  // Particle counts of the nodes that do not fit GridState::particle_count,
+  // by b * elements_per_block + t. Almost always empty.
+  std::unordered_map<uint64, uint32> particle_count_overflows;
+  // From the last update_rigid_slots, sorted (block offset, rigid id) pairs:
+  // of the bodies within two blocks of each block, and of the bodies in each
+  // rigid block
+  std::vector<std::pair<uint64, int>> rigid_neighbourhoods;
+  std::vector<std::pair<uint64, int>> rigid_block_bodies;
+  // Keys of the next sort, and the number of particles whose key in
+  // particle_sorter is still in particle order (see sort_particle_keys)
+  std::vector<uint64> particle_sorter_;
+  uint32 num_sorted_particles = 0;
+  // Only if options.async
+  std::unique_ptr<MPMScheduler<dim>> scheduler;
+  // Created at the first frame, see write_bgeo
+  mutable std::unique_ptr<FrameWriter<dim>> frame_writer;
+  // Stage timings, if "metrics" or "metrics_file"
+  StageMetrics stage_metrics;
+  // Per-thread stage and block task events, if "trace_file"
+  Timeline timeline;
+  // Hardware counters per stage, if "perf_counters"
+  PerfCounters perf_counters;
 
   /***************************************************************
    * Serialized
@@ -108,6 +334,7 @@ class MPM : public Simulation<dim> {
   int step_counter = 0;
   uint64 update_counter = 0;
   real sound_smoothed = 0;
+  // Per substep, summed by the workers with add_counter
   uint64 cutting_counter;
   uint64 plasticity_counter;
   Config config_backup;
@@ -130,8 +357,18 @@ class MPM : public Simulation<dim> {
   std::vector<std::unique_ptr<RigidBody<dim>>> rigids;
   std::vector<std::unique_ptr<Articulation<dim>>> articulations;
   ParticleAllocator<dim> allocator;
+  // Affinity slot (tag bits in GridState/particle states) of each rigid body
+  std::vector<int> rigid_slots;
 
   TC_IO_DECL_VIRT {
+    io_fields(serializer, true);
+  }
+
+  // The fields of io(). Without particles, the particle pool and lists
+  // (particles, particles_, particle_sorter) are left out: checkpoints store
+  // them themselves, see io/checkpoint.h.
+  template <typename S>
+  void io_fields(S &serializer, bool with_particles) const {
     Base::io(serializer);
     TC_IO(penalty);
     TC_IO(res);
@@ -158,14 +395,23 @@ class MPM : public Simulation<dim> {
     TC_IO(plasticity_counter);
     TC_IO(config_backup);
     TC_IO(spgrid_size);
-    TC_IO(particles);
-    TC_IO(particles_);
+    if (with_particles) {
+      TC_IO(particles);
+      TC_IO(particles_);
+    }
     TC_IO(block_meta);
-    TC_IO(particle_sorter);
+    if (with_particles) {
+      TC_IO(particle_sorter);
+    }
     TC_IO(rigid_block_fractions);
     TC_IO(rigids);
     TC_IO(articulations);
-    TC_IO(allocator);
+    if (with_particles) {
+      TC_IO(allocator);
+    } else {
+      allocator.io_fields(serializer, false);
+    }
+    TC_IO(rigid_slots);
   }
 
   bool test() const override;
@@ -178,10 +424,22 @@ class MPM : public Simulation<dim> {
 
   void rasterize_optimized(real delta_t);
 
+  // CachedP2GOptions or ConfigP2GOptions
+  template <typename P2GOptions>
+  void rasterize_optimized(real delta_t, const P2GOptions p2g_options);
+
   void gather_cdf();
 
   void rasterize_rigid_boundary();
 
+  // Fills the grid CDF as rasterize_rigid_boundary does, from rigid_sdfs
+  void rasterize_rigid_sdf();
+
+  // Bakes the fields of the rigid bodies added since the last call
+  void bake_rigid_sdfs();
+  // Bakes the fat blocks not in baked_levelset yet, for the current levelset
+  void bake_levelset();
+
   // added
   void reset_grid_granular_fluidity();
 
@@ -192,8 +450,11 @@ class MPM : public Simulation<dim> {
   // apply grid boundary conditions --------------------------------------------
   void apply_grid_boundary_conditions(const DynamicLevelSet<dim> &levelset, real t);
 
+  // Only on the fat blocks that intersect each of dirichlet_regions
   void apply_dirichlet_boundary_conditions();
 
+  void add_legacy_dirichlet_regions(const Config &config);
+
   TC_FORCE_INLINE real &grid_mass(const Vectori &ind) {
     return get_grid(ind).velocity_and_mass[dim];
   }
@@ -213,7 +474,14 @@ class MPM : public Simulation<dim> {
   void particle_bc_at_levelset(real t);  // added
   void particle_collision_resolution(real t);
   void rigid_body_levelset_collision(real t, real dt);
-  void substep();
+  void substep(real delta_t);
+  // Counts of the substep for stage_metrics
+  void record_substep_metrics(real delta_t);
+
+  // Largest stable dt over all particles (CFL and material stiffness)
+  real get_allowed_dt();
+
+  real get_next_delta_t(real remaining_t);
 
   template <typename T>
   void parallel_for_each_particle(const T &target) {
@@ -273,9 +541,8 @@ class MPM : public Simulation<dim> {
 
   // articulate ----------------------------------------------------------------
   void articulate(real delta_t) {
-    int articulation_iterations =
-        config_backup.get("articulation_iterations", 100);
-    if (config_backup.get("sand_climb", false)) {
+    int articulation_iterations = options.articulation_iterations;
+    if (options.sand_climb) {
       /*
       bool first = true;
       pair<real, real> pos_min, pos_max;
@@ -329,36 +596,37 @@ class MPM : public Simulation<dim> {
 
   void write_bgeo() const {
     ++(const_cast<MPM<dim> *>(this)->frame_count);
-    std::string directory = config_backup.get_string("frame_directory");
-    std::string filename;
-
-    if (config_backup.get("write_partio", false)){
-      filename = fmt::format("{}/{:04}.bgeo", directory, frame_count);
-      write_partio(filename);
+    // The outputs are written on the writer thread while the next substeps
+    // run; only the snapshot is taken here
+    if (!frame_writer) {
+      frame_writer = std::make_unique<FrameWriter<dim>>(config_backup);
     }
-
-    if (config_backup.get("write_rigid_body", false)){
-      // Start from 1 (0 is the background rigid body.)
-      for (int i = 1; i < (int)rigids.size(); i++) {
-        filename = fmt::format("{}/rigid_{:03}_{:04}", directory, i, frame_count);
-        write_rigid_body(rigids[i].get(), filename);
-      }
+    auto &snapshot = frame_writer->acquire();
+    snapshot.set_outputs(config_backup);
+    take_snapshot(snapshot);
+    frame_writer->submit();
+    if (!options.async_output) {
+      frame_writer->flush();
     }
+  }
 
-    // added
-    if (config_backup.get("write_particle", false)){
-      // if (frame_count%50 == 0 || frame_count == 1) {
-        filename = fmt::format("{}/particle_{:04}", directory, frame_count);
-        write_particle(filename);
-      // }
-    }
+  // Fast checkpoints, see io/checkpoint.h. Also writes <file_name>.state.
+  void save_checkpoint(const std::string &file_name) const;
+  // Restores the state; call post_load after
+  void load_checkpoint(const std::string &file_name);
+  // Rebuilds what is not serialized, after load/load_checkpoint. config
+  // holds the scripted functions.
+  void post_load(const Config &config);
 
-    // added
-    if (config_backup.get("write_dataset", false)){
-        filename = fmt::format("{}/ds_{:04}", directory, frame_count);
-        write_dataset(rigids[1].get(), filename);
-    }
-  }
+  // Copies what the requested outputs of snapshot need
+  void take_snapshot(FrameSnapshot<dim> &snapshot) const;
+  void take_rigid_snapshot(RigidBody<dim> const *rigid,
+                           typename FrameSnapshot<dim>::Rigid &snapshot,
+                           bool with_mesh) const;
+
+  // Binary columnar frame (see io/particle_frame.h) of the fields in
+  // config 'frame_fields'
+  void write_frame(const std::string &file_name) const;
 
   TC_FORCE_INLINE GridState<dim> &get_grid(const Vectori &i) {
     return grid->Get_Array()(to_std_array(i));
@@ -377,7 +645,34 @@ class MPM : public Simulation<dim> {
   }
 
   virtual void sort_allocator();
+  // A particle_sorter key is the particle's cell (SPGrid offset >> data_bits,
+  // dim * log2(spgrid_size) bits) followed by its index in the low bits
+  int get_sorter_index_bits() const {
+    int axis_bits = 0;
+    while ((1 << axis_bits) < spgrid_size) {
+      axis_bits++;
+    }
+    return 64 - dim * axis_bits;
+  }
+
+  void sort_particle_keys(bool incremental);
   void sort_particles_and_populate_grid();
+  // With options.async, true between synchronizations if no particle left its
+  // cell since the last sort: the sort and page maps can be kept
+  bool is_sort_current() const;
+  // Clears the grid the P2G of this substep writes, keeping particle_count
+  void reset_substep_grid();
+
+  // Number of particles of node t of page_map block b, whose GridState is g
+  TC_FORCE_INLINE uint32 get_particle_count(uint32 b,
+                                            uint32 t,
+                                            const GridState<dim> &g) const {
+    if (g.particle_count != GridState<dim>::particle_count_overflow) {
+      return g.particle_count;
+    }
+    return particle_count_overflows.at(
+        (uint64)b * SparseMask::elements_per_block + t);
+  }
 
   template <typename T>
   void parallel_for_each_active_grid(const T &target, bool fat = true) {
@@ -390,9 +685,11 @@ class MPM : public Simulation<dim> {
     ThreadedTaskManager::run((int)blocks.second, this->num_threads, [&](int b) {
       GridState<dim> *g =
           reinterpret_cast<GridState<dim> *>(&grid_array(blocks.first[b]));
-      for (int i = 0; i < (int)SparseMask::elements_per_block; i++) {
-        target(g[i]);
-      }
+      run_block_task(b, -1, [&]() {
+        for (int i = 0; i < (int)SparseMask::elements_per_block; i++) {
+          target(g[i]);
+        }
+      });
     });
   }
 
@@ -407,7 +704,7 @@ class MPM : public Simulation<dim> {
     ThreadedTaskManager::run((int)blocks.second, this->num_threads, [&](int b) {
       GridState<dim> *g =
           reinterpret_cast<GridState<dim> *>(&grid_array(blocks.first[b]));
-      target(g);
+      run_block_task(b, -1, [&]() { target(g); });
     });
   }
 
@@ -422,7 +719,7 @@ class MPM : public Simulation<dim> {
           (int)blocks.second, this->num_threads, [&](int b) {
             GridState<dim> *g = reinterpret_cast<GridState<dim> *>(
                 &grid_array(blocks.first[b]));
-            target(b, blocks.first[b], g);
+            run_block_task(b, -1, [&]() { target(b, blocks.first[b], g); });
           });
     } else {
       for (int i = 0; i < (1 << dim); i++) {
@@ -437,7 +734,8 @@ class MPM : public Simulation<dim> {
                   return;
                 }
               }
-              target(b, blocks.first[b], g);
+              run_block_task(b, -1,
+                             [&]() { target(b, blocks.first[b], g); });
             });
       }
     }
@@ -453,12 +751,19 @@ class MPM : public Simulation<dim> {
     else
       blocks = page_map->Get_Blocks();
     auto grid_array = grid->Get_Array();
+    // page_map blocks are the ones of block_meta
+    auto particle_count = [&](int b) {
+      return fat ? -1
+                 : (int32)(block_meta[b + 1].particle_offset -
+                           block_meta[b].particle_offset);
+    };
     if (!colored) {
       ThreadedTaskManager::run(
           (int)blocks.second, this->num_threads, [&](int b) {
             GridState<dim> *g = reinterpret_cast<GridState<dim> *>(
                 &grid_array(blocks.first[b]));
-            target(b, blocks.first[b], g);
+            run_block_task(b, particle_count(b),
+                           [&]() { target(b, blocks.first[b], g); });
           });
     } else {
       for (int i = 0; i < (1 << dim); i++) {
@@ -473,12 +778,55 @@ class MPM : public Simulation<dim> {
                   return;
                 }
               }
-              target(b, blocks.first[b], g);
+              run_block_task(b, particle_count(b),
+                             [&]() { target(b, blocks.first[b], g); });
             });
       }
     }
   }
 
+  // Calls target(p, phi, normal) for the particles of the page_map blocks in
+  // the band of baked_levelset (in delta_x, at time t). Particles of inside
+  // blocks, or off the nodes of their block, sample the levelset itself.
+  template <typename T>
+  void parallel_for_each_particle_near_levelset(real t, const T &target) {
+    parallel_for_each_block_with_index(
+        [&](uint32 b, uint64 block_offset, GridState<dim> *) {
+          int32 block = baked_levelset.get_block(block_offset);
+          if (block == BakedLevelSet<dim>::outside) {
+            return;
+          }
+          Vectori base(SparseMask::LinearToCoord(block_offset));
+          for (uint32 i = block_meta[b].particle_offset;
+               i < block_meta[b + 1].particle_offset; i++) {
+            Particle &p = *allocator[particles[i]];
+            Vector pos = p.pos * inv_delta_x;
+            real phi;
+            Vector normal;
+            if (block == BakedLevelSet<dim>::inside ||
+                !baked_levelset.sample(block, base, pos, t, phi, normal)) {
+              phi = this->levelset.sample(pos, t);
+              normal = this->levelset.get_spatial_gradient(pos, t);
+            }
+            target(p, phi, normal);
+          }
+        },
+        false);
+  }
+
+  // Runs task, traced as a block task of the current stage if the timeline
+  // is enabled
+  template <typename T>
+  TC_FORCE_INLINE void run_block_task(int b, int32 particles, const T &task) {
+    if (!timeline.enabled) {
+      task();
+      return;
+    }
+    auto begin = timeline.now();
+    task();
+    timeline.record(timeline.stage, begin, b, particles);
+  }
+
   Matrix damp_affine_momemtum(const Matrix &b) {
     auto b_sym = 0.5_f * (b + b.transposed());
     auto b_skew = b - b_sym;
@@ -499,6 +847,66 @@ class MPM : public Simulation<dim> {
   }
 
   void update_rigid_page_map();
+
+  // Affinity slots ------------------------------------------------------------
+  // With at most GridState::num_affinity_slots bodies, slot = id. Otherwise
+  // bodies are colored so that bodies within a few blocks of each other get
+  // different slots, keeping their previous slots when possible; particle
+  // states are moved along when a body's slot changes. Skipped while no body
+  // enters or leaves a block.
+  void update_rigid_slots();
+
+  TC_FORCE_INLINE int get_affinity_slot(int rigid_id) const {
+    return rigid_slots[rigid_id];
+  }
+
+  // Side (0 or 1) of rigid body rigid_id in particle states
+  TC_FORCE_INLINE int get_affinity_side(uint64 states, int rigid_id) const {
+    return (states >> (2 * rigid_slots[rigid_id])) % 2;
+  }
+
+  // Rigid body impulses in transfers ------------------------------------------
+  // Blocks write their contributions to their own slots, which are then
+  // tree-reduced in a fixed order. This needs no locking, and the resulting
+  // force/torque does not depend on thread scheduling.
+  void reset_rigid_impulses();
+
+  TC_FORCE_INLINE RigidImpulse<dim> *get_rigid_impulses(uint32 b) {
+    TC_ASSERT(rigid_block_slots[b] != -1);
+    return &rigid_impulses[rigid_block_slots[b] * rigids.size()];
+  }
+
+  // Adds the reduced sums to rigid_force/torque_tmp and the tmp velocities
+  void reduce_rigid_impulses();
+
+  // Counters touched by several workers; sum locally (per block) and add once
+  static void add_counter(uint64 &counter, uint64 n) {
+    if (n != 0) {
+      __atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Step of particle p in the transfers. With options.async it is the
+  // particle's own step, or 0 if p is not due (see MPMScheduler).
+  TC_FORCE_INLINE real get_particle_delta_t(const Particle &p,
+                                            real delta_t) const {
+    return scheduler ? scheduler->get_particle_delta_t(p) : delta_t;
+  }
+
+  // Step over which the stress of p acts on the grid in P2G. With
+  // options.async, particles that are not due still push on their due
+  // neighbours for the whole substep.
+  TC_FORCE_INLINE real get_stress_delta_t(const Particle &p,
+                                          real delta_t) const {
+    return scheduler ? scheduler->get_stress_delta_t(p) : delta_t;
+  }
+
+  // With options.async, false for fat blocks no due particle reads in G2P;
+  // the grid passes skip them
+  TC_FORCE_INLINE bool is_fat_block_needed(uint32 b) const {
+    return !scheduler || scheduler->is_fat_block_active(b);
+  }
+
   std::string get_name() const override {
     return "mpm";
   }
@@ -279,9 +279,26 @@ void MPM<dim>::add_rigid_particle(Config config) {
   }
 
   rigids.push_back(std::move(rigid_ptr));
+  if (options.rigid_sdf) {
+    bake_rigid_sdfs();
+  }
   TC_TRACE("#Particles: {}", particles.size());
 }
 
+// bake rigid SDFs -------------------------------------------------------------
+template <int dim>
+void MPM<dim>::bake_rigid_sdfs() {
+  for (std::size_t r = rigid_sdfs.size(); r < rigids.size(); r++) {
+    rigid_sdfs.emplace_back();
+    // No mesh for the background rigid body
+    if (rigids[r]->mesh) {
+      rigid_sdfs.back().bake(rigids[r]->mesh->elements, delta_x,
+                             options.rigid_sdf_band);
+      TC_TRACE("Rigid body #{}: {} SDF samples", r, rigid_sdfs.back().size());
+    }
+  }
+}
+
 // advect rigid bodies ---------------------------------------------------------
 template <int dim>
 void MPM<dim>::advect_rigid_bodies(real dt) {
@@ -294,11 +311,11 @@ void MPM<dim>::advect_rigid_bodies(real dt) {
     }
 
     // rigid body gravity 
-    if (config_backup.get("rigidBody_gravity", true)) {  // added
+    if (options.rigid_body_gravity) {  // added
       rigid.apply_impulse(this->gravity * rigid.get_mass() * dt, rigid.position);
     }
     
-    int free_axis_in_position = config_backup.get("free_axis_in_position", 0); // added
+    int free_axis_in_position = options.free_axis_in_position; // added
 
     // advance
     rigid.advance(this->current_t, dt, free_axis_in_position);  // added
@@ -308,7 +325,7 @@ void MPM<dim>::advect_rigid_bodies(real dt) {
       rigid.enforce_angular_velocity_parallel_to(rigid.rotation_axis);
     }
     // print rigid body state
-    if (config_backup.get("print_rigid_body_state", true)) {
+    if (options.print_rigid_body_state) {
       // TC_P(rigid->get_mass());
       // TC_P(rigid->get_inertia());
       TC_P(rigid.position);
@@ -330,7 +347,7 @@ void MPM<dim>::advect_rigid_bodies(real dt) {
 // rigid body collision -------------------------------------------------- : OFF
 template <int dim>
 void MPM<dim>::rigidify(real dt) {
-  if (!config_backup.get<bool>("rigid_body_collision", true)) {
+  if (!options.rigid_body_collision) {
     return;
   }
   std::vector<Collision<dim>> collisions;
@@ -338,7 +355,7 @@ void MPM<dim>::rigidify(real dt) {
     Profiler _("collision detection");
     TC_STATIC_IF(dim == 3) {
       RigidSolver<dim> rigid_solver;
-      rigid_solver.detect_rigid_collision(rigids, collisions);
+      rigid_solver.detect_rigid_collision(rigids, rigid_hulls, collisions);
     }
     TC_STATIC_END_IF
   }
@@ -347,10 +364,10 @@ void MPM<dim>::rigidify(real dt) {
   }
   {
     Profiler _("collision resolution");
-    int iterations = config_backup.get("rigid_body_iterations", 5);
+    int iterations = options.rigid_body_iterations;
     for (int i = 0; i < iterations; i++) {
-      auto rigid_penalty = config_backup.get("rigid_penalty", 1e3_f);
-      if (config_backup.get("rigid_body_position_iterations", true)) {
+      auto rigid_penalty = options.rigid_penalty;
+      if (options.rigid_body_position_iterations) {
         for (auto &col : collisions) {
           col.project_position(dt, rigid_penalty);
         }
@@ -421,4 +438,6 @@ template void MPM<2>::rigid_body_levelset_collision(real t, real delta_t);
 template void MPM<3>::rigid_body_levelset_collision(real t, real delta_t);
 template void MPM<2>::add_rigid_particle(Config config);
 template void MPM<3>::add_rigid_particle(Config config);
+template void MPM<2>::bake_rigid_sdfs();
+template void MPM<3>::bake_rigid_sdfs();
 TC_NAMESPACE_END
@@ -38,9 +38,23 @@ class ParticleAllocator {
   uint64 particle_counter = 0;
   std::vector<ParticleContainer<dim> > pool;
   std::vector<ParticleContainer<dim> > pool_;
+  // Of the particles in pool; serialized before them, particles only write
+  // their material ids
+  MaterialTables materials;
 
   TC_IO_DECL {
+    io_fields(serializer, true);
+  }
+
+  // Without the pool, only particle_counter is written: checkpoints store the
+  // pool and the material tables as they are in memory
+  template <typename S>
+  void io_fields(S &serializer, bool with_pool) const {
     TC_IO(particle_counter);
+    if (!with_pool) {
+      return;
+    }
+    TC_IO(materials);
     if (TC_SERIALIZER_IS(BinaryOutputSerializer)) {
       // Output
       std::size_t n = pool.size();
@@ -60,6 +74,7 @@ class ParticleAllocator {
         serializer(name);
         auto p = remove_const(this)->operator[](i);
         create_instance_placement<Particle>(name, p);
+        p->bind_materials(remove_const(this)->materials);
         p->binary_io(serializer);
       }
     }
@@ -70,6 +85,7 @@ class ParticleAllocator {
     auto index = ParticlePtr(pool.size()) - 1;
     Particle *p = create_instance_placement<Particle>(alias, &pool[index]);
     p->id = particle_counter++;
+    p->bind_materials(materials);
     return std::make_pair(index, p);
   }
 
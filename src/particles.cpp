@@ -344,7 +344,10 @@ class LinearParticle : public MPMParticle<dim> {
   }
 
   real get_allowed_dt(const real &dx) const override {
-    return 0.0f;
+    real rho = this->get_mass() / this->vol;
+    real c = sqrt((lambda + 2.0_f * mu) / rho);
+    Vector v = this->get_velocity();
+    return dx / (c + sqrt(v.dot(v)));
   }
 
   Vector3 get_debug_info() const override {
@@ -420,7 +423,10 @@ class JellyParticle : public MPMParticle<dim> {
   }
 
   real get_allowed_dt(const real &dx) const override {
-    return 0.0f;
+    real rho = this->get_mass() / this->vol;
+    real c = sqrt((lambda + 2.0_f * mu) / rho);
+    Vector v = this->get_velocity();
+    return dx / (c + sqrt(v.dot(v)));
   }
 
   Vector3 get_debug_info() const override {
@@ -881,48 +887,42 @@ class NonlocalParticle : public MPMParticle<dim> {
   using Vector = typename Base::Vector;
   using Matrix = typename Base::Matrix;
 
-  real S_mod;  // Shear modulus
-  real B_mod;  // Bulk modulus
-  real A_mat;
-  real dia;
-  real rho_s;
-  real rho_c;
-  real mu_s;
-  real mu_2;
-  real I_0;
-  real t_0;
-  real delta_t;
-
-  TC_IO_DEF_WITH_BASE(S_mod,
-                      B_mod,
-                      A_mat,
-                      dia,
-                      rho_s,
-                      rho_c,
-                      mu_s,
-                      mu_2,
-                      I_0,
-                      t_0,
-                      delta_t);
+  // In the allocator's MaterialTables::nonlocal
+  MaterialRef<NonlocalMaterial> material;
+
+  // Written as the material id; the table goes with the allocator
+  TC_IO_DEF_WITH_BASE(material);
 
   NonlocalParticle() : MPMParticle<dim>() {
   }
 
   void initialize(const Config &config) override {
     Base::initialize(config);
+    NonlocalMaterial parameters;
+    TC_ASSERT_INFO(material.table != nullptr,
+                   "NonlocalParticle created outside of a ParticleAllocator");
     // Conversion ref: https://en.wikipedia.org/wiki/Elastic_modulus
-    S_mod = config.get("S_mod", 3.4483e3_f);
-    B_mod = config.get("B_mod", 3.3333e4_f);
-    A_mat = config.get("A_mat", 0.48_f);
-    dia = config.get("dia", 0.005_f);
-    rho_s = config.get("density", 2550.0_f);
-    rho_c = config.get("critical_density", 2000.0_f);
+    parameters.S_mod = config.get("S_mod", 3.4483e3_f);
+    parameters.B_mod = config.get("B_mod", 3.3333e4_f);
+    parameters.A_mat = config.get("A_mat", 0.48_f);
+    parameters.dia = config.get("dia", 0.005_f);
+    parameters.rho_s = config.get("density", 2550.0_f);
+    parameters.rho_c = config.get("critical_density", 2000.0_f);
     // mu_s should be larger than sqrt(3)*(1-(2*nu))/(1+nu)
-    mu_s = config.get("mu_s", 0.3819_f);
-    mu_2 = config.get("mu_2", 0.6435_f);
-    I_0 = config.get("I_0", 0.278_f);
-    t_0 = config.get("t_0", 1e-3_f);
-    delta_t = config.get("base_delta_t", 1e-4_f);
+    parameters.mu_s = config.get("mu_s", 0.3819_f);
+    parameters.mu_2 = config.get("mu_2", 0.6435_f);
+    parameters.I_0 = config.get("I_0", 0.278_f);
+    parameters.t_0 = config.get("t_0", 1e-3_f);
+    parameters.delta_t = config.get("base_delta_t", 1e-4_f);
+    material.id = material.table->get_or_create(parameters);
+  }
+
+  void bind_materials(MaterialTables &tables) override {
+    material.table = &tables.nonlocal;
+  }
+
+  const NonlocalMaterial &get_material() const {
+    return material.get();
   }
 
   // Apply force @ n
@@ -933,6 +933,14 @@ class NonlocalParticle : public MPMParticle<dim> {
 
   // Calculate stress @ n+1 and update granular fluidity and deformation gradient
   int plasticity(const Matrix &cdg, const real &laplacian_gf) override {
+    const NonlocalMaterial &material = get_material();
+    const real S_mod = material.S_mod, B_mod = material.B_mod;
+    const real A_mat = material.A_mat, dia = material.dia;
+    const real rho_s = material.rho_s, rho_c = material.rho_c;
+    const real mu_s = material.mu_s, mu_2 = material.mu_2;
+    const real I_0 = material.I_0, t_0 = material.t_0;
+    const real delta_t = material.delta_t;
+
     Matrix I = Matrix(1.0_f);
     real eps = 1e-20_f;
     real mu;
@@ -947,7 +955,7 @@ class NonlocalParticle : public MPMParticle<dim> {
       real gamma_dot_equ = 0.0_f;
       for (int i = 0; i < dim; ++i)
         for (int j = 0; j < dim; ++j)
-          gamma_dot_equ += pow(D_0[i][j], 2.0_f);
+          gamma_dot_equ += D_0[i][j] * D_0[i][j];
       gamma_dot_equ = 1.414_f * sqrt(gamma_dot_equ);
       return gamma_dot_equ;  // Total equ shear strain rate @ n+1
     };
@@ -995,16 +1003,16 @@ class NonlocalParticle : public MPMParticle<dim> {
       mu = std::min(this->tau / p_n, mu_2-eps);  // mu @ n
       real gdot_loc = - ((mu_s - mu) * this->gf)
                       - ((mu_2 - mu_s) / I_0 *
-                          sqrt(rho_s * pow(dia, 2.0_f) / p_n) *
-                          mu * pow(this->gf, 2.0_f));
-      real gdot_nonloc = pow(A_mat, 2.0_f) * pow(dia, 2.0_f) * laplacian_gf;
+                          sqrt(rho_s * dia * dia / p_n) *
+                          mu * this->gf * this->gf);
+      real gdot_nonloc = A_mat * A_mat * dia * dia * laplacian_gf;
       this->gf = std::max(0.0_f, (delta_t*(gdot_loc+gdot_nonloc)/t_0) + this->gf);
 
       Matrix Me_0 = Me + this->p * I;
       real Me_0_mag = 0.0_f;
       for (int i = 0; i < dim; ++i)
         for (int j = 0; j < dim; ++j)
-          Me_0_mag += pow(Me_0[i][j], 2.0_f);
+          Me_0_mag += Me_0[i][j] * Me_0[i][j];
       Me_0_mag = sqrt(Me_0_mag);
 
       real tau_trial = 0.707_f * Me_0_mag;  // tau @ tr
@@ -1074,23 +1082,27 @@ class NonlocalParticle : public MPMParticle<dim> {
   }
 
   real get_allowed_dt(const real &dx) const override {
+    const NonlocalMaterial &material = get_material();
     real J = determinant(this->dg_t);
-    real mass = this->get_mass();
-    real vol0 = this->vol;
-    real rho0 = mass / vol0;
-    real rho = rho0 / J;
-
-    real lambda_0 = 204057.0_f, mu_0 = 136038.0_f;  // check it
+    real rho = this->get_mass() / this->vol / J;
 
-    real K = 2.0_f * mu_0 / 3.0_f + lambda_0;
-    real c2 = 4.0_f * mu_0 / (3.0_f * rho) + K * (1.0_f - std::log(J)) / rho0;
+    // P-wave speed from the bulk and shear moduli
+    real c2 = (material.B_mod + 4.0_f / 3.0_f * material.S_mod) / rho;
     c2 = max(c2, 1e-20_f);
     real c = sqrt(c2);
 
     Vector v = this->get_velocity();
     real u = sqrt(v.dot(v));
+    real cfl_dt = dx / (c + u);
 
-    return dx / (c + u);
+    // Explicit nonlocal diffusion of the granular fluidity:
+    // dt < t_0 * dx^2 / (2 * dim * A^2 * d^2)
+    real diffusion = material.A_mat * material.A_mat * material.dia *
+                     material.dia;
+    real diffusion_dt = material.t_0 * dx * dx /
+                        max(2.0_f * dim * diffusion, 1e-30_f);
+
+    return min(cfl_dt, diffusion_dt);
   }
 
   Vector3 get_debug_info() const override {
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <iostream>
+#include <limits>
 #include <taichi/util.h>
 #include <taichi/math/svd.h>
 #include <taichi/math/array.h>
@@ -14,6 +15,93 @@
 
 TC_NAMESPACE_BEGIN
 
+// Per-material parameter table ------------------------------------------------
+// Constants shared by all particles created with the same parameters live
+// here once instead of being copied into every particle; particles keep a
+// 16-bit index into the table. Each ParticleAllocator (i.e. each MPM) owns
+// its tables, see MaterialTables.
+template <typename Material>
+class MaterialTable {
+ public:
+  std::vector<Material> materials;
+
+  TC_IO_DEF(materials);
+
+  uint16 get_or_create(const Material &material) {
+    for (std::size_t i = 0; i < materials.size(); i++) {
+      if (materials[i] == material) {
+        return (uint16)i;
+      }
+    }
+    TC_ASSERT_INFO(materials.size() < std::numeric_limits<uint16>::max(),
+                   "Too many materials");
+    materials.push_back(material);
+    return (uint16)(materials.size() - 1);
+  }
+
+  TC_FORCE_INLINE const Material &get(uint16 id) const {
+    return materials[id];
+  }
+};
+
+// A particle's entry in a MaterialTable. Only the id is serialized; the
+// table itself is written once by the ParticleAllocator, before its particles.
+template <typename Material>
+struct MaterialRef {
+  MaterialTable<Material> *table = nullptr;
+  uint16 id = 0;
+
+  TC_FORCE_INLINE const Material &get() const {
+    return table->get(id);
+  }
+
+  TC_IO_DEF(id);
+};
+
+// Nonlocal granular fluidity (NGF) material constants
+struct NonlocalMaterial {
+  real S_mod;  // Shear modulus
+  real B_mod;  // Bulk modulus
+  real A_mat;
+  real dia;
+  real rho_s;
+  real rho_c;
+  real mu_s;
+  real mu_2;
+  real I_0;
+  real t_0;
+  real delta_t;
+
+  TC_IO_DEF(S_mod,
+            B_mod,
+            A_mat,
+            dia,
+            rho_s,
+            rho_c,
+            mu_s,
+            mu_2,
+            I_0,
+            t_0,
+            delta_t);
+
+  bool operator==(const NonlocalMaterial &o) const {
+    return S_mod == o.S_mod && B_mod == o.B_mod && A_mat == o.A_mat &&
+           dia == o.dia && rho_s == o.rho_s && rho_c == o.rho_c &&
+           mu_s == o.mu_s && mu_2 == o.mu_2 && I_0 == o.I_0 && t_0 == o.t_0 &&
+           delta_t == o.delta_t;
+  }
+};
+
+using NonlocalMaterialTable = MaterialTable<NonlocalMaterial>;
+
+// The tables of one ParticleAllocator, bound to its particles by
+// MPMParticle::bind_materials
+struct MaterialTables {
+  NonlocalMaterialTable nonlocal;
+
+  TC_IO_DEF(nonlocal);
+};
+
 template <int dim>
 class MPMParticle : public Unit {
  public:
@@ -22,31 +110,38 @@ class MPMParticle : public Unit {
   using Matrix = MatrixND<dim, real>;
   using Region = RegionND<dim>;
 
+  // Note, fields are grouped by access frequency rather than by meaning:
+  // everything P2G/G2P touches for every particle comes first so that the
+  // transfers stream the leading cache lines of each particle only.
+  // Serialization order (TC_IO_DEF_VIRT below) is independent of this.
  private:
   VectorP v_and_m;
 
  public:
+  // hot: transfers
   Vector pos;
-  Matrix dg_e;  // Elastic deformation gradient
   Matrix apic_b;  // Affine momemtum (APIC), c234
-  Vector boundary_normal;
-  real boundary_distance;
+  Matrix T;  // added: stress tensor
   real vol;
-  int dt_limit;
-  int stiffness_limit;
-  int cfl_limit;
+  real p;  // added: normal stress (pressure)
+  real tau;  // added: shear stress
+  real gf;  // added: granular fluidity
+  uint32 states;
   bool near_boundary_;
   bool sticky;
   bool is_rigid_;
-  uint32 states;
-  int32 id;
-  real debug;
+  real boundary_distance;
+  Vector boundary_normal;
+  // warm: constitutive models
+  Matrix dg_e;  // Elastic deformation gradient
   Matrix dg_t;  // added: total deformation gradient
   Matrix dg_p;  // added: plastic deformation gradient
-  Matrix T;  // added: stress tensor
-  real p;  // added: normal stress (pressure)
-  real tau;  // added: shear stress
-  real gf;  // added: granular fluidity
+  // cold: bookkeeping and output
+  int dt_limit;
+  int stiffness_limit;
+  int cfl_limit;
+  int32 id;
+  real debug;
   // real mu_visual;  // added: friction coeff (FOR VISUALIZATION ONLY)
   // bool is_free;  // added (FOR VISUALIZATION ONLY)
   Vector rigid_impulse;  // added: Impulses on rigid boundary particles
@@ -203,6 +298,11 @@ class MPMParticle : public Unit {
     return 0;
   }
 
+  // Called by the allocator on every particle it creates or restores,
+  // before initialize or deserialization
+  virtual void bind_materials(MaterialTables &tables) {
+  }
+
   virtual Matrix get_first_piola_kirchoff_differential(const Matrix &dF) {
     return Matrix(0.0f);
   }
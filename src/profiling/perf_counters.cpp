@@ -0,0 +1,259 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <tbb/task_scheduler_observer.h>
+#include "perf_counters.h"
+#include "stage_metrics.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+static std::atomic<uint64> perf_counter_generations(0);
+
+class PerfCounters::Observer : public tbb::task_scheduler_observer {
+ public:
+  PerfCounters &counters;
+
+  Observer(PerfCounters &counters) : counters(counters) {
+  }
+
+  void on_scheduler_entry(bool) override {
+    counters.register_thread();
+  }
+};
+
+static const char *counter_names[PerfCounters::num_counters] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "fp_ops"};
+
+#if defined(__linux__)
+static int open_counter(int counter, uint64 fp_event, int group_fd) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  switch (counter) {
+    case PerfCounters::cycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PerfCounters::instructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PerfCounters::llc_misses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case PerfCounters::dtlb_misses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    default:
+      if (!fp_event) {
+        return -1;
+      }
+      attr.type = PERF_TYPE_RAW;
+      attr.config = fp_event;
+  }
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = group_fd == -1;
+  // This thread, on any CPU
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < num_counters; i++) {
+    available[i] = false;
+  }
+}
+
+PerfCounters::~PerfCounters() {
+  close();
+}
+
+void PerfCounters::initialize(const Config &config) {
+  close();
+  enabled = config.get("perf_counters", false);
+  if (!enabled) {
+    return;
+  }
+#if defined(__linux__)
+  std::string fp = config.get<std::string>("perf_fp_event", "");
+  fp_event = fp.empty() ? 0 : std::stoull(fp, nullptr, 0);
+  file_name = config.get<std::string>("perf_counters_file", "");
+  totals.assign(num_mpm_stages, {});
+  stage_particles.assign(num_mpm_stages, 0);
+  // Probe on this (the solver) thread
+  for (int i = 0; i < num_counters; i++) {
+    available[i] = true;
+  }
+  generation = ++perf_counter_generations;
+  register_thread();
+  if (threads.empty()) {
+    TC_WARN("Hardware performance counters unavailable ({}), disabled",
+            std::strerror(errno));
+    enabled = false;
+    return;
+  }
+  for (int i = 0; i < num_counters; i++) {
+    if (!available[i] && (i != fp_ops || fp_event)) {
+      TC_WARN("Performance counter {} unavailable", counter_names[i]);
+    }
+  }
+  observer = std::make_unique<Observer>(*this);
+  observer->observe(true);
+#else
+  TC_WARN("Hardware performance counters need Linux, disabled");
+  enabled = false;
+#endif
+}
+
+void PerfCounters::register_thread() {
+#if defined(__linux__)
+  thread_local uint64 registered_generation = 0;
+  if (registered_generation == generation) {
+    return;
+  }
+  registered_generation = generation;
+  ThreadCounters t;
+  t.fds[cycles] = open_counter(cycles, fp_event, -1);
+  if (t.fds[cycles] < 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> _(mutex);
+  for (int i = 1; i < num_counters; i++) {
+    t.fds[i] = -1;
+    if (available[i]) {
+      t.fds[i] = open_counter(i, fp_event, t.fds[cycles]);
+    }
+    if (t.fds[i] < 0 && threads.empty()) {
+      // Probing: not on this machine
+      available[i] = false;
+    }
+  }
+  ioctl(t.fds[cycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(t.fds[cycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  threads.push_back(t);
+#endif
+}
+
+void PerfCounters::read(Values values) {
+  for (int i = 0; i < num_counters; i++) {
+    values[i] = 0;
+  }
+#if defined(__linux__)
+  std::lock_guard<std::mutex> _(mutex);
+  // nr, time_enabled, time_running, then a value per group member
+  uint64 buffer[3 + num_counters];
+  for (auto &t : threads) {
+    auto size = ::read(t.fds[cycles], buffer, sizeof(buffer));
+    if (size < (ssize_t)(3 * sizeof(uint64)) || buffer[2] == 0) {
+      continue;
+    }
+    float64 scale = (float64)buffer[1] / buffer[2];
+    int member = 0;
+    for (int i = 0; i < num_counters && member < (int)buffer[0]; i++) {
+      if (t.fds[i] >= 0) {
+        values[i] += (uint64)(buffer[3 + member++] * scale);
+      }
+    }
+  }
+#endif
+}
+
+void PerfCounters::add(MPMStage stage, const Values begin) {
+  Values end;
+  read(end);
+  auto &total = totals[(int)stage];
+  for (int i = 0; i < num_counters; i++) {
+    // Scaled estimates of multiplexed counters are not monotonic
+    total[i] += end[i] > begin[i] ? end[i] - begin[i] : 0;
+  }
+  stage_particles[(int)stage] += particles;
+}
+
+std::string PerfCounters::to_json() const {
+  std::string ret = "{";
+  bool first = true;
+  for (int s = 0; s < (int)totals.size(); s++) {
+    auto &total = totals[s];
+    if (total[cycles] == 0) {
+      continue;
+    }
+    ret += fmt::format("{}\"{}\": {{", first ? "" : ", ",
+                       get_stage_name((MPMStage)s));
+    first = false;
+    for (int i = 0; i < num_counters; i++) {
+      if (available[i]) {
+        ret += fmt::format("\"{}\": {}, ", counter_names[i], total[i]);
+      }
+    }
+    float64 n = std::max<uint64>(stage_particles[s], 1);
+    ret += fmt::format("\"particles\": {}, \"ipc\": {}, ",
+                       stage_particles[s],
+                       (float64)total[instructions] / total[cycles]);
+    ret += fmt::format("\"cycles_per_particle\": {}", total[cycles] / n);
+    if (available[llc_misses]) {
+      // Every miss moves a 64 B line from memory
+      ret += fmt::format(
+          ", \"bytes_per_particle\": {}, \"llc_misses_per_particle\": {}",
+          total[llc_misses] * 64 / n, total[llc_misses] / n);
+    }
+    if (available[dtlb_misses]) {
+      ret += fmt::format(", \"dtlb_misses_per_particle\": {}",
+                         total[dtlb_misses] / n);
+    }
+    if (available[fp_ops]) {
+      ret += fmt::format(", \"fp_ops_per_particle\": {}", total[fp_ops] / n);
+    }
+    ret += "}";
+  }
+  return ret + "}";
+}
+
+void PerfCounters::write() const {
+  if (file_name.empty()) {
+    return;
+  }
+  std::ofstream f(file_name);
+  f << to_json() << std::endl;
+}
+
+void PerfCounters::close() {
+  if (observer) {
+    observer->observe(false);
+    observer = nullptr;
+  }
+#if defined(__linux__)
+  std::lock_guard<std::mutex> _(mutex);
+  for (auto &t : threads) {
+    for (int i = num_counters - 1; i >= 0; i--) {
+      if (t.fds[i] >= 0) {
+        ::close(t.fds[i]);
+      }
+    }
+  }
+#endif
+  threads.clear();
+  enabled = false;
+}
+
+TC_NAMESPACE_END
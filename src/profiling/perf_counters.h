@@ -0,0 +1,94 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+enum class MPMStage : int;
+
+// Hardware counters per substep stage ("perf_counters"), via perf_event_open
+// (Linux): cycles, instructions, LLC misses, dTLB load misses and, with
+// "perf_fp_event", a raw FP event (e.g. 0x2ac7, single precision
+// FP_ARITH_INST_RETIRED on Broadwell and later; Haswell has none).
+//
+// Every thread of the TBB scheduler, and the solver thread, gets its own
+// counter group when it first joins; a stage counts the sum over all groups,
+// so the workers it spawns are included. So would be anything else the
+// workers run meanwhile, which is why frames are then written synchronously
+// (between steps) instead of on the writer thread ("async_output"). Counting user space only needs
+// perf_event_paranoid <= 2. Counters that cannot be opened are left out, and
+// if cycles cannot be, the whole layer is disabled with a warning.
+//
+// Reading all groups at both ends of a stage costs a few syscalls per thread,
+// i.e. some 10 us per stage; this is a tuning tool, not for production runs.
+class PerfCounters {
+ public:
+  enum Counter : int {
+    cycles,
+    instructions,
+    llc_misses,
+    dtlb_misses,
+    fp_ops,
+    num_counters
+  };
+
+  using Values = uint64[num_counters];
+
+  bool enabled = false;
+  // Of the current substep, counted for the stages that run
+  uint64 particles = 0;
+
+  PerfCounters();
+  PerfCounters(const PerfCounters &) = delete;
+
+  ~PerfCounters();
+
+  void initialize(const Config &config);
+
+  // Sum over the threads, scaled for multiplexing
+  void read(Values values);
+
+  // Adds what was counted since begin to stage
+  void add(MPMStage stage, const Values begin);
+
+  // Totals and derived metrics (ipc, bytes_per_particle, ...) per stage
+  std::string to_json() const;
+
+  // Writes to_json to "perf_counters_file", if any
+  void write() const;
+
+  // Opens the counters of the calling thread, once
+  void register_thread();
+
+ private:
+  struct ThreadCounters {
+    int fds[num_counters];  // -1 if unavailable; fds[cycles] leads the group
+  };
+
+  class Observer;
+
+  void close();
+
+  bool available[num_counters];
+  uint64 fp_event = 0;
+  uint64 generation = 0;
+  std::string file_name;
+  std::mutex mutex;
+  std::vector<ThreadCounters> threads;
+  std::unique_ptr<Observer> observer;
+  // Per stage
+  std::vector<std::array<uint64, num_counters>> totals;
+  std::vector<uint64> stage_particles;
+};
+
+TC_NAMESPACE_END
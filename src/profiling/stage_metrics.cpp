@@ -0,0 +1,195 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "stage_metrics.h"
+
+TC_NAMESPACE_BEGIN
+
+const char *get_stage_name(MPMStage stage) {
+  static const char *names[num_mpm_stages] = {
+      "sort_particles_and_populate_grid",
+      "sort_prepare_keys",
+      "sort_parallel_sort",
+      "sort_detect_movers",
+      "sort_movers",
+      "sort_merge",
+      "reorder_particle_pointers",
+      "block_particle_offset",
+      "reset_page_map",
+      "fat_page_map",
+      "reset_grid",
+      "grid_particle_offset",
+      "update_rigid_page_map",
+      "async_schedule",
+      "reset_grid_granular_fluidity",
+      "rigidify",
+      "articulate",
+      "rasterize_rigid_boundary",
+      "gather_cdf",
+      "bake_levelset",
+      "particle_bc_at_levelset",
+      "p2g",
+      "normalize_grid_and_apply_external_force",
+      "rigid_body_levelset_collision",
+      "boundary_condition",
+      "apply_dirichlet_boundary_conditions",
+      "g2p",
+      "clean_boundary",
+      "particle_collision",
+      "advect_rigid_bodies",
+  };
+  TC_ASSERT(0 <= (int)stage && (int)stage < num_mpm_stages);
+  return names[(int)stage];
+}
+
+void StageRecord::accumulate(const StageRecord &r) {
+  substep = r.substep;
+  frame = r.frame;
+  substeps += r.substeps;
+  t = r.t;
+  dt += r.dt;
+  wall += r.wall;
+  particles = r.particles;
+  active_blocks = r.active_blocks;
+  fat_blocks = r.fat_blocks;
+  rigid_blocks = r.rigid_blocks;
+  rigid_block_fraction = r.rigid_block_fraction;
+  cutting_counter += r.cutting_counter;
+  plasticity_counter += r.plasticity_counter;
+  for (int i = 0; i < num_mpm_stages; i++) {
+    stage_time[i] += r.stage_time[i];
+  }
+}
+
+StageRecord StageRecord::since(const StageRecord &earlier) const {
+  StageRecord r = *this;
+  r.substeps -= earlier.substeps;
+  r.dt -= earlier.dt;
+  r.wall -= earlier.wall;
+  r.cutting_counter -= earlier.cutting_counter;
+  r.plasticity_counter -= earlier.plasticity_counter;
+  for (int i = 0; i < num_mpm_stages; i++) {
+    r.stage_time[i] -= earlier.stage_time[i];
+  }
+  return r;
+}
+
+std::string StageRecord::to_json() const {
+  std::string ret = fmt::format(
+      "{{\"substep\": {}, \"frame\": {}, \"substeps\": {}, \"t\": {}, "
+      "\"dt\": {}, \"wall\": {}, \"particles\": {}, \"active_blocks\": {}, "
+      "\"fat_blocks\": {}, \"rigid_blocks\": {}, "
+      "\"rigid_block_fraction\": {}, \"cutting_counter\": {}, "
+      "\"plasticity_counter\": {}, \"stages\": {{",
+      substep, frame, substeps, t, dt, wall, particles, active_blocks,
+      fat_blocks, rigid_blocks, rigid_block_fraction, cutting_counter,
+      plasticity_counter);
+  for (int i = 0; i < num_mpm_stages; i++) {
+    ret += fmt::format("{}\"{}\": {}", i ? ", " : "",
+                       get_stage_name((MPMStage)i), stage_time[i]);
+  }
+  return ret + "}}";
+}
+
+StageMetrics::~StageMetrics() {
+  if (file) {
+    std::fclose(file);
+  }
+}
+
+void StageMetrics::initialize(const Config &config, bool append) {
+  if (file) {
+    std::fclose(file);
+    file = nullptr;
+  }
+  std::string file_name = config.get<std::string>("metrics_file", "");
+  enabled = config.get("metrics", false) || !file_name.empty();
+  per_frame = config.get("metrics_per_frame", false);
+  substep.clear();
+  frame.clear();
+  last_frame.clear();
+  total.clear();
+  if (file_name.empty()) {
+    return;
+  }
+  csv = file_name.size() >= 4 &&
+        file_name.compare(file_name.size() - 4, 4, ".csv") == 0;
+  file = std::fopen(file_name.c_str(), append ? "a" : "w");
+  if (!file) {
+    TC_ERROR("Cannot open metrics file {}", file_name);
+  }
+  std::fseek(file, 0, SEEK_END);
+  if (csv && std::ftell(file) == 0) {
+    std::fprintf(file,
+                 "substep,frame,substeps,t,dt,wall,particles,active_blocks,"
+                 "fat_blocks,rigid_blocks,rigid_block_fraction,"
+                 "cutting_counter,plasticity_counter");
+    for (int i = 0; i < num_mpm_stages; i++) {
+      std::fprintf(file, ",%s", get_stage_name((MPMStage)i));
+    }
+    std::fprintf(file, "\n");
+  }
+}
+
+void StageMetrics::begin_substep() {
+  substep.clear();
+  substep.substeps = 1;
+  substep_start = Time::get_time();
+}
+
+void StageMetrics::end_substep() {
+  substep.wall = Time::get_time() - substep_start;
+  frame.accumulate(substep);
+  total.accumulate(substep);
+  if (!per_frame) {
+    write(substep);
+  }
+}
+
+void StageMetrics::end_frame(int frame_id) {
+  frame.frame = frame_id;
+  total.frame = frame_id;
+  last_frame = frame;
+  if (per_frame) {
+    write(frame);
+  }
+  if (file) {
+    std::fflush(file);
+  }
+  frame.clear();
+}
+
+const StageRecord &StageMetrics::get(const std::string &scope) const {
+  if (scope == "substep") {
+    return substep;
+  } else if (scope == "frame") {
+    return last_frame;
+  } else if (scope == "total") {
+    return total;
+  }
+  TC_ERROR("Unknown metrics scope {}", scope);
+  return total;
+}
+
+void StageMetrics::write(const StageRecord &r) {
+  if (!file) {
+    return;
+  }
+  if (!csv) {
+    std::fprintf(file, "%s\n", r.to_json().c_str());
+    return;
+  }
+  std::string line = fmt::format(
+      "{},{},{},{},{},{},{},{},{},{},{},{},{}", r.substep, r.frame,
+      r.substeps, r.t, r.dt, r.wall, r.particles, r.active_blocks,
+      r.fat_blocks, r.rigid_blocks, r.rigid_block_fraction, r.cutting_counter,
+      r.plasticity_counter);
+  for (int i = 0; i < num_mpm_stages; i++) {
+    line += fmt::format(",{}", r.stage_time[i]);
+  }
+  std::fprintf(file, "%s\n", line.c_str());
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,204 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <taichi/system/profiler.h>
+#include "../mpm_fwd.h"
+#include "perf_counters.h"
+#include "timeline.h"
+
+TC_NAMESPACE_BEGIN
+
+// Stages of MPM::substep, and the ones nested in
+// sort_particles_and_populate_grid (sort_* to update_rigid_page_map, also
+// counted in sort_particles_and_populate_grid)
+enum class MPMStage : int {
+  sort_particles_and_populate_grid,
+  sort_prepare_keys,
+  sort_parallel_sort,
+  sort_detect_movers,
+  sort_movers,
+  sort_merge,
+  reorder_particle_pointers,
+  block_particle_offset,
+  reset_page_map,
+  fat_page_map,
+  reset_grid,
+  grid_particle_offset,
+  update_rigid_page_map,
+  async_schedule,
+  reset_grid_granular_fluidity,
+  rigidify,
+  articulate,
+  rasterize_rigid_boundary,
+  gather_cdf,
+  bake_levelset,
+  particle_bc_at_levelset,
+  p2g,
+  normalize_grid_and_apply_external_force,
+  rigid_body_levelset_collision,
+  boundary_condition,
+  apply_dirichlet_boundary_conditions,
+  g2p,
+  clean_boundary,
+  particle_collision,
+  advect_rigid_bodies,
+  num_stages
+};
+
+constexpr int num_mpm_stages = (int)MPMStage::num_stages;
+
+const char *get_stage_name(MPMStage stage);
+
+// One substep, or the sum over a frame or the whole run
+struct StageRecord {
+  int64 substep = 0;  // substep_counter after the (last) substep
+  int frame = 0;
+  int substeps = 0;
+  float64 t = 0;
+  // Of the substep, or the time advanced over a frame/run
+  float64 dt = 0;
+  float64 wall = 0;
+  // Of the (last) substep
+  uint64 particles = 0;
+  uint64 active_blocks = 0;
+  uint64 fat_blocks = 0;
+  uint64 rigid_blocks = 0;
+  float64 rigid_block_fraction = 0;
+  // Summed
+  uint64 cutting_counter = 0;
+  uint64 plasticity_counter = 0;
+  float64 stage_time[num_mpm_stages] = {};
+
+  void clear() {
+    *this = StageRecord();
+  }
+
+  void accumulate(const StageRecord &r);
+
+  // The substeps accumulated since earlier, of the same run
+  StageRecord since(const StageRecord &earlier) const;
+
+  std::string to_json() const;
+};
+
+// Wall time of each stage plus particle/block counts, per substep, streamed
+// to "metrics_file" (CSV if it ends with .csv, JSON lines otherwise), one
+// record per substep, or per frame with "metrics_per_frame". Also kept for
+// the "metrics" action. Only used from the solver thread.
+class StageMetrics {
+ public:
+  bool enabled = false;
+
+  StageMetrics() = default;
+  StageMetrics(const StageMetrics &) = delete;
+
+  ~StageMetrics();
+
+  // append: keep the records of a previous run in the file (after a load)
+  void initialize(const Config &config, bool append);
+
+  void add(MPMStage stage, float64 time) {
+    substep.stage_time[(int)stage] += time;
+  }
+
+  void begin_substep();
+
+  // The counts are filled in by the solver before end_substep
+  StageRecord &current() {
+    return substep;
+  }
+
+  void end_substep();
+
+  void end_frame(int frame);
+
+  // "substep", "frame" (the last ones) or "total"
+  const StageRecord &get(const std::string &scope) const;
+
+ private:
+  void write(const StageRecord &r);
+
+  FILE *file = nullptr;
+  bool csv = false;
+  bool per_frame = false;
+  float64 substep_start = 0;
+  StageRecord substep, frame, last_frame, total;
+};
+
+// Times a stage into metrics, traces it on timeline and counts it on
+// counters, each if enabled
+class StageScope {
+ public:
+  StageScope(StageMetrics &metrics,
+             Timeline &timeline,
+             PerfCounters &counters,
+             MPMStage stage)
+      : metrics(metrics), timeline(timeline), counters(counters), stage(stage) {
+    if (counters.enabled) {
+      counters.read(counter_start);
+    }
+    if (metrics.enabled) {
+      start = Time::get_time();
+    }
+    if (timeline.enabled) {
+      trace_start = timeline.now();
+      parent_stage = timeline.stage;
+      timeline.stage = get_stage_name(stage);
+    }
+  }
+
+  ~StageScope() {
+    if (metrics.enabled) {
+      metrics.add(stage, Time::get_time() - start);
+    }
+    if (timeline.enabled) {
+      timeline.record(get_stage_name(stage), trace_start);
+      timeline.stage = parent_stage;
+    }
+    if (counters.enabled) {
+      counters.add(stage, counter_start);
+    }
+  }
+
+ private:
+  StageMetrics &metrics;
+  Timeline &timeline;
+  PerfCounters &counters;
+  MPMStage stage;
+  PerfCounters::Values counter_start;
+  float64 start = 0;
+  uint64 trace_start = 0;
+  const char *parent_stage = "";
+};
+
+// TC_PROFILE/TC_PROFILE_TPE, also recorded in the stage_metrics, timeline and
+// perf_counters of the enclosing MPM
+#define MPM_STAGE_SCOPE(stage)                                       \
+  StageScope _stage_scope(stage_metrics, timeline, perf_counters,    \
+                          MPMStage::stage)
+
+#define MPM_PROFILE(stage, statements)                          \
+  {                                                             \
+    MPM_STAGE_SCOPE(stage);                                     \
+    TC_PROFILE(get_stage_name(MPMStage::stage), statements);    \
+  }
+
+#define MPM_PROFILE_TPE(stage, statements, elements)            \
+  {                                                             \
+    MPM_STAGE_SCOPE(stage);                                     \
+    TC_PROFILE_TPE(get_stage_name(MPMStage::stage), statements, \
+                   elements);                                   \
+  }
+
+// For the rest of the enclosing scope
+#define MPM_PROFILE_SCOPE(stage) \
+  MPM_STAGE_SCOPE(stage);        \
+  Profiler _stage_profiler(get_stage_name(MPMStage::stage))
+
+TC_NAMESPACE_END
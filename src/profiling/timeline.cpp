@@ -0,0 +1,114 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "timeline.h"
+
+TC_NAMESPACE_BEGIN
+
+static std::atomic<uint64> timeline_generations(0);
+
+Timeline::~Timeline() {
+  close();
+}
+
+void Timeline::initialize(const Config &config) {
+  close();
+  std::string file_name = config.get<std::string>("trace_file", "");
+  enabled = !file_name.empty();
+  if (!enabled) {
+    return;
+  }
+  uint64 min_buffer_size = config.get<uint64>("trace_buffer_size", 1 << 20);
+  buffer_size = 1;
+  while (buffer_size < min_buffer_size) {
+    buffer_size *= 2;
+  }
+  generation = ++timeline_generations;
+  // now() is relative to origin
+  origin = 0;
+  origin = now();
+  stage = "";
+  dropped = 0;
+  file = std::fopen(file_name.c_str(), "w");
+  if (!file) {
+    TC_ERROR("Cannot open trace file {}", file_name);
+  }
+  std::fprintf(file, "[\n");
+  first_event = true;
+  // The solver thread is tid 0
+  get_buffer();
+}
+
+Timeline::ThreadBuffer *Timeline::register_thread() {
+  std::lock_guard<std::mutex> _(mutex);
+  auto buffer = std::make_unique<ThreadBuffer>();
+  buffer->tid = (int)buffers.size();
+  buffer->events.resize(buffer_size);
+  buffer->written = 0;
+  buffer->read = 0;
+  buffers.push_back(std::move(buffer));
+  return buffers.back().get();
+}
+
+void Timeline::flush() {
+  if (!file) {
+    return;
+  }
+  std::lock_guard<std::mutex> _(mutex);
+  auto separator = [&]() {
+    std::fputs(first_event ? "" : ",\n", file);
+    first_event = false;
+  };
+  for (; num_named_threads < (int)buffers.size(); num_named_threads++) {
+    separator();
+    std::fprintf(file,
+                 "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+                 "\"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                 num_named_threads, num_named_threads ? "worker" : "solver",
+                 num_named_threads);
+  }
+  for (auto &buffer : buffers) {
+    uint64 written = buffer->written.load(std::memory_order_acquire);
+    uint64 size = buffer->events.size();
+    if (written - buffer->read > size) {
+      dropped += written - buffer->read - size;
+      buffer->read = written - size;
+    }
+    for (; buffer->read < written; buffer->read++) {
+      auto &e = buffer->events[buffer->read & (size - 1)];
+      separator();
+      std::fprintf(file,
+                   "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                   "\"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                   e.name, e.block < 0 ? "stage" : "block", buffer->tid,
+                   e.begin * 1e-3, (e.end - e.begin) * 1e-3);
+      if (e.block >= 0) {
+        std::fprintf(file, ", \"args\": {\"block\": %d, \"particles\": %d}",
+                     e.block, e.particles);
+      }
+      std::fprintf(file, "}");
+    }
+  }
+  std::fflush(file);
+  if (dropped) {
+    TC_WARN("{} trace events dropped, consider a larger trace_buffer_size",
+            dropped);
+    dropped = 0;
+  }
+}
+
+void Timeline::close() {
+  if (file) {
+    flush();
+    std::fprintf(file, "\n]\n");
+    std::fclose(file);
+    file = nullptr;
+  }
+  enabled = false;
+  buffers.clear();
+  num_named_threads = 0;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,104 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// Opt-in per-thread timeline of the substeps ("trace_file"): one event per
+// stage on the solver thread and one per block task on the workers, with the
+// block index and its particle count, written as Chrome trace events (JSON
+// array format; chrome://tracing or ui.perfetto.dev).
+//
+// Each thread records into its own ring buffer of "trace_buffer_size" events,
+// without locks. The solver thread drains the buffers between frames (flush),
+// when no tasks run; events overwritten before that are dropped and counted.
+// Only one simulation per process should trace at a time.
+class Timeline {
+ public:
+  struct Event {
+    uint64 begin, end;  // ns since initialize
+    const char *name;
+    int32 block;        // -1 for stages
+    int32 particles;    // -1 if unknown
+  };
+
+  bool enabled = false;
+  // Name of the innermost stage running, for the block tasks it spawns
+  const char *stage = "";
+
+  Timeline() = default;
+  Timeline(const Timeline &) = delete;
+
+  ~Timeline();
+
+  void initialize(const Config &config);
+
+  uint64 now() const {
+    return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+               .count() -
+           origin;
+  }
+
+  // An event from begin to now on the calling thread
+  void record(const char *name,
+              uint64 begin,
+              int32 block = -1,
+              int32 particles = -1) {
+    auto &buffer = get_buffer();
+    uint64 written = buffer.written.load(std::memory_order_relaxed);
+    buffer.events[written & (buffer.events.size() - 1)] =
+        Event{begin, now(), name, block, particles};
+    buffer.written.store(written + 1, std::memory_order_release);
+  }
+
+  // Writes the events recorded so far. Solver thread only, between tasks.
+  void flush();
+
+ private:
+  struct ThreadBuffer {
+    int tid;
+    std::vector<Event> events;  // Power of two
+    std::atomic<uint64> written;
+    uint64 read;
+  };
+
+  ThreadBuffer &get_buffer() {
+    thread_local uint64 cached_generation = 0;
+    thread_local ThreadBuffer *cached_buffer = nullptr;
+    if (cached_generation != generation) {
+      cached_buffer = register_thread();
+      cached_generation = generation;
+    }
+    return *cached_buffer;
+  }
+
+  ThreadBuffer *register_thread();
+
+  void close();
+
+  // Tells threads registered with an earlier Timeline to register again
+  uint64 generation = 0;
+  uint64 origin = 0;
+  uint64 buffer_size = 0;
+  uint64 dropped = 0;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+  int num_named_threads = 0;
+  FILE *file = nullptr;
+  bool first_event = true;
+};
+
+TC_NAMESPACE_END
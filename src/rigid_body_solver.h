@@ -12,6 +12,7 @@
 #include <ccd/ccd.h>
 #include <ccd/quat.h>
 #include <taichi/math/eigen.h>
+#include "rigid_hull.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -99,6 +100,14 @@ class RigidSolver {
   typedef std::vector<std::unique_ptr<RigidBody<dim>>> RigidsVector;
   typedef std::vector<Collision<dim>> CollisionsVector;
 
+  // What the ccd callbacks see of a rigid body, fixed for one detection
+  struct SupportObject {
+    const RigidBody<dim> *rigid;
+    const RigidHull *hull;
+    Matrix world_to_body;  // rotation only, for directions
+    MatrixP mesh_to_world;
+  };
+
   static inline void center(const void *obj, ccd_vec3_t *center) {
     const RigidBody<dim> *rigid = static_cast<const RigidBody<dim> *>(obj);
     Vector pos_vec = rigid->position;
@@ -112,68 +121,110 @@ class RigidSolver {
   }
 
   static inline void centerRigid(const void *obj, ccd_vec3_t *center) {
-    const RigidBody<dim> *rigid = static_cast<const RigidBody<dim> *>(obj);
+    const RigidBody<dim> *rigid =
+        static_cast<const SupportObject *>(obj)->rigid;
     ccdVec3Set(center, rigid->position[0], rigid->position[1],
                rigid->position[2]);
   }
 
+  // Farthest hull vertex along dir, found by hill climbing in the body frame
   static inline void supportRigid(const void *obj,
                                   const ccd_vec3_t *dir_,
                                   ccd_vec3_t *v) {
-    const RigidBody<dim> *rigid = static_cast<const RigidBody<dim> *>(obj);
-    ccd_vec3_t dir;
-
-    ccdVec3Copy(&dir, dir_);
-    ccdVec3Normalize(&dir);
-
-    Vector tdir(dir.v[0], dir.v[1], dir.v[2]);
-
-    auto rot = MatrixP(rigid->rotation.get_rotation_matrix());
-    rot[dim][dim] = 1;
-    auto trans = rigid->get_mesh_to_world();
-
-    real max_dist = -1e30_f;
-    for (auto element : rigid->mesh->elements) {
-      for (int i = 0; i < dim; i++) {
-        Vector v_ = transform(rot, element.v[i]);
-        Vector p_ = transform(trans, element.v[i]);
-        auto dist = dot(tdir, v_);
-        if (dist > max_dist) {
-          max_dist = dist;
-          ccdVec3Set(v, p_.x, p_.y, p_.z);
-        }
-      }
-    }
+    const SupportObject *object = static_cast<const SupportObject *>(obj);
+    Vector tdir(dir_->v[0], dir_->v[1], dir_->v[2]);
+    const Vector3 &vertex =
+        object->hull->vertices[object->hull->get_support(
+            object->world_to_body * tdir)];
+    Vector p_ = transform(object->mesh_to_world, vertex);
+    ccdVec3Set(v, p_.x, p_.y, p_.z);
   }
 
  public:
+  // Builds the hulls of rigid bodies added since the last call
   void detect_rigid_collision(RigidsVector &rigids,
+                              std::vector<RigidHull> &hulls,
                               CollisionsVector &collisions);
 };
 
 template <>
 void RigidSolver<2>::detect_rigid_collision(RigidsVector &rigids,
+                                            std::vector<RigidHull> &hulls,
                                             CollisionsVector &collisions) {
   TC_NOT_IMPLEMENTED
 }
 
 template <>
 void RigidSolver<3>::detect_rigid_collision(RigidsVector &rigids,
+                                            std::vector<RigidHull> &hulls,
                                             CollisionsVector &collisions) {
   int rigids_number = rigids.size();
-  ccd_t ccd;
-  std::mutex mut;
-
-  tbb::parallel_for(0, rigids_number * rigids_number, [&](int k) {
-    // for (int k = 0; k < rigids_number * rigids_number; k++) {
-    int i = k / rigids_number;
-    int j = k % rigids_number;
-    if (i == 0 || j == 0 || j >= i) {
+  for (int i = (int)hulls.size(); i < rigids_number; i++) {
+    hulls.emplace_back();
+    // No mesh for the background rigid body
+    if (rigids[i]->mesh) {
+      hulls.back().initialize(rigids[i]->mesh->elements);
+    }
+  }
+
+  // Broad phase: world AABBs of the hulls, sweep and prune along x
+  std::vector<SupportObject> objects(rigids_number);
+  std::vector<Vector> lower(rigids_number), upper(rigids_number);
+  tbb::parallel_for(0, rigids_number, [&](int i) {
+    auto &rigid = *rigids[i];
+    objects[i].rigid = &rigid;
+    objects[i].hull = &hulls[i];
+    if (hulls[i].empty()) {
       return;
     }
-    if (rigids[i]->pos_func && rigids[i]->rot_func)
-      if (rigids[j]->pos_func && rigids[j]->rot_func)
-        return;
+    objects[i].world_to_body = transpose(rigid.rotation.get_rotation_matrix());
+    objects[i].mesh_to_world = rigid.get_mesh_to_world();
+    lower[i] = Vector(1e30_f);
+    upper[i] = Vector(-1e30_f);
+    for (auto &vertex : hulls[i].vertices) {
+      Vector p = transform(objects[i].mesh_to_world, vertex);
+      for (int k = 0; k < 3; k++) {
+        lower[i][k] = std::min(lower[i][k], p[k]);
+        upper[i][k] = std::max(upper[i][k], p[k]);
+      }
+    }
+  });
+  std::vector<int> order;
+  for (int i = 1; i < rigids_number; i++) {
+    if (!hulls[i].empty()) {
+      order.push_back(i);
+    }
+  }
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return lower[a][0] < lower[b][0]; });
+  auto scripted = [&](int i) {
+    return rigids[i]->pos_func && rigids[i]->rot_func;
+  };
+  std::vector<std::pair<int, int>> pairs;
+  for (int a = 0; a < (int)order.size(); a++) {
+    int i = order[a];
+    for (int b = a + 1;
+         b < (int)order.size() && lower[order[b]][0] <= upper[i][0]; b++) {
+      int j = order[b];
+      if (lower[i][1] > upper[j][1] || lower[j][1] > upper[i][1] ||
+          lower[i][2] > upper[j][2] || lower[j][2] > upper[i][2]) {
+        continue;
+      }
+      if (scripted(i) && scripted(j)) {
+        continue;
+      }
+      pairs.push_back(std::make_pair(std::max(i, j), std::min(i, j)));
+    }
+  }
+  // Same collision order as a full pair loop, whatever the sweep order
+  std::sort(pairs.begin(), pairs.end());
+
+  // Narrow phase: MPR on the candidate pairs
+  std::vector<int> hit(pairs.size(), 0);
+  std::vector<ccd_real_t> depths(pairs.size());
+  std::vector<ccd_vec3_t> dirs(pairs.size()), positions(pairs.size());
+  tbb::parallel_for(0, (int)pairs.size(), [&](int k) {
+    ccd_t ccd;
     CCD_INIT(&ccd);
     ccd.support1 = supportRigid;
     ccd.support2 = supportRigid;
@@ -182,19 +233,20 @@ void RigidSolver<3>::detect_rigid_collision(RigidsVector &rigids,
     //      ccd.max_iterations = 200;
     //      ccd.epa_tolerance = 0.00001;
     ccd.mpr_tolerance = 0.0001;
-    ccd_real_t depth;
-    ccd_vec3_t dir, pos;
-    const void *obj1 = static_cast<const void *>(rigids[i].get());
-    const void *obj2 = static_cast<const void *>(rigids[j].get());
-    int intersect = ccdMPRPenetration(obj1, obj2, &ccd, &depth, &dir, &pos);
-    if (!intersect) {
-      mut.lock();
-      collisions.emplace_back(rigids[i].get(), rigids[j].get(), depth,
-                              Vector(dir.v[0], dir.v[1], dir.v[2]),
-                              Vector(pos.v[0], pos.v[1], pos.v[2]));
-      mut.unlock();
-    }
+    const void *obj1 = static_cast<const void *>(&objects[pairs[k].first]);
+    const void *obj2 = static_cast<const void *>(&objects[pairs[k].second]);
+    int intersect = ccdMPRPenetration(obj1, obj2, &ccd, &depths[k], &dirs[k],
+                                      &positions[k]);
+    hit[k] = !intersect;
   });
+  for (int k = 0; k < (int)pairs.size(); k++) {
+    if (hit[k]) {
+      collisions.emplace_back(
+          rigids[pairs[k].first].get(), rigids[pairs[k].second].get(),
+          depths[k], Vector(dirs[k].v[0], dirs[k].v[1], dirs[k].v[2]),
+          Vector(positions[k].v[0], positions[k].v[1], positions[k].v[2]));
+    }
+  }
 }
 
 TC_NAMESPACE_END
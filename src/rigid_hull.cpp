@@ -0,0 +1,213 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <algorithm>
+#include <functional>
+#include <set>
+#include "rigid_hull.h"
+
+TC_NAMESPACE_BEGIN
+
+void RigidHull::initialize(const std::vector<ElementType> &elements) {
+  vertices.clear();
+  neighbour_begin.clear();
+  neighbours.clear();
+  starts.clear();
+
+  std::vector<Vector3> points;
+  for (auto &elem : elements) {
+    for (int k = 0; k < 3; k++) {
+      points.push_back(elem.v[k]);
+    }
+  }
+  auto lexicographic = [](const Vector3 &a, const Vector3 &b) {
+    return a.x < b.x ||
+           (a.x == b.x && (a.y < b.y || (a.y == b.y && a.z < b.z)));
+  };
+  std::sort(points.begin(), points.end(), lexicographic);
+  points.erase(std::unique(points.begin(), points.end(),
+                           [](const Vector3 &a, const Vector3 &b) {
+                             return a.x == b.x && a.y == b.y && a.z == b.z;
+                           }),
+               points.end());
+  if (points.empty()) {
+    return;
+  }
+
+  Vector3 lower = points[0], upper = points[0];
+  for (auto &p : points) {
+    for (int k = 0; k < 3; k++) {
+      lower[k] = std::min(lower[k], p[k]);
+      upper[k] = std::max(upper[k], p[k]);
+    }
+  }
+  const real eps = 1e-5_f * std::max(length(upper - lower), 1e-30_f);
+
+  // Initial tetrahedron: points[0] (smallest x), the farthest point from it,
+  // the farthest from that line and the farthest from that plane
+  auto argmax = [&](const std::function<real(const Vector3 &)> &f) {
+    int ret = 0;
+    for (int i = 1; i < (int)points.size(); i++) {
+      if (f(points[i]) > f(points[ret])) {
+        ret = i;
+      }
+    }
+    return ret;
+  };
+  Vector3 p0 = points[0];
+  int i1 = argmax([&](const Vector3 &p) { return length(p - p0); });
+  Vector3 p1 = points[i1];
+  int i2 = argmax(
+      [&](const Vector3 &p) { return length(cross(p1 - p0, p - p0)); });
+  Vector3 p2 = points[i2];
+  Vector3 n = cross(p1 - p0, p2 - p0);
+  int i3 = argmax([&](const Vector3 &p) { return std::abs(dot(n, p - p0)); });
+  if (length(p1 - p0) <= eps ||
+      length(n) <= eps * length(p1 - p0) ||
+      std::abs(dot(normalized(n), points[i3] - p0)) <= eps) {
+    // Flat mesh, no hull graph
+    vertices = points;
+  }
+
+  if (vertices.empty()) {
+    struct Face {
+      int v[3];
+      Vector3 normal;
+      real offset;
+    };
+    Vector3 inside = (p0 + p1 + p2 + points[i3]) * 0.25_f;
+    auto make_face = [&](int a, int b, int c) {
+      Face f;
+      f.v[0] = a;
+      f.v[1] = b;
+      f.v[2] = c;
+      f.normal = normalized(
+          cross(points[b] - points[a], points[c] - points[a]));
+      f.offset = dot(f.normal, points[a]);
+      return f;
+    };
+    std::vector<Face> faces;
+    int tet[4] = {0, i1, i2, i3};
+    for (int k = 0; k < 4; k++) {
+      Face f = make_face(tet[k], tet[(k + 1) % 4], tet[(k + 2) % 4]);
+      if (dot(f.normal, inside) - f.offset > 0) {
+        f = make_face(f.v[0], f.v[2], f.v[1]);
+      }
+      faces.push_back(f);
+    }
+
+    // Add points one by one: remove the faces a point sees and close the
+    // hole with faces to its horizon
+    std::vector<Face> kept;
+    std::set<std::pair<int, int>> visible_edges;
+    for (int i = 1; i < (int)points.size(); i++) {
+      if (i == i1 || i == i2 || i == i3) {
+        continue;
+      }
+      kept.clear();
+      visible_edges.clear();
+      for (auto &f : faces) {
+        if (dot(f.normal, points[i]) - f.offset > eps) {
+          for (int k = 0; k < 3; k++) {
+            visible_edges.insert(std::make_pair(f.v[k], f.v[(k + 1) % 3]));
+          }
+        } else {
+          kept.push_back(f);
+        }
+      }
+      if (visible_edges.empty()) {
+        continue;
+      }
+      for (auto &e : visible_edges) {
+        if (!visible_edges.count(std::make_pair(e.second, e.first))) {
+          kept.push_back(make_face(e.first, e.second, i));
+        }
+      }
+      std::swap(faces, kept);
+    }
+
+    // Keep the vertices and edges of the hull
+    std::vector<int> index(points.size(), -1);
+    std::vector<std::pair<int, int>> edges;
+    for (auto &f : faces) {
+      for (int k = 0; k < 3; k++) {
+        if (index[f.v[k]] == -1) {
+          index[f.v[k]] = (int)vertices.size();
+          vertices.push_back(points[f.v[k]]);
+        }
+      }
+    }
+    for (auto &f : faces) {
+      for (int k = 0; k < 3; k++) {
+        edges.push_back(
+            std::make_pair(index[f.v[k]], index[f.v[(k + 1) % 3]]));
+      }
+    }
+    // Each edge appears once in each direction
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    neighbour_begin.assign(vertices.size() + 1, 0);
+    for (auto &e : edges) {
+      neighbour_begin[e.first + 1]++;
+    }
+    for (int i = 0; i < (int)vertices.size(); i++) {
+      neighbour_begin[i + 1] += neighbour_begin[i];
+    }
+    for (auto &e : edges) {
+      neighbours.push_back(e.second);
+    }
+  }
+
+  for (int k = 0; k < 6; k++) {
+    Vector3 dir(0.0_f);
+    dir[k / 2] = k % 2 ? 1.0_f : -1.0_f;
+    int best = 0;
+    for (int i = 1; i < (int)vertices.size(); i++) {
+      if (dot(vertices[i], dir) > dot(vertices[best], dir)) {
+        best = i;
+      }
+    }
+    starts.push_back(best);
+  }
+}
+
+int RigidHull::get_support(const Vector3 &dir) const {
+  int best = starts[0];
+  real best_dist = dot(vertices[best], dir);
+  for (int s : starts) {
+    real dist = dot(vertices[s], dir);
+    if (dist > best_dist) {
+      best = s;
+      best_dist = dist;
+    }
+  }
+  if (neighbours.empty()) {
+    for (int i = 0; i < (int)vertices.size(); i++) {
+      real dist = dot(vertices[i], dir);
+      if (dist > best_dist) {
+        best = i;
+        best_dist = dist;
+      }
+    }
+    return best;
+  }
+  bool climbed = true;
+  while (climbed) {
+    climbed = false;
+    int current = best;
+    for (int n = neighbour_begin[current]; n < neighbour_begin[current + 1];
+         n++) {
+      real dist = dot(vertices[neighbours[n]], dir);
+      if (dist > best_dist) {
+        best = neighbours[n];
+        best_dist = dist;
+        climbed = true;
+      }
+    }
+  }
+  return best;
+}
+
+TC_NAMESPACE_END
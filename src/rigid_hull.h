@@ -0,0 +1,44 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <taichi/dynamics/rigid_body.h>
+#include "mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// Convex hull of a rigid mesh in its body (mesh) frame, for the support
+// queries of rigid-rigid collision detection (see rigid_body_solver.h).
+//
+// Only the hull vertices and edges are kept. A support query climbs the edges
+// from the best of the axis-extreme vertices; on a convex polytope the first
+// vertex with no better neighbour is the farthest one. Flat meshes have no
+// hull graph and fall back to scanning the vertices.
+class RigidHull {
+ public:
+  using ElementType = typename RigidBody<3>::ElementType;
+
+  std::vector<Vector3> vertices;
+
+  void initialize(const std::vector<ElementType> &elements);
+
+  // Index of the vertex farthest along dir
+  int get_support(const Vector3 &dir) const;
+
+  bool empty() const {
+    return vertices.empty();
+  }
+
+ private:
+  // Hull edges, CSR by vertex
+  std::vector<int> neighbour_begin;
+  std::vector<int> neighbours;
+  // Farthest vertex along -x, +x, -y, +y, -z, +z
+  std::vector<int> starts;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,165 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "rigid_sdf.h"
+
+TC_NAMESPACE_BEGIN
+
+// Lattice coordinates are packed into the key with this many bits per axis
+constexpr int rigid_sdf_key_bits = 21;
+constexpr int rigid_sdf_key_offset = 1 << (rigid_sdf_key_bits - 1);
+
+// Closest point on a segment
+static Vector2 closest_point(const Vector2 &x, const Vector2 *v) {
+  Vector2 ab = v[1] - v[0];
+  real t = dot(x - v[0], ab) / std::max(dot(ab, ab), 1e-30_f);
+  return v[0] + ab * clamp(t, 0.0_f, 1.0_f);
+}
+
+// Closest point on a triangle (Ericson, Real-Time Collision Detection 5.1.5)
+static Vector3 closest_point(const Vector3 &x, const Vector3 *v) {
+  Vector3 a = v[0], b = v[1], c = v[2];
+  Vector3 ab = b - a, ac = c - a;
+  real d1 = dot(ab, x - a), d2 = dot(ac, x - a);
+  if (d1 <= 0 && d2 <= 0) {
+    return a;
+  }
+  real d3 = dot(ab, x - b), d4 = dot(ac, x - b);
+  if (d3 >= 0 && d4 <= d3) {
+    return b;
+  }
+  real vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    return a + ab * (d1 / (d1 - d3));
+  }
+  real d5 = dot(ab, x - c), d6 = dot(ac, x - c);
+  if (d6 >= 0 && d5 <= d6) {
+    return c;
+  }
+  real vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    return a + ac * (d2 / (d2 - d6));
+  }
+  real va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+    return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+  }
+  real sum = va + vb + vc;
+  if (sum <= 0) {
+    // Degenerate triangle
+    return a;
+  }
+  return a + ab * (vb / sum) + ac * (vc / sum);
+}
+
+template <int dim>
+uint64 RigidSDF<dim>::get_key(const Vectori &node) {
+  uint64 key = 0;
+  for (int d = 0; d < dim; d++) {
+    key = (key << rigid_sdf_key_bits) | uint64(node[d] + rigid_sdf_key_offset);
+  }
+  return key;
+}
+
+template <int dim>
+void RigidSDF<dim>::bake(const std::vector<ElementType> &elements,
+                         real delta_x,
+                         real band) {
+  this->inv_delta_x = 1.0_f / delta_x;
+  this->band = band;
+  samples.clear();
+  lower = Vector(1e30_f);
+  upper = Vector(-1e30_f);
+
+  // Every lattice cell with a point in the band must have all its corners
+  real reach = band + std::sqrt(real(dim));
+  // Ties (at edges and vertices) go to the element whose normal is most
+  // aligned with the offset, so the side is right on both sides of the edge
+  constexpr real tie = 1e-5_f;
+  // Per node: (unsigned distance, offset along the normal), in delta_x
+  std::unordered_map<uint64, std::pair<real, real>> nearest;
+  for (auto &elem : elements) {
+    Vector normal = normalize(elem.get_normal());
+    Vectori begin, end;
+    for (int d = 0; d < dim; d++) {
+      real elem_lower = 1e30_f, elem_upper = -1e30_f;
+      for (int k = 0; k < dim; k++) {
+        elem_lower = std::min(elem_lower, elem.v[k][d] * inv_delta_x);
+        elem_upper = std::max(elem_upper, elem.v[k][d] * inv_delta_x);
+      }
+      begin[d] = (int)std::floor(elem_lower - reach);
+      end[d] = (int)std::ceil(elem_upper + reach) + 1;
+      TC_ASSERT_INFO(-rigid_sdf_key_offset <= begin[d] &&
+                         end[d] <= rigid_sdf_key_offset,
+                     "Rigid body too large for its SDF");
+    }
+    for (auto &ind : RegionND<dim>(begin, end)) {
+      Vectori node = ind.get_ipos();
+      Vector x = node.template cast<real>() * delta_x;
+      Vector offset = (x - closest_point(x, elem.v)) * inv_delta_x;
+      real distance = length(offset);
+      if (distance > reach) {
+        continue;
+      }
+      real along_normal = dot(offset, normal);
+      auto it = nearest.find(get_key(node));
+      if (it == nearest.end()) {
+        nearest[get_key(node)] = std::make_pair(distance, along_normal);
+        for (int d = 0; d < dim; d++) {
+          lower[d] = std::min(lower[d], x[d]);
+          upper[d] = std::max(upper[d], x[d]);
+        }
+      } else if (distance < it->second.first - tie ||
+                 (distance <= it->second.first + tie &&
+                  std::abs(along_normal) > std::abs(it->second.second))) {
+        it->second = std::make_pair(distance, along_normal);
+      }
+    }
+  }
+  samples.reserve(nearest.size());
+  for (auto &n : nearest) {
+    samples[n.first] = n.second.second < 0 ? -n.second.first : n.second.first;
+  }
+}
+
+template <int dim>
+bool RigidSDF<dim>::sample(const Vector &pos, real &distance) const {
+  for (int d = 0; d < dim; d++) {
+    if (!(lower[d] <= pos[d] && pos[d] < upper[d])) {
+      return false;
+    }
+  }
+  Vectori base;
+  Vector frac;
+  for (int d = 0; d < dim; d++) {
+    real x = pos[d] * inv_delta_x;
+    real x_floor = std::floor(x);
+    base[d] = (int)x_floor;
+    frac[d] = x - x_floor;
+  }
+  real ret = 0;
+  for (auto &ind : RegionND<dim>(Vectori(0), Vectori(2))) {
+    Vectori corner = ind.get_ipos();
+    auto it = samples.find(get_key(base + corner));
+    if (it == samples.end()) {
+      return false;
+    }
+    real weight = 1;
+    for (int d = 0; d < dim; d++) {
+      weight *= corner[d] ? frac[d] : 1 - frac[d];
+    }
+    ret += weight * it->second;
+  }
+  if (std::abs(ret) > band) {
+    return false;
+  }
+  distance = ret;
+  return true;
+}
+
+template class RigidSDF<2>;
+template class RigidSDF<3>;
+
+TC_NAMESPACE_END
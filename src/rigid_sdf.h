@@ -0,0 +1,51 @@
+/*******************************************************************************
+    Copyright (c) The Taichi MPM Authors (2018- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <taichi/dynamics/rigid_body.h>
+#include "mpm_fwd.h"
+
+TC_NAMESPACE_BEGIN
+
+// Narrow-band signed distance of a rigid mesh, in its body (mesh) frame.
+//
+// Sampled on a lattice of spacing delta_x, stored sparsely: only nodes within
+// the band of some element are kept. Distances are in units of delta_x and
+// negative behind the element normals, i.e. the same distance and side that
+// rasterize_rigid_boundary computes from the triangles. Baked once per rigid
+// body, since the mesh does not deform.
+template <int dim>
+class RigidSDF {
+ public:
+  using Vector = VectorND<dim, real>;
+  using Vectori = VectorND<dim, int>;
+  using ElementType = typename RigidBody<dim>::ElementType;
+
+  // Body-frame bounds of the baked nodes; empty (lower > upper) if none
+  Vector lower = Vector(1e30_f);
+  Vector upper = Vector(-1e30_f);
+
+  // band: half width in delta_x
+  void bake(const std::vector<ElementType> &elements, real delta_x, real band);
+
+  // Multilinear interpolation at body-frame pos; false outside the band
+  bool sample(const Vector &pos, real &distance) const;
+
+  std::size_t size() const {
+    return samples.size();
+  }
+
+ private:
+  static uint64 get_key(const Vectori &node);
+
+  real inv_delta_x = 0;
+  real band = 0;
+  std::unordered_map<uint64, real> samples;
+};
+
+TC_NAMESPACE_END
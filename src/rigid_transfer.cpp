@@ -22,12 +22,12 @@ void MPM<dim>::rasterize_rigid_boundary() {
   
   // find nearest rigid particle to grid node ----------------------------------
   // Note: we assume particles from the same rigid body are contiguous (adjacent)
-  parallel_for_each_particle([&](Particle &p_) {
-    // ONLY rigid particles
-    auto *p = dynamic_cast<RigidBoundaryParticle<dim> *>(&p_);
-    if (!p)
-      return;
-
+  // The stencil starts in the block the particle is sorted into, so with the
+  // colored block schedule of P2G no two threads touch the same node.
+  static_assert(cdf_kernel_order_rasterize == mpm_kernel_order,
+                "rigid particles must be bucketed with the rasterization "
+                "stencil");
+  auto rasterize_particle = [&](RigidBoundaryParticle<dim> *p) {
     // cdf_kernel_order_rasterize <- 2 (from mpm_fwd.h)
     constexpr int kernel_size = cdf_kernel_order_rasterize + 1;  // was 1
     // from 0 to 3 (grid) in each direction
@@ -43,6 +43,8 @@ void MPM<dim>::rasterize_rigid_boundary() {
     // first vertex of element (counter-clockwise mesh)
     Vector p0 = elem.v[0];
 
+    int slot = get_affinity_slot(p->rigid->id);
+
     // grid node loop (ind from 0 to 3 in each direction)
     for (auto &ind : region) {
 
@@ -61,7 +63,7 @@ void MPM<dim>::rasterize_rigid_boundary() {
       real dist_triangle = abs(coord[dim - 1]);
 
       // added: CPIC modification for corner issues
-      if (config_backup.get("cdf_3d_modified", false))
+      if (options.cdf_3d_modified)
       {
         bool valid = false;
         TC_STATIC_IF(dim == 3)
@@ -129,7 +131,6 @@ void MPM<dim>::rasterize_rigid_boundary() {
       dist_triangle *= inv_delta_x;
 
       GridState<dim> &g = get_grid(i);
-      g.get_lock().lock();
 
       // set minimum dist to the grid in rigid particle's kernel
       if (g.get_rigid_body_id() == -1 || dist_triangle < get_grid(i).get_distance()) {
@@ -141,11 +142,29 @@ void MPM<dim>::rasterize_rigid_boundary() {
       // TODO: what happens if the relative position of the grid point to a
       // rigid body is ambiguous???
       // Should be fine for most meshes, though?
-      g.set_states(g.get_states() | (2 + (int)(negative)) << (p->rigid->id * 2));
+      g.set_states(g.get_states() |
+                   (uint32)(2 + (int)(negative)) << (slot * 2));
+    }
+  };
 
-      g.get_lock().unlock();
+  // ONLY rigid particles, from the blocks that have any
+  auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (!block_has_rigid[b]) {
+      return;
     }
-  });
+    for (uint32 k = block_meta[b].particle_offset;
+         k < block_meta[b + 1].particle_offset; k++) {
+      Particle &p = *allocator[particles[k]];
+      if (p.is_rigid()) {
+        rasterize_particle(static_cast<RigidBoundaryParticle<dim> *>(&p));
+      }
+    }
+  };
+  if (options.rigid_sdf) {
+    rasterize_rigid_sdf();
+  } else {
+    parallel_for_each_block_with_index(block_op, false, true);
+  }
 
   // scale the distance
   parallel_for_each_active_grid([&](GridState<dim> &g){
@@ -155,7 +174,7 @@ void MPM<dim>::rasterize_rigid_boundary() {
   // extra steps in 2D 
   TC_STATIC_IF(dim == 2) {
     ArrayND<2, uint32> grid_states_tmp(id(this->res + Vectori(1)), 0);
-    for (int e = 0; e < config_backup.get<int>("cdf_expand", 0); e++) {
+    for (int e = 0; e < options.cdf_expand; e++) {
       for (int k = 0; k < dim; k++) {
         Region region = Region(Vectori::axis(k), res - Vectori::axis(k));
         grid_states_tmp.reset_zero();
@@ -193,6 +212,83 @@ template void MPM<2>::rasterize_rigid_boundary();
 
 template void MPM<3>::rasterize_rigid_boundary();
 
+// rP2G from baked SDFs --------------------------------------------------------
+// Each node of rigid_page_map is moved into the body frame of every rigid body
+// whose band may cover it, and samples the baked field there. Nodes are only
+// written by the thread of their own block, and the cost does not depend on
+// the number of mesh elements.
+template <int dim>
+void MPM<dim>::rasterize_rigid_sdf() {
+  TC_ASSERT(rigid_sdfs.size() == rigids.size());
+  int num_rigids = (int)rigids.size();
+  std::vector<MatrixP> world_to_body(num_rigids);
+  // World-space bounds of the bands
+  std::vector<Vector> lower(num_rigids, Vector(1e30_f)),
+      upper(num_rigids, Vector(-1e30_f));
+  for (int r = 0; r < num_rigids; r++) {
+    const RigidSDF<dim> &sdf = rigid_sdfs[r];
+    if (sdf.size() == 0) {
+      continue;
+    }
+    MatrixP body_to_world = rigids[r]->get_mesh_to_world();
+    world_to_body[r] = inverse(body_to_world);
+    for (auto &ind : Region(Vectori(0), Vectori(2))) {
+      Vector corner;
+      for (int k = 0; k < dim; k++) {
+        corner[k] = ind.get_ipos()[k] ? sdf.upper[k] : sdf.lower[k];
+      }
+      corner = transform(body_to_world, corner);
+      for (int k = 0; k < dim; k++) {
+        lower[r][k] = std::min(lower[r][k], corner[k]);
+        upper[r][k] = std::max(upper[r][k], corner[k]);
+      }
+    }
+  }
+
+  auto block_op = [&](uint32 b, uint64 block_offset, GridState<dim> *g_) {
+    Vectori block_base_coord(SparseMask::LinearToCoord(block_offset));
+    Vector block_lower = Vector(block_base_coord) * delta_x;
+    Vector block_upper =
+        Vector(block_base_coord + grid_block_size() - Vectori(1)) * delta_x;
+    for (int r = 0; r < num_rigids; r++) {
+      bool overlap = true;
+      for (int k = 0; k < dim; k++) {
+        overlap = overlap && lower[r][k] <= block_upper[k] &&
+                  block_lower[k] <= upper[r][k];
+      }
+      if (!overlap) {
+        continue;
+      }
+      int rigid_id = rigids[r]->id;
+      int slot = get_affinity_slot(rigid_id);
+      for (auto &ind_ : Region(Vectori(0), grid_block_size())) {
+        Vectori i = block_base_coord + ind_.get_ipos();
+        Vector grid_pos = i.template cast<real>() * delta_x;
+        real distance;
+        if (!rigid_sdfs[r].sample(transform(world_to_body[r], grid_pos),
+                                  distance)) {
+          continue;
+        }
+        bool negative = distance < 0;
+        distance = std::abs(distance);
+
+        GridState<dim> &g = get_grid(i);
+        if (g.get_rigid_body_id() == -1 || distance < g.get_distance()) {
+          g.set_distance(distance);
+          g.set_rigid_body_id(rigid_id);
+        }
+        g.set_states(g.get_states() |
+                     (uint32)(2 + (int)(negative)) << (slot * 2));
+      }
+    }
+  };
+  parallel_for_each_block_with_index(rigid_page_map, block_op);
+}
+
+template void MPM<2>::rasterize_rigid_sdf();
+
+template void MPM<3>::rasterize_rigid_sdf();
+
 // G2P --------------------------------------------------------------------------
 // Construct particle states
 template <int dim>
@@ -314,7 +410,7 @@ void MPM<dim>::gather_cdf() {
         p.states |=
             (state_to_add | ((state_to_add >> 1) * int(weighted_distances[0] <
                                                        weighted_distances[1])));
-        cutting_counter++;
+        add_counter(cutting_counter, 1);
       }
     }
 
@@ -3,10 +3,17 @@
     The use of this software is governed by the LICENSE file.
 *******************************************************************************/
 
+#include <cstdio>
+#include <cstring>
 #include <taichi/common/testing.h>
 
 #include "mpm_fwd.h"
 #include "kernel.h"
+#include "particles.h"
+#include "particle_allocator.h"
+#include "rigid_hull.h"
+#include "rigid_sdf.h"
+#include "io/compressed_frame.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -50,4 +57,204 @@ TC_TEST("mpm_fast_kernel32") {
   }
 }
 
+TC_TEST("material_table") {
+  NonlocalMaterialTable table;
+  NonlocalMaterial material{};
+  material.S_mod = 1.0_f;
+  auto id = table.get_or_create(material);
+  CHECK(table.get_or_create(material) == id);
+  CHECK(table.get(id).S_mod == 1.0_f);
+  material.S_mod = 2.0_f;
+  CHECK(table.get_or_create(material) != id);
+
+  // Each allocator has its own tables
+  ParticleAllocator<3> a, b;
+  Config config;
+  config.set("S_mod", 5.0_f);
+  a.allocate_particle("nonlocal").second->initialize(config);
+  CHECK(a.materials.nonlocal.materials.size() == 1);
+  CHECK(b.materials.nonlocal.materials.empty());
+
+  // The table is written once, particles only refer to it
+  a.allocate_particle("nonlocal").second->initialize(config);
+  std::string fn = "/tmp/material_table.tcb";
+  write_to_binary_file(a, fn);
+  read_from_binary_file(b, fn);
+  std::remove(fn.c_str());
+  CHECK(b.pool.size() == 2);
+  CHECK(b.materials.nonlocal.materials.size() == 1);
+  CHECK(b.materials.nonlocal.get(0).S_mod == 5.0_f);
+  CHECK(b[1]->get_allowed_dt(1.0_f) == a[1]->get_allowed_dt(1.0_f));
+}
+
+TC_TEST("grid_state") {
+  // The packed fields do not overlap, and hold the values the CDF and the
+  // sort store
+  GridState<3> g;
+  std::memset(&g, 0, sizeof(g));
+  g.velocity_and_mass = VectorND<4, real>(1, 2, 3, 4);
+  g.set_distance(0.125_f);
+  g.set_rigid_body_id(5);
+  // Tags of all affinity slots, including the last one
+  g.set_states(0xc000002du);
+  g.granular_fluidity = 0.5_f;
+  g.particle_count = std::numeric_limits<uint16>::max();
+  CHECK(g.velocity_and_mass[3] == 4);
+  CHECK(g.get_distance() == 0.125_f);
+  CHECK(g.get_rigid_body_id() == 5);
+  CHECK(g.get_states() == 0xc000002du);
+  CHECK(g.granular_fluidity == 0.5_f);
+  CHECK(g.particle_count == std::numeric_limits<uint16>::max());
+  g.set_rigid_body_id(GridState<3>::max_num_rigid_bodies - 1);
+  CHECK(g.get_rigid_body_id() == GridState<3>::max_num_rigid_bodies - 1);
+  CHECK(g.get_states() == 0xc000002du);
+  CHECK(g.particle_count == std::numeric_limits<uint16>::max());
+}
+
+TC_TEST("parallel_page_map") {
+  using SparseGrid = SPGrid_Allocator<GridState<2>, 2, 12>;
+  using SparseMask = SparseGrid::Array_type<>::MASK;
+  SparseGrid grid(256, 256);
+  SPGrid_Page_Map<12> reference(grid);
+  ParallelPageMap<12> page_map(grid);
+  std::vector<uint64_t> previous;
+  for (int round = 0; round < 2; round++) {
+    reference.Clear();
+    for (int i = 0; i < 100; i++) {
+      reference.Set_Page(SparseMask::Linear_Offset((i * 37 + round) % 256,
+                                                   (i * 11) % 256));
+    }
+    reference.Update_Block_Offsets();
+    auto blocks = reference.Get_Blocks();
+    std::vector<uint64_t> offsets(blocks.first, blocks.first + blocks.second);
+    page_map.Set_Blocks(std::vector<uint64_t>(offsets));
+    CHECK(page_map.Get_Blocks().second == blocks.second);
+    for (auto offset : offsets) {
+      CHECK(page_map.Test_Page(offset));
+    }
+    // Blocks of the previous round are unset
+    for (auto offset : previous) {
+      CHECK(page_map.Test_Page(offset) == reference.Test_Page(offset));
+    }
+    previous = offsets;
+  }
+}
+
+TC_TEST("rigid_sdf") {
+  RigidBody<3>::ElementType elem;
+  elem.v[0] = Vector3(0, 0, 0);
+  elem.v[1] = Vector3(1, 0, 0);
+  elem.v[2] = Vector3(0, 1, 0);
+  RigidSDF<3> sdf;
+  sdf.bake({elem}, 0.05_f, 2.0_f);
+  real distance;
+  // Distances in delta_x, negative behind the normal (+z)
+  CHECK(sdf.sample(Vector3(0.25_f, 0.25_f, 0.06_f), distance));
+  CHECK(distance == Approx(1.2_f));
+  CHECK(sdf.sample(Vector3(0.25_f, 0.25_f, -0.06_f), distance));
+  CHECK(distance == Approx(-1.2_f));
+  // Beyond an edge
+  CHECK(sdf.sample(Vector3(-0.05_f, 0.5_f, 0), distance));
+  CHECK(std::abs(distance) == Approx(1.0_f));
+  // Outside the band
+  CHECK(!sdf.sample(Vector3(0.25_f, 0.25_f, 0.5_f), distance));
+  CHECK(!sdf.sample(Vector3(2, 2, 0), distance));
+}
+
+TC_TEST("rigid_hull") {
+  // Unit cube, split into triangles through its center, so that the center
+  // is a mesh vertex inside the hull
+  std::vector<RigidHull::ElementType> elements;
+  for (int k = 0; k < 3; k++) {
+    for (int side = 0; side < 2; side++) {
+      Vector3 corners[4];
+      for (int c = 0; c < 4; c++) {
+        corners[c][k] = real(side);
+        corners[c][(k + 1) % 3] = real(c == 1 || c == 2);
+        corners[c][(k + 2) % 3] = real(c >= 2);
+      }
+      for (int c = 0; c < 4; c++) {
+        RigidHull::ElementType elem;
+        elem.v[0] = corners[c];
+        elem.v[1] = corners[(c + 1) % 4];
+        elem.v[2] = Vector3(0.5_f);
+        elements.push_back(elem);
+      }
+    }
+  }
+  RigidHull hull;
+  hull.initialize(elements);
+  CHECK(hull.vertices.size() == 8);
+  for (int i = 0; i < 100; i++) {
+    Vector3 dir = Vector3::rand() - Vector3(0.5_f);
+    real best = -1e30_f;
+    for (auto &v : hull.vertices) {
+      best = std::max(best, dot(v, dir));
+    }
+    CHECK(dot(hull.vertices[hull.get_support(dir)], dir) == Approx(best));
+  }
+}
+
+TC_TEST("compressed_frame") {
+  // Two blocks of particles, one missing id; a keyframe, then a delta frame
+  int n = CompressedFrameEncoder<3>::block_size + 1000;
+  std::vector<FrameField> fields = {FrameField::id, FrameField::position,
+                                    FrameField::pressure, FrameField::states};
+  ParticleFrame<3> frame;
+  frame.num_particles = n;
+  frame.columns.resize(fields.size());
+  for (int c = 0; c < (int)fields.size(); c++) {
+    frame.columns[c].field = fields[c];
+    frame.columns[c].data.resize(n * ParticleFrame<3>::get_field_bytes(
+                                         fields[c]));
+  }
+  auto id = frame.columns[0].get<int32>();
+  auto pos = frame.columns[1].get<float32>();
+  auto pressure = frame.columns[2].get<float32>();
+  auto states = frame.columns[3].get<uint32>();
+  for (int i = 0; i < n; i++) {
+    id[i] = i < 10 ? i : i + 1;
+    for (int k = 0; k < 3; k++) {
+      pos[i * 3 + k] = (float32)rand();
+    }
+    pressure[i] = (float32)rand() * 1e4f;
+    states[i] = (uint32)(rand() * 255) << 24;
+  }
+  CompressedFrameEncoder<3> encoder;
+  encoder.initialize("pressure:12", 10, 1);
+  CompressedFrameDecoder<3> decoder;
+  ParticleFrame<3> decoded;
+  std::string file_name = "compressed_frame_test.mpmz";
+  for (int f = 0; f < 2; f++) {
+    for (int i = 0; i < n * 3; i++) {
+      pos[i] += 0.001f * f;
+    }
+    frame.frame = f;
+    encoder.write(frame, fields, file_name);
+    decoder.read(file_name, decoded);
+    CHECK(decoded.frame == f);
+    CHECK(decoded.num_particles == (uint64)n);
+    auto decoded_id = decoded.find(FrameField::id)->get<int32>();
+    auto decoded_pos = decoded.find(FrameField::position)->get<float32>();
+    auto decoded_pressure = decoded.find(FrameField::pressure)->get<float32>();
+    auto decoded_states = decoded.find(FrameField::states)->get<uint32>();
+    bool exact = true;
+    float32 pos_error = 0, pressure_error = 0;
+    for (int i = 0; i < n; i++) {
+      exact = exact && decoded_id[i] == id[i] && decoded_states[i] == states[i];
+      pressure_error =
+          std::max(pressure_error, std::abs(decoded_pressure[i] - pressure[i]));
+      for (int k = 0; k < 3; k++) {
+        pos_error = std::max(pos_error,
+                             std::abs(decoded_pos[i * 3 + k] - pos[i * 3 + k]));
+      }
+    }
+    CHECK(exact);
+    // Half a step, range / (2^bits - 1) / 2
+    CHECK(pressure_error <= 1e4f / 4095 * 0.51f);
+    CHECK(pos_error <= 1.0f / ((1 << 20) - 1) * 0.51f + 1e-7f);
+  }
+  std::remove(file_name.c_str());
+}
+
 TC_NAMESPACE_END
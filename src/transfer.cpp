@@ -154,6 +154,103 @@ struct GridCache {
   }
 };
 
+// grid cache (2D) -------------------------------------------------------------
+template <typename MPM, bool v_and_m_only = false>
+struct GridCache2D {
+  static_assert(mpm_kernel_order == 2, "Only supports quadratic kernel");
+
+  using SparseMask = typename MPM::SparseMask;
+
+  static constexpr int dim = 2;
+  static constexpr int scratch_x_size = (1 << SparseMask::block_xbits) + 2;
+  static constexpr int scratch_y_size = (1 << SparseMask::block_ybits) + 2;
+  static constexpr int scratch_size = scratch_x_size * scratch_y_size;
+
+  static constexpr int num_nodes = pow<dim>(mpm_kernel_order + 1); // quad2D: 9
+
+  using ElementType =
+      std::conditional_t<v_and_m_only, Vector3f, GridState<dim>>;
+
+  using GridCacheType = ElementType[scratch_x_size][scratch_y_size];
+  using GridCacheLinearizedType = ElementType[scratch_size];
+
+  using SparseGrid = typename MPM::SparseGrid;
+
+  SparseGrid &grid;
+  uint64 block_offset;
+  bool write_back;
+
+  TC_ALIGNED(64) GridCacheType blocked;
+  GridCacheLinearizedType &linear =
+      *reinterpret_cast<GridCacheLinearizedType *>(&blocked[0][0]);
+
+  static constexpr int kernel_linearized(int x) {
+    return (x / 3) * scratch_y_size + x % 3;
+  }
+
+  // constructor
+  TC_FORCE_INLINE GridCache2D(SparseGrid &grid,
+                              const uint64 &block_offset,
+                              bool write_back)
+      : grid(grid), block_offset(block_offset), write_back(write_back) {
+    Vector2i block_base_coord(MPM::SparseMask::LinearToCoord(block_offset));
+    auto grid_array = grid.Get_Array();
+    for (int i = 0; i < scratch_x_size; i++) {
+      for (int j = 0; j < scratch_y_size; j++) {
+        TC_STATIC_IF(v_and_m_only) {
+          id(blocked[i][j]) =
+              grid_array(to_std_array(block_base_coord + Vector2i(i, j)))
+                  .velocity_and_mass;
+        }
+        TC_STATIC_ELSE {
+          id(blocked[i][j]) =
+              grid_array(to_std_array(block_base_coord + Vector2i(i, j)));
+        }
+        TC_STATIC_END_IF
+      }
+    }
+  }
+
+  ~GridCache2D() {
+    if (!write_back) {
+      return;
+    }
+    Vector2i block_base_coord(MPM::SparseMask::LinearToCoord(block_offset));
+    auto grid_array = grid.Get_Array();
+    for (int i = 0; i < scratch_x_size; i++) {
+      for (int j = 0; j < scratch_y_size; j++) {
+        TC_STATIC_IF(v_and_m_only) {
+          id(grid_array(to_std_array(block_base_coord + Vector2i(i, j)))
+              .velocity_and_mass) = blocked[i][j];
+        }
+        TC_STATIC_ELSE {
+          id(grid_array(to_std_array(block_base_coord + Vector2i(i, j)))) =
+              blocked[i][j];
+        }
+        TC_STATIC_END_IF
+      }
+    }
+  }
+
+  TC_FORCE_INLINE static constexpr int linearized_offset(int x, int y) {
+    return x * scratch_y_size + y;
+  }
+
+  // Note: in 2D SPGrid blocks y is the fastest varying coordinate
+  TC_FORCE_INLINE static Vector2i spgrid_block_linear_to_vector(int elem) {
+    int elem_x = (elem >> SparseMask::block_ybits);
+    int elem_y = elem & ((1 << SparseMask::block_ybits) - 1);
+    return Vector2i(elem_x, elem_y);
+  }
+
+  TC_FORCE_INLINE static constexpr int spgrid_block_to_grid_cache_block(
+      int elem) {
+    int elem_x = (elem >> SparseMask::block_ybits);
+    int elem_y = elem & ((1 << SparseMask::block_ybits) - 1);
+    return linearized_offset(elem_x, elem_y);
+  }
+};
+
 TC_FORCE_INLINE __m128 make_float4(float32 a, float32 b, float32 c, float32 d) {
   return _mm_set_ps(d, c, b, a);
 }
@@ -190,6 +287,31 @@ struct MLSMPMFastKernel32 {
   }
 };
 
+// MLS-MPM fast kernel (2D) ----------------------------------------------------
+// kernels[i][j] is the weight of node (i, j); lane 3 is always zero
+struct MLSMPMFastKernel2D {
+  static constexpr int dim = 2;
+  TC_ALIGNED(16) __m128 kernels[3];
+
+  // Note, rela_pos is the magnified particle position relative to the
+  // stencil start
+  TC_FORCE_INLINE MLSMPMFastKernel2D(const Vector2 &rela_pos) {
+    TC_ALIGNED(16) __m128 w_cache[dim];
+    for (int k = 0; k < dim; k++) {
+      __m128 t = _mm_sub_ps(_mm_set1_ps(rela_pos[k] - 0.5f),
+                            make_float4(-0.5f, 0.5f, 1.5f, 0.0f));
+      __m128 tt = _mm_mul_ps(t, t);
+      w_cache[k] =
+          _mm_fmadd_ps(make_float4(0.5f, -1.0f, 0.5f, 0.0f), tt,
+                       _mm_fmadd_ps(make_float4(-1.5f, 0.0f, 1.5f, 0.0f), t,
+                                    make_float4(1.125f, 0.75f, 1.125f, 0.0f)));
+    }
+    for (int i = 0; i < 3; i++) {
+      kernels[i] = _mm_mul_ps(_mm_set1_ps(w_cache[0][i]), w_cache[1]);
+    }
+  }
+};
+
 // rasterize ------------------------------------------------------------- : OFF
 template <int dim>
 void MPM<dim>::rasterize(real delta_t, bool with_force) {
@@ -246,7 +368,7 @@ void MPM<dim>::rasterize(real delta_t, bool with_force) {
         Vector velocity_change =
             v_acc -
             friction_project(v_acc, rigid_v, p.boundary_normal,
-                             r->frictions[(particle_state >> (2 * r->id)) % 2]);
+                             r->frictions[get_affinity_side(particle_state, r->id)]);
 
         Vector impulse = mass * dw_w[dim] * velocity_change +
                          delta_t_tmp_force * Vector(dw_w);
@@ -278,10 +400,6 @@ void MPM<dim>::rasterize(real delta_t, bool with_force) {
   // TC_P(E);
 }
 
-template <>
-void MPM<2>::rasterize_optimized(real delta_t) {
-  rasterize(delta_t, true);
-}
 TC_FORCE_INLINE __m128 make_float3(float a, float b, float c) {
   return make_float4(a, b, c, 0);
 }
@@ -350,17 +468,285 @@ TC_ALIGNED(64) const static Vector3f grid_pos_offset[27] = {
 };
 // clang-format on
 
+// clang-format off
+TC_ALIGNED(64) const static __m128 grid_pos_offset_2d_[9] = {
+    make_float4(0, 0, 0, 0),  // 0
+    make_float4(0, 1, 0, 0),  // 1, i-1
+    make_float4(0, 2, 0, 0),  // 2
+    make_float4(1, 0, 0, 0),  // 3, j-1
+    make_float4(1, 1, 0, 0),  // 4, i,j
+    make_float4(1, 2, 0, 0),  // 5, j+1
+    make_float4(2, 0, 0, 0),  // 6
+    make_float4(2, 1, 0, 0),  // 7, i+1
+    make_float4(2, 2, 0, 0),  // 8
+};
+// clang-format on
+
+// clang-format off
+TC_ALIGNED(64) const static Vector2f grid_pos_offset_2d[9] = {
+    Vector2f(0, 0),
+    Vector2f(0, 1),
+    Vector2f(0, 2),
+    Vector2f(1, 0),
+    Vector2f(1, 1),
+    Vector2f(1, 2),
+    Vector2f(2, 0),
+    Vector2f(2, 1),
+    Vector2f(2, 2),
+};
+// clang-format on
+
 TC_TEST("grid_pos_offset") {
   for (int i = 0; i < 27; i++) {
     CHECK(grid_pos_offset[i].x == i / 9);
     CHECK(grid_pos_offset[i].y == i / 3 % 3);
     CHECK(grid_pos_offset[i].z == i % 3);
   }
+  for (int i = 0; i < 9; i++) {
+    CHECK(grid_pos_offset_2d[i].x == i / 3);
+    CHECK(grid_pos_offset_2d[i].y == i % 3);
+    CHECK(grid_pos_offset_2d_[i][0] == i / 3);
+    CHECK(grid_pos_offset_2d_[i][1] == i % 3);
+  }
+}
+
+// optimized rasterization function (2D) ---------------------------------- : ON
+template <>
+template <typename P2GOptions>
+void MPM<2>::rasterize_optimized(real substep_delta_t,
+                                 const P2GOptions p2g_options) {
+  constexpr int dim = 2;
+  using Cache = GridCache2D<MPM<dim>>;
+  for (auto &r : this->rigids) {
+    r->reset_tmp_velocity();
+  }
+
+  // block_op_rigid, called from block_op_switch -------------------------------
+  auto block_op_rigid = [&](uint32 b, uint64 block_offset, GridState<dim> *g_) {
+    Cache grid_cache(*grid, block_offset, true);
+    int particle_begin;
+    int particle_end = block_meta[b].particle_offset;
+    RigidImpulse<dim> *impulses = get_rigid_impulses(b);
+
+    for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
+      particle_begin = particle_end;
+      particle_end += get_particle_count(b, t, g_[t]);
+      int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
+
+      Vectori grid_base_pos = Vectori(SparseMask::LinearToCoord(block_offset)) +
+                              grid_cache.spgrid_block_linear_to_vector(t);
+      Vector grid_base_pos_f = Vector(grid_base_pos);
+
+      Vector grid_pos[9];
+      for (int i = 0; i < 9; i++) {
+        grid_pos[i] = grid_pos_offset_2d[i] + grid_base_pos_f;
+      }
+
+      // Reset forces on rigid body boundary particles
+      if (p2g_options.visualize_particle_impulses()) {
+        for (int r_p_i = particle_begin; r_p_i < particle_end; r_p_i++) {
+          Particle &r_p = *allocator[particles[r_p_i]];
+          if (r_p.is_rigid())
+            r_p.rigid_impulse = Vector(0.0_f);
+        }
+      }
+
+      for (int p_i = particle_begin; p_i < particle_end; p_i++) {
+        Particle &p = *allocator[particles[p_i]];
+        if (p.is_rigid()) {
+          continue;
+        }
+        const real delta_t = get_particle_delta_t(p, substep_delta_t);
+        const real stress_delta_t = get_stress_delta_t(p, substep_delta_t);
+        if (particle_gravity) {
+          p.set_velocity(p.get_velocity() + gravity * delta_t);
+        }
+        // Note, pos is magnified (0-res) grid pos
+        const Vector pos = p.pos * inv_delta_x;
+        Kernel kernel(pos, inv_delta_x);
+
+        const Vector v = p.get_velocity();
+        const real mass = p.get_mass();
+
+        // Disconnection handling via pressure @ n
+        const real gf = p.p > 0.0_f ? p.gf : 0.0_f;
+
+        const Matrix delta_t_tmp_force = stress_delta_t * p.calculate_force();
+        // Note, apic_b has delta_x issue
+        const Matrix apic_b_inv_d_mass = p.apic_b * (Kernel::inv_D() * mass);
+        const Vector mass_v = mass * v;
+
+        for (int node_id = 0; node_id < Cache::num_nodes; node_id++) {
+          Vector dpos = pos - grid_pos[node_id];
+
+          GridState<dim> &g =
+              grid_cache.linear[grid_cache.kernel_linearized(node_id) +
+                                grid_cache_offset];
+
+          const VectorP dw_w =
+              kernel.get_dw_w(Vectori(node_id / 3, node_id % 3));
+
+          // Coloring
+          uint64 grid_state = g.get_states(), particle_state = p.states;
+          uint64 mask = (grid_state & particle_state & state_mask) >> 1;
+
+          // incompatible grid and particle ------------------------------------
+          if ((grid_state & mask) != (particle_state & mask)) {
+            if (p2g_options.compute_particle_impulses()) {
+              RigidBody<dim> *r = get_rigid_body_ptr(g.get_rigid_body_id());
+              if (r == nullptr)
+                continue;
+              Vector rigid_v = r->get_velocity_at(delta_x * grid_pos[node_id]);
+              Vector velocity_change =
+                  v - friction_project(
+                          v, rigid_v, p.boundary_normal,
+                          r->frictions[get_affinity_side(particle_state, r->id)]);
+              Vector impulse = mass * dw_w[dim] * velocity_change +
+                               delta_t_tmp_force * Vector(dw_w);
+
+              // Force and torque on rigid bodies' center of mass. Particles
+              // that are not due (async) exchange no impulse.
+              if (delta_t == 0.0_f) {
+                continue;
+              }
+              Vector force_tmp = impulse / delta_t;
+              Vector arm = delta_x * grid_pos[node_id] - r->position;
+              RigidImpulse<dim> &rigid_impulse =
+                  impulses[g.get_rigid_body_id()];
+              rigid_impulse.add_force(force_tmp, arm);
+
+              if (p2g_options.visualize_particle_impulses()) {
+                for (int r_p_i = particle_begin; r_p_i < particle_end;
+                     r_p_i++) {
+                  Particle &r_p = *allocator[particles[r_p_i]];
+                  if (r_p.is_rigid()) {
+                    r_p.rigid_impulse = force_tmp;
+                  }
+                }
+              }
+
+              if (p2g_options.affect_particle_impulses()) {
+                rigid_impulse.add_impulse(impulse, arm);
+              }
+            }
+            continue;
+          }
+
+          g.velocity_and_mass +=
+              dw_w[dim] *
+              (VectorP(mass_v + apic_b_inv_d_mass * dpos, mass) +
+               VectorP(-delta_t_tmp_force * dpos * 4.0_f * inv_delta_x));
+          g.granular_fluidity += dw_w[dim] * gf;
+        }
+      }
+    }
+  };
+
+  // block_op_normal, called from block_op_switch ------------------------------
+  auto block_op_normal = [&](uint32 b, uint64 block_offset,
+                             GridState<dim> *g_) {
+    Cache grid_cache(*grid, block_offset, true);
+    int particle_begin;
+    int particle_end = block_meta[b].particle_offset;
+
+    // grid loop
+    for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
+      particle_begin = particle_end;
+      particle_end += get_particle_count(b, t, g_[t]);
+      int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
+
+      Vectori grid_base_pos = Vectori(SparseMask::LinearToCoord(block_offset)) +
+                              grid_cache.spgrid_block_linear_to_vector(t);
+      Vector grid_base_pos_f = Vector(grid_base_pos);
+
+      // particle loop
+      for (int p_i = particle_begin; p_i < particle_end; p_i++) {
+        Particle &p = *allocator[particles[p_i]];
+        const real delta_t = get_particle_delta_t(p, substep_delta_t);
+        const real stress_delta_t = get_stress_delta_t(p, substep_delta_t);
+        const __m128 S = _mm_set1_ps(-4.0_f * inv_delta_x * stress_delta_t);
+        if (particle_gravity) {
+          p.set_velocity(p.get_velocity() + gravity * delta_t);
+        }
+
+        // Note, rela_pos is magnified grid pos relative to the stencil start
+        const Vector rela_pos_ = p.pos * inv_delta_x - grid_base_pos_f;
+        MLSMPMFastKernel2D kernel(rela_pos_);
+        const __m128(&kernels)[3] = kernel.kernels;
+
+        const Vector v = p.get_velocity();
+        const real mass = p.get_mass();
+        // (mass_v, mass) is laid out as the VectorP in GridState<2>
+        const __m128 mass_ = make_float4(0.0_f, 0.0_f, mass, 0.0_f);
+        const __m128 mass_v =
+            make_float4(mass * v[0], mass * v[1], 0.0_f, 0.0_f);
+
+        // Disconnection handling via pressure @ n
+        const real gf = p.p > 0.0_f ? p.gf : 0.0_f;
+
+        // Note, apic_b has delta_x issue
+        const Matrix apic_b_inv_d_mass = p.apic_b * (Kernel::inv_D() * mass);
+        const Matrix stress = p.calculate_force();
+
+        __m128 affine[2];
+        for (int i = 0; i < dim; i++) {
+          affine[i] = _mm_fmadd_ps(
+              make_float4(stress[i][0], stress[i][1], 0.0_f, 0.0_f), S,
+              make_float4(apic_b_inv_d_mass[i][0], apic_b_inv_d_mass[i][1],
+                          0.0_f, 0.0_f));
+        }
+        __m128 rela_pos =
+            make_float4(rela_pos_[0], rela_pos_[1], 0.0_f, 0.0_f);
+
+        for (int node_id = 0; node_id < Cache::num_nodes; node_id++) {
+          GridState<dim> &g =
+              grid_cache.linear[grid_cache.kernel_linearized(node_id) +
+                                grid_cache_offset];
+          __m128 dpos = _mm_sub_ps(rela_pos, grid_pos_offset_2d_[node_id]);
+          real w = kernels[node_id / 3][node_id % 3];
+          __m128 weight = _mm_set1_ps(w);
+          __m128 affine_prod = _mm_fmadd_ps(
+              affine[1], broadcast(dpos, 1),
+              _mm_fmadd_ps(affine[0], broadcast(dpos, 0), mass_v));
+          __m128 contrib = _mm_blend_ps(affine_prod, mass_, 0x4);
+          g.velocity_and_mass.v =
+              _mm_fmadd_ps(weight, contrib, g.velocity_and_mass.v);
+          g.granular_fluidity += w * gf;
+        }
+      }
+    }
+  };
+
+  // block_op_switch -----------------------------------------------------------
+  auto block_op_switch = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (scheduler && !scheduler->is_block_rasterized(b)) {
+      return;
+    }
+    if (rigid_page_map->Test_Page(block_offset)) {
+      block_op_rigid(b, block_offset, g);
+    } else {
+      block_op_normal(b, block_offset, g);
+    }
+  };
+
+  reset_rigid_impulses();
+  parallel_for_each_block_with_index(block_op_switch, false, true);
+  reduce_rigid_impulses();
+
+  for (auto &r : rigids) {
+    r->apply_tmp_velocity();
+    r->rigid_force = r->rigid_force_tmp;
+    r->rigid_torque = r->rigid_torque_tmp;
+    r->rigid_force_tmp = Vector(0.0_f);
+    r->rigid_torque_tmp = Vector(0.0_f);
+  }
 }
 
 // optimized rasterization function --------------------------------------- : ON
 template <>
-void MPM<3>::rasterize_optimized(real delta_t) {
+template <typename P2GOptions>
+void MPM<3>::rasterize_optimized(real substep_delta_t,
+                                 const P2GOptions p2g_options) {
   constexpr int dim = 3;
   for (auto &r : this->rigids) {
     r->reset_tmp_velocity();
@@ -372,10 +758,11 @@ void MPM<3>::rasterize_optimized(real delta_t) {
     Cache grid_cache(*grid, block_offset, true);
     int particle_begin;
     int particle_end = block_meta[b].particle_offset;
+    RigidImpulse<dim> *impulses = get_rigid_impulses(b);
 
     for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
       particle_begin = particle_end;
-      particle_end += g_[t].particle_count;
+      particle_end += get_particle_count(b, t, g_[t]);
       int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
 
       Vectori grid_base_pos = Vectori(SparseMask::LinearToCoord(block_offset)) +
@@ -388,7 +775,7 @@ void MPM<3>::rasterize_optimized(real delta_t) {
       }
 
       // added: Reset forces on rigid body boundary particles
-      if (config_backup.get("visualize_particle_impulses", false))
+      if (p2g_options.visualize_particle_impulses())
       {
         for (int r_p_i = particle_begin; r_p_i < particle_end; r_p_i++) {
           Particle &r_p = *allocator[particles[r_p_i]];
@@ -402,6 +789,8 @@ void MPM<3>::rasterize_optimized(real delta_t) {
         if (p.is_rigid()) {
           continue;
         }
+        const real delta_t = get_particle_delta_t(p, substep_delta_t);
+        const real stress_delta_t = get_stress_delta_t(p, substep_delta_t);
         // add particle gravity ------------------------------------------------
         if (particle_gravity) {
           p.set_velocity(p.get_velocity() + gravity * delta_t);
@@ -431,7 +820,7 @@ void MPM<3>::rasterize_optimized(real delta_t) {
           gf = 0.0_f;
         }
         Matrix delta_t_tmp_force(0.0_f);
-        delta_t_tmp_force = (delta_t * p.calculate_force());
+        delta_t_tmp_force = (stress_delta_t * p.calculate_force());
 
         // Note, apic_b has delta_x issue
         const Matrix apic_b_inv_d_mass = p.apic_b * (Kernel::inv_D() * mass);
@@ -453,13 +842,18 @@ void MPM<3>::rasterize_optimized(real delta_t) {
           // incompatible grid and particle ------------------------------------
           if ((grid_state & mask) != (particle_state & mask)) {
             // calculate impulse on rigid bodies -------------------------------
-            if (config_backup.get("compute_particle_impulses", false))
+            // (not from particles that are not due, async)
+            if (p2g_options.compute_particle_impulses() &&
+                delta_t != 0.0_f)
             {
               RigidBody<dim> *r = get_rigid_body_ptr(g.get_rigid_body_id());
               if (r == nullptr)
                 continue;
               Vector impulse(0.0_f);
               Vector force_tmp(0.0_f);
+              Vector arm = delta_x * grid_pos[node_id] - r->position;
+              RigidImpulse<dim> &rigid_impulse =
+                  impulses[g.get_rigid_body_id()];
               // if (p.boundary_distance <= 0.05_f * delta_x){  // for excav with 4 ppc
                 Vector rigid_v = r->get_velocity_at(delta_x * grid_pos[node_id]);
 
@@ -470,19 +864,18 @@ void MPM<3>::rasterize_optimized(real delta_t) {
                     v_acc,
                     rigid_v,
                     p.boundary_normal,
-                    r->frictions[(particle_state >> (2 * r->id)) % 2]);
+                    r->frictions[get_affinity_side(particle_state, r->id)]);
                 impulse = (mass * dw_w[dim] * velocity_change +
                           delta_t_tmp_force * Vector(dw_w));
 
                 // added: Force and torque on rigid bodies' center of mass
                 force_tmp = impulse / delta_t;
-                r->rigid_force_tmp += force_tmp;
-                r->rigid_torque_tmp += cross(delta_x * grid_pos[node_id] - r->position, force_tmp);
+                rigid_impulse.add_force(force_tmp, arm);
               // }
 
               // Impulse on rigid body boundary particles
               // TODO: Make it more realistic for visualization
-              if (config_backup.get("visualize_particle_impulses", false))
+              if (p2g_options.visualize_particle_impulses())
               {
                 for (int r_p_i = particle_begin; r_p_i < particle_end; r_p_i++)
                 {
@@ -497,8 +890,8 @@ void MPM<3>::rasterize_optimized(real delta_t) {
               }
 
               // Apply impulses on rigid body
-              if (config_backup.get("affect_particle_impulses", false)){
-                r->apply_tmp_impulse(impulse, delta_x * grid_pos[node_id]);
+              if (p2g_options.affect_particle_impulses()){
+                rigid_impulse.add_impulse(impulse, arm);
               }
             }
             continue;
@@ -518,8 +911,6 @@ void MPM<3>::rasterize_optimized(real delta_t) {
     }
   };
 
-  __m128 S = _mm_set1_ps(-4.0_f * inv_delta_x * delta_t);
-
   // block_op_normal, called from block_op_switch ------------------------------
   auto block_op_normal = [&](uint32 b, uint64 block_offset,
                              GridState<dim> *g_) {
@@ -532,7 +923,7 @@ void MPM<3>::rasterize_optimized(real delta_t) {
     // grid loop
     for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
       particle_begin = particle_end;
-      particle_end += g_[t].particle_count;
+      particle_end += get_particle_count(b, t, g_[t]);
       int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
 
       Vectori grid_base_pos = Vectori(SparseMask::LinearToCoord(block_offset)) +
@@ -542,6 +933,9 @@ void MPM<3>::rasterize_optimized(real delta_t) {
       // particle loop
       for (int p_i = particle_begin; p_i < particle_end; p_i++) {
         Particle &p = *allocator[particles[p_i]];
+        const real delta_t = get_particle_delta_t(p, substep_delta_t);
+        const real stress_delta_t = get_stress_delta_t(p, substep_delta_t);
+        const __m128 S = _mm_set1_ps(-4.0_f * inv_delta_x * stress_delta_t);
         if (particle_gravity) {
           p.set_velocity(p.get_velocity() + gravity * delta_t);
         }
@@ -585,7 +979,8 @@ void MPM<3>::rasterize_optimized(real delta_t) {
         Matrix &delta_t_tmp_force =
             reinterpret_cast<Matrix &>(delta_t_tmp_force_);
         for (int i = 0; i < 3; i++) {
-          delta_t_tmp_force_[i] = _mm_mul_ps(_mm_set1_ps(delta_t), stress[i]);
+          delta_t_tmp_force_[i] =
+              _mm_mul_ps(_mm_set1_ps(stress_delta_t), stress[i]);
         }
 
         __m128 rela_pos = _mm_sub_ps(pos_, grid_base_pos_f);
@@ -652,6 +1047,9 @@ void MPM<3>::rasterize_optimized(real delta_t) {
 
   // block_op_switch -----------------------------------------------------------
   auto block_op_switch = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (scheduler && !scheduler->is_block_rasterized(b)) {
+      return;
+    }
     if (rigid_page_map->Test_Page(block_offset)) {
       block_op_rigid(b, block_offset, g);
     } else {
@@ -660,7 +1058,9 @@ void MPM<3>::rasterize_optimized(real delta_t) {
   };
 
   // calls block_op_switch
+  reset_rigid_impulses();
   parallel_for_each_block_with_index(block_op_switch, false, true);
+  reduce_rigid_impulses();
   // apply impulses from particles on rigid bodies
   for (auto &r : rigids) {
     r->apply_tmp_velocity();
@@ -673,6 +1073,18 @@ void MPM<3>::rasterize_optimized(real delta_t) {
     
   }
 }
+
+template <int dim>
+void MPM<dim>::rasterize_optimized(real delta_t) {
+  rasterize_optimized(delta_t, CachedP2GOptions(options));
+}
+
+template void MPM<2>::rasterize_optimized(real, const CachedP2GOptions);
+template void MPM<3>::rasterize_optimized(real, const CachedP2GOptions);
+template void MPM<2>::rasterize_optimized(real, const ConfigP2GOptions);
+template void MPM<3>::rasterize_optimized(real, const ConfigP2GOptions);
+template void MPM<2>::rasterize_optimized(real);
+template void MPM<3>::rasterize_optimized(real);
 // end -------------------------------------------------------------------------
 
 // resample -------------------------------------------------------------- : OFF
@@ -688,7 +1100,7 @@ void MPM<dim>::resample() {
     if (p.is_rigid()) {
       return;
     }
-    real delta_t = base_delta_t;
+    real delta_t = current_delta_t;
     Vector v(0.0f), bv(0.0f);
     Matrix b(0.0f);
     Matrix cdg(0.0f);
@@ -726,7 +1138,7 @@ void MPM<dim>::resample() {
         if (r != nullptr) {
           v_g = r->get_velocity_at(grid_pos);
           rigid_id = g.get_rigid_body_id();
-          friction = r->frictions[(particle_state >> (2 * r->id)) % 2];
+          friction = r->frictions[get_affinity_side(particle_state, r->id)];
         }
         if (p.near_boundary()) {
           if (p.sticky) {
@@ -759,7 +1171,7 @@ void MPM<dim>::resample() {
     cdg = b * (-4 * inv_delta_x);
 #endif
     cdg = Matrix(1.0f) + delta_t * cdg;
-    plasticity_counter += p.plasticity(cdg, 0.0f);
+    add_counter(plasticity_counter, p.plasticity(cdg, 0.0f));
 
     p.pos += delta_t * p.get_velocity();
 
@@ -789,8 +1201,261 @@ template void MPM<2>::rasterize(real delta_t, bool);
 template void MPM<2>::resample();
 template void MPM<3>::rasterize(real delta_t, bool);
 template void MPM<3>::resample();
+
+// optimized resampling (2D) ---------------------------------------------- : ON
 template <>
-void MPM<2>::resample_optimized() {resample();}
+void MPM<2>::resample_optimized() {
+  constexpr int dim = 2;
+  using Cache = GridCache2D<MPM<dim>>;
+
+  // laplacian of granular fluidity using central FD scheme (5-point)
+  auto get_laplacian_gf = [&](const Cache &grid_cache, int grid_cache_offset) {
+    auto gf = [&](int node_id) -> real {
+      return grid_cache
+          .linear[Cache::kernel_linearized(node_id) + grid_cache_offset]
+          .granular_fluidity;
+    };
+    return inv_delta_x * inv_delta_x *
+           (gf(7) + gf(1) + gf(5) + gf(3) - gf(4) * 4.0_f);
+  };
+
+  // Position correction
+  auto clamp_position = [&](Particle &p) {
+    p.pos = (p.pos * inv_delta_x)
+                .clamp(Vector(0.0_f), res.template cast<real>() - Vector(eps)) *
+            delta_x;
+  };
+
+  // block_op_rigid ------------------------------------------------------------
+  auto block_op_rigid = [&](uint32 b, uint64 block_offset, GridState<dim> *g_) {
+    Cache grid_cache(*grid, block_offset, false);
+    int particle_begin;
+    int particle_end = block_meta[b].particle_offset;
+    RigidImpulse<dim> *impulses = get_rigid_impulses(b);
+    uint64 block_plasticity = 0;
+
+    for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
+      particle_begin = particle_end;
+      particle_end += get_particle_count(b, t, g_[t]);
+      int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
+
+      Vectori grid_base_pos = Vectori(SparseMask::LinearToCoord(block_offset)) +
+                              grid_cache.spgrid_block_linear_to_vector(t);
+      Vector grid_base_pos_f = Vector(grid_base_pos);
+
+      Vector grid_pos[9];
+      for (int i = 0; i < 9; i++) {
+        grid_pos[i] = grid_pos_offset_2d[i] + grid_base_pos_f;
+      }
+
+      const real laplacian_gf = get_laplacian_gf(grid_cache, grid_cache_offset);
+
+      // for each (non-rigid) particle in grid
+      for (int k = particle_begin; k < particle_end; k++) {
+        Particle &p = *allocator[particles[k]];
+        if (p.is_rigid()) {
+          continue;
+        }
+        real delta_t = get_particle_delta_t(p, current_delta_t);
+        if (delta_t == 0.0_f) {
+          continue;
+        }
+        Vector v(0.0_f);
+        Matrix b(0.0_f);
+        Vector pos = p.pos * inv_delta_x;
+
+        Vector v_r(0.0_f);
+        real friction_r = 0.0_f;
+
+        Kernel kernel(pos, inv_delta_x);
+
+        int rigid_id = -1;
+
+        // for each node
+        for (int node_id = 0; node_id < Cache::num_nodes; node_id++) {
+          Vector dpos = pos - grid_pos[node_id];
+
+          GridState<dim> &g =
+              grid_cache.linear[grid_cache.kernel_linearized(node_id) +
+                                grid_cache_offset];
+
+          auto grid_vel = Vector(g.velocity_and_mass);
+          const real w = kernel.get_w(Vectori(node_id / 3, node_id % 3));
+
+          // Coloring
+          uint64 grid_state = g.get_states();
+          uint64 particle_state = p.states;
+          uint64 mask = (grid_state & particle_state & state_mask) >> 1;
+
+          if ((grid_state & mask) != (particle_state & mask)) {
+            // different color
+            Vector fake_v = p.get_velocity();
+            RigidBody<dim> *r = get_rigid_body_ptr(g.get_rigid_body_id());
+            Vector v_g(0.0_f);
+            real friction = 0;
+            if (r != nullptr) {
+              v_g = r->get_velocity_at(grid_pos[node_id] * delta_x);
+              rigid_id = g.get_rigid_body_id();
+              friction = r->frictions[get_affinity_side(particle_state, r->id)];
+            }
+            if (p.near_boundary()) {
+              fake_v = friction_project(p.get_velocity(), v_g,
+                                        p.boundary_normal, friction);
+            }
+            grid_vel = fake_v;
+          }
+
+          // Modified rb interaction approach
+          if (node_id == 4) {
+            RigidBody<dim> *r = get_rigid_body_ptr(g.get_rigid_body_id());
+            if (r != nullptr) {
+              v_r = r->get_velocity_at(grid_pos[node_id] * delta_x);
+              friction_r = r->frictions[get_affinity_side(particle_state, r->id)];
+            }
+          }
+
+          v += w * grid_vel;
+          for (int r = 0; r < dim; r++) {
+            b[r] += (w * dpos[r]) * grid_vel;
+          }
+        }
+
+        Matrix cdg = Matrix(1.0_f) + (-4 * inv_delta_x * delta_t) * b;
+
+        if (p.near_boundary() && p.boundary_distance <= 0.05_f * delta_x)
+          v = friction_project(v, v_r, p.boundary_normal, std::abs(friction_r));
+
+        block_plasticity += p.plasticity(cdg, laplacian_gf);
+
+        p.set_velocity(v);
+
+        if (p.near_boundary()) {
+          p.apic_b = Matrix(0);
+        } else {
+          p.apic_b = damp_affine_momemtum(b);
+        }
+
+        p.pos += delta_t * p.get_velocity();
+        clamp_position(p);
+
+        if (p.near_boundary()) {
+          if (p.boundary_distance < -0.05 * delta_x &&
+              p.boundary_distance > -delta_x * 0.3) {
+            Vector delta_velocity =
+                p.boundary_distance * p.boundary_normal * penalty;
+            p.set_velocity(p.get_velocity() - delta_velocity);
+            if (rigid_id != -1) {
+              RigidBody<dim> *r = get_rigid_body_ptr(rigid_id);
+              impulses[rigid_id].add_impulse(delta_velocity * p.get_mass(),
+                                             p.pos - r->position);
+            }
+          }
+        }
+      }  // particle loop end
+    }
+    add_counter(plasticity_counter, block_plasticity);
+  };
+
+  // block_op_normal -----------------------------------------------------------
+  auto block_op_normal = [&](uint32 b, uint64 block_offset,
+                             GridState<dim> *g_) {
+    Cache grid_cache(*grid, block_offset, false);
+    int particle_begin;
+    int particle_end = block_meta[b].particle_offset;
+    uint64 block_plasticity = 0;
+
+    for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
+      particle_begin = particle_end;
+      particle_end += get_particle_count(b, t, g_[t]);
+      int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
+
+      Vectori grid_base_pos = Vectori(SparseMask::LinearToCoord(block_offset)) +
+                              grid_cache.spgrid_block_linear_to_vector(t);
+      Vector grid_base_pos_f = Vector(grid_base_pos);
+
+      const real laplacian_gf = get_laplacian_gf(grid_cache, grid_cache_offset);
+
+      for (int k = particle_begin; k < particle_end; k++) {
+        Particle &p = *allocator[particles[k]];
+        real delta_t = get_particle_delta_t(p, current_delta_t);
+        if (delta_t == 0.0_f) {
+          continue;
+        }
+
+        const Vector rela_pos_ = p.pos * inv_delta_x - grid_base_pos_f;
+        MLSMPMFastKernel2D kernel(rela_pos_);
+        const __m128(&kernels)[3] = kernel.kernels;
+
+        __m128 b_[2] = {_mm_setzero_ps(), _mm_setzero_ps()};
+        __m128 v_ = _mm_setzero_ps();
+        __m128 rela_pos =
+            make_float4(rela_pos_[0], rela_pos_[1], 0.0_f, 0.0_f);
+
+        for (int node_id = 0; node_id < Cache::num_nodes; node_id++) {
+          __m128 dpos = _mm_sub_ps(rela_pos, grid_pos_offset_2d_[node_id]);
+          __m128 grid_vel =
+              grid_cache
+                  .linear[grid_cache.kernel_linearized(node_id) +
+                          grid_cache_offset]
+                  .velocity_and_mass.v;
+          __m128 w = _mm_set1_ps(kernels[node_id / 3][node_id % 3]);
+          v_ = _mm_fmadd_ps(grid_vel, w, v_);
+          __m128 w_grid_vel = _mm_mul_ps(w, grid_vel);
+          for (int r = 0; r < dim; r++) {
+            b_[r] = _mm_fmadd_ps(w_grid_vel, broadcast(dpos, r), b_[r]);
+          }
+        }
+
+        // Note, only the first dim lanes carry velocity
+        Vector v(v_[0], v_[1]);
+        Matrix b;
+        for (int r = 0; r < dim; r++) {
+          b[r] = Vector(b_[r][0], b_[r][1]);
+        }
+
+        p.apic_b = damp_affine_momemtum(b);
+        p.set_velocity(v);
+
+        Matrix cdg = Matrix(1.0_f) + (-4 * inv_delta_x * delta_t) * b;
+        block_plasticity += p.plasticity(cdg, laplacian_gf);
+
+        p.pos += delta_t * v;
+        clamp_position(p);
+      }
+    }
+    add_counter(plasticity_counter, block_plasticity);
+  };
+
+  for (auto &r : rigids) {
+    r->reset_tmp_velocity();
+  }
+
+  auto block_op_switch = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (scheduler && !scheduler->is_block_active(b)) {
+      return;
+    }
+    if (rigid_page_map->Test_Page(block_offset)) {
+      block_op_rigid(b, block_offset, g);
+    } else {
+      block_op_normal(b, block_offset, g);
+    }
+  };
+
+  reset_rigid_impulses();
+  if (scheduler) {
+    // One pass per step size, as NGF plasticity reads the material dt
+    scheduler->for_each_level([&] {
+      parallel_for_each_block_with_index(block_op_switch, false, false);
+    });
+  } else {
+    parallel_for_each_block_with_index(block_op_switch, false, false);
+  }
+  reduce_rigid_impulses();
+
+  for (auto &r : rigids) {
+    r->apply_tmp_velocity();
+  }
+}
 
 // optimized resampling --------------------------------------------------- : ON
 template <>
@@ -803,13 +1468,15 @@ void MPM<3>::resample_optimized() {
     Cache grid_cache(*grid, block_offset, false);
     int particle_begin;
     int particle_end = block_meta[b].particle_offset;
+    RigidImpulse<dim> *impulses = get_rigid_impulses(b);
+    uint64 block_plasticity = 0;
 
     // element loop
     for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
       particle_begin = particle_end;
 
       // number of particles in grid
-      particle_end += g[t].particle_count;
+      particle_end += get_particle_count(b, t, g[t]);
 
       int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
 
@@ -828,7 +1495,10 @@ void MPM<3>::resample_optimized() {
         if (p.is_rigid()) {
           continue;
         }
-        real delta_t = base_delta_t;
+        real delta_t = get_particle_delta_t(p, current_delta_t);
+        if (delta_t == 0.0_f) {
+          continue;
+        }
         Vector v(0.0_f);
         Matrix b(0.0_f);
         Matrix cdg(0.0_f);
@@ -877,7 +1547,7 @@ void MPM<3>::resample_optimized() {
               rigid_id = g.get_rigid_body_id();
               /* there might be frictions for inside and outside of rigid body.
               but for now, they are the same */
-              friction = r->frictions[(particle_state >> (2 * r->id)) % 2];
+              friction = r->frictions[get_affinity_side(particle_state, r->id)];
             }
             if (p.near_boundary())
             {
@@ -898,7 +1568,7 @@ void MPM<3>::resample_optimized() {
             {
               // can be more accurate
               v_r = r->get_velocity_at(grid_pos[node_id] * delta_x);
-              friction_r = r->frictions[(particle_state >> (2 * r->id)) % 2];                
+              friction_r = r->frictions[get_affinity_side(particle_state, r->id)];                
             }
           }
 
@@ -1301,7 +1971,7 @@ void MPM<3>::resample_optimized() {
           v = friction_project(v, v_r, p.boundary_normal, abs(friction_r));
 
         // added: Update granular fluidity and deformation gradient
-        plasticity_counter += p.plasticity(cdg, laplacian_gf);
+        block_plasticity += p.plasticity(cdg, laplacian_gf);
 
         p.set_velocity(v);
 
@@ -1322,13 +1992,15 @@ void MPM<3>::resample_optimized() {
             p.set_velocity(p.get_velocity() - delta_velocity);
             if (rigid_id != -1) {
               RigidBody<dim> *r = get_rigid_body_ptr(rigid_id);
-              r->apply_tmp_impulse(delta_velocity * p.get_mass(), p.pos);
+              impulses[rigid_id].add_impulse(delta_velocity * p.get_mass(),
+                                             p.pos - r->position);
             }
           }
         } 
 
       }  // particle loop end
     }
+    add_counter(plasticity_counter, block_plasticity);
   };
 
   auto block_op_normal = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
@@ -1337,6 +2009,7 @@ void MPM<3>::resample_optimized() {
     Cache grid_cache(*grid, block_offset, false);
     int particle_begin;
     int particle_end = block_meta[b].particle_offset;
+    uint64 block_plasticity = 0;
 
     real inv_delta_x = this->inv_delta_x;
 
@@ -1344,7 +2017,7 @@ void MPM<3>::resample_optimized() {
     // elements_per_block = 8 x 8 x 4 = 256
     for (uint32 t = 0; t < SparseMask::elements_per_block; t++) {
       particle_begin = particle_end;
-      particle_end += g[t].particle_count;
+      particle_end += get_particle_count(b, t, g[t]);
 
       int grid_cache_offset = grid_cache.spgrid_block_to_grid_cache_block(t);
 
@@ -1739,7 +2412,10 @@ void MPM<3>::resample_optimized() {
       // particle loop
       for (int k = particle_begin; k < particle_end; k++) {
         Particle &p = *allocator[particles[k]];
-        real delta_t = base_delta_t;
+        real delta_t = get_particle_delta_t(p, current_delta_t);
+        if (delta_t == 0.0_f) {
+          continue;
+        }
         Vector pos = p.pos * inv_delta_x;
 
 #if defined(MLSMPM)
@@ -1832,13 +2508,14 @@ void MPM<3>::resample_optimized() {
         Matrix &cdg = reinterpret_cast<Matrix &>(cdg_[0]);
 
         // added: Update granular fluidity and deformation gradient
-        p.plasticity(cdg, laplacian_gf);
+        block_plasticity += p.plasticity(cdg, laplacian_gf);
 
         // advect particles
         p.pos.v = _mm_fmadd_ps(v_, delta_t_vec, p.pos.v);
 
       }
     }
+    add_counter(plasticity_counter, block_plasticity);
   };
 
   for (auto &r : rigids) {
@@ -1846,6 +2523,9 @@ void MPM<3>::resample_optimized() {
   }
 
   auto block_op_switch = [&](uint32 b, uint64 block_offset, GridState<dim> *g) {
+    if (scheduler && !scheduler->is_block_active(b)) {
+      return;
+    }
     if (rigid_page_map->Test_Page(block_offset)) {
       block_op_rigid(b, block_offset, g);
     } else {
@@ -1853,7 +2533,16 @@ void MPM<3>::resample_optimized() {
     }
   };
 
-  parallel_for_each_block_with_index(block_op_switch, false, false);
+  reset_rigid_impulses();
+  if (scheduler) {
+    // One pass per step size, as NGF plasticity reads the material dt
+    scheduler->for_each_level([&] {
+      parallel_for_each_block_with_index(block_op_switch, false, false);
+    });
+  } else {
+    parallel_for_each_block_with_index(block_op_switch, false, false);
+  }
+  reduce_rigid_impulses();
 
   for (auto &r : rigids) {
     r->apply_tmp_velocity();
@@ -1879,5 +2568,104 @@ TC_TEST("mls_kernel") {
   }
 }
 
+TC_TEST("mls_kernel_2d") {
+  for (int t = 0; t < 10000; t++) {
+    Vector2 pos = Vector2::rand() + Vector2(0.5_f);
+    MPMKernel<2, 2> gt(pos, 1);
+    MLSMPMFastKernel2D fast(pos);
+    for (int i = 0; i < 3; i++) {
+      for (int j = 0; j < 3; j++) {
+        TC_CHECK_EQUAL(gt.get_w(Vector2i(i, j)), fast.kernels[i][j], 1e-6_f);
+      }
+    }
+  }
+}
+
+// The optimized 2D transfer must match the reference (per particle) transfer
+TC_TEST("optimized_transfer_2d") {
+  using Vector = Vector2;
+  constexpr int n = 2000;
+  const real delta_x = 1.0_f / 64;
+
+  Config config;
+  config.set("res", Vector2i(64));
+  config.set("delta_x", delta_x);
+  config.set("base_delta_t", 1e-4_f);
+  config.set("num_threads", 4);
+
+  Config particle_config;
+  particle_config.set("E", 1e4_f);
+  particle_config.set("nu", 0.3_f);
+
+  std::vector<Vector> positions, velocities;
+  std::vector<Matrix2> affine;
+  for (int i = 0; i < n; i++) {
+    positions.push_back(Vector(0.3_f) + Vector::rand() * 0.4_f);
+    velocities.push_back(Vector::rand() - Vector(0.5_f));
+    Matrix2 b(0.0_f);
+    b[0] = Vector::rand() - Vector(0.5_f);
+    b[1] = Vector::rand() - Vector(0.5_f);
+    affine.push_back(b);
+  }
+
+  MPM<2> reference, optimized;
+  for (auto mpm : {&reference, &optimized}) {
+    mpm->initialize(config);
+    for (int i = 0; i < n; i++) {
+      MPM<2>::ParticlePtr p_i;
+      MPMParticle<2> *p;
+      std::tie(p_i, p) = mpm->allocator.allocate_particle("jelly");
+      p->initialize(particle_config);
+      p->pos = positions[i];
+      p->vol = pow<2>(delta_x) * 0.25_f;
+      p->set_mass(p->vol * 400.0_f);
+      p->set_velocity(velocities[i]);
+      p->apic_b = affine[i];
+      mpm->particles.push_back(p_i);
+    }
+    mpm->sort_particles_and_populate_grid();
+  }
+
+  auto check_close = [](real a, real b) {
+    CHECK(a == Approx(b).epsilon(1e-4_f).margin(1e-5_f));
+  };
+
+  // P2G
+  real delta_t = reference.base_delta_t;
+  reference.rasterize(delta_t, true);
+  optimized.rasterize_optimized(delta_t);
+  real total_gf = 0;
+  for (auto &ind : reference.grid_region) {
+    auto &g_ref = reference.get_grid(ind);
+    auto &g_opt = optimized.get_grid(ind);
+    for (int k = 0; k < 3; k++) {
+      check_close(g_opt.velocity_and_mass[k], g_ref.velocity_and_mass[k]);
+    }
+    total_gf += g_opt.granular_fluidity;
+  }
+  // Quadratic weights are a partition of unity and each particle has gf = 1
+  CHECK(total_gf == Approx(n).epsilon(1e-4_f));
+
+  // G2P
+  for (auto mpm : {&reference, &optimized}) {
+    mpm->normalize_grid_and_apply_external_force(Vector(0.0_f));
+  }
+  reference.resample();
+  optimized.resample_optimized();
+  for (int i = 0; i < n; i++) {
+    auto &p_ref = *reference.allocator[reference.particles[i]];
+    auto &p_opt = *optimized.allocator[optimized.particles[i]];
+    CHECK(p_ref.id == p_opt.id);
+    for (int k = 0; k < 2; k++) {
+      check_close(p_opt.pos[k], p_ref.pos[k]);
+      check_close(p_opt.get_velocity()[k], p_ref.get_velocity()[k]);
+      for (int l = 0; l < 2; l++) {
+        check_close(p_opt.apic_b[k][l], p_ref.apic_b[k][l]);
+        check_close(p_opt.dg_e[k][l], p_ref.dg_e[k][l]);
+      }
+    }
+  }
+}
+
 TC_NAMESPACE_END
 #endif